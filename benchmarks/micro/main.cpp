@@ -0,0 +1,453 @@
+/*
+
+RPNlib
+
+Host microbenchmarks
+
+Copyright (C) 2018-2019 by Xose Pérez <xose dot perez at gmail dot com>
+
+The rpnlib library is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+The rpnlib library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with the rpnlib library.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "rpnlib.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+// -----------------------------------------------------------------------------
+// Results
+// -----------------------------------------------------------------------------
+
+struct bench_result {
+    std::string group;
+    std::string name;
+    unsigned long iterations;
+    unsigned long tokens;
+    double ns;
+};
+
+std::vector<bench_result> results;
+unsigned long iterations = 200000;
+
+double now_ns() {
+    return std::chrono::duration<double, std::nano>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+void report(const char * group, const std::string & name, unsigned long tokens, double ns, unsigned long count = iterations) {
+    results.push_back({group, name, count, tokens, ns});
+}
+
+void print_csv() {
+    printf("group,name,iterations,tokens,ns_per_iteration,ns_per_token\n");
+    for (auto & r : results) {
+        double per_iteration = r.ns / r.iterations;
+        printf("%s,%s,%lu,%lu,%.2f,%.2f\n",
+            r.group.c_str(), r.name.c_str(), r.iterations, r.tokens,
+            per_iteration, per_iteration / r.tokens
+        );
+    }
+}
+
+void print_json() {
+    printf("{\n  \"benchmarks\": [\n");
+    for (size_t i=0; i<results.size(); i++) {
+        auto & r = results[i];
+        double per_iteration = r.ns / r.iterations;
+        printf("    {\"group\": \"%s\", \"name\": \"%s\", \"iterations\": %lu, \"tokens\": %lu, "
+            "\"ns_per_iteration\": %.2f, \"ns_per_token\": %.2f}%s\n",
+            r.group.c_str(), r.name.c_str(), r.iterations, r.tokens,
+            per_iteration, per_iteration / r.tokens,
+            (i + 1 < results.size()) ? "," : ""
+        );
+    }
+    printf("  ]\n}\n");
+}
+
+// -----------------------------------------------------------------------------
+// Benchmarks
+// -----------------------------------------------------------------------------
+
+// Runs the expression repeatedly, clearing the stack after every run
+void bench_process(rpn_context & ctxt, const char * group, const char * name, const char * expression, bool variable_must_exist = false) {
+
+    unsigned long tokens = 0;
+    for (const char * p = expression; *p; p++) {
+        if ((*p != ' ') && ((p == expression) || (*(p-1) == ' '))) tokens++;
+    }
+
+    double start = now_ns();
+    for (unsigned long i=0; i<iterations; i++) {
+        rpn_process(ctxt, expression, variable_must_exist);
+        rpn_stack_clear(ctxt);
+    }
+    report(group, name, tokens, now_ns() - start);
+
+}
+
+// Same as above but compiling the expression once
+void bench_program(rpn_context & ctxt, const char * group, const char * name, const char * expression, bool variable_must_exist = false) {
+
+    unsigned long tokens = 0;
+    for (const char * p = expression; *p; p++) {
+        if ((*p != ' ') && ((p == expression) || (*(p-1) == ' '))) tokens++;
+    }
+
+    rpn_program program;
+    rpn_compile(ctxt, expression, program, variable_must_exist);
+
+    double start = now_ns();
+    for (unsigned long i=0; i<iterations; i++) {
+        rpn_execute(ctxt, program);
+        rpn_stack_clear(ctxt);
+    }
+    report(group, name, tokens, now_ns() - start);
+
+}
+
+void bench_tokens(rpn_context & ctxt) {
+
+    bench_process(ctxt, "parse", "number",
+        "1 2.5 -3 +4 5.25 6 7 8.125 9 10 -11.5 12 13 14 15.75 16");
+
+    // "pi" is the first operator registered, "nop" the last one
+    rpn_operator_set(ctxt, "nop", 0, [](rpn_context &) { return true; });
+    bench_process(ctxt, "lookup", "operator_first",
+        "pi pi pi pi pi pi pi pi pi pi pi pi pi pi pi pi");
+    bench_process(ctxt, "lookup", "operator_last",
+        "nop nop nop nop nop nop nop nop nop nop nop nop nop nop nop nop");
+
+    char name[8];
+    for (unsigned char i=0; i<16; i++) {
+        snprintf(name, sizeof(name), "v%u", i);
+        rpn_variable_set(ctxt, name, i);
+    }
+    bench_process(ctxt, "lookup", "variable",
+        "$v0 $v1 $v2 $v3 $v4 $v5 $v6 $v7 $v8 $v9 $v10 $v11 $v12 $v13 $v14 $v15", true);
+
+    // Same lookups with 20000 variables around
+    char many[16];
+    for (unsigned int i=16; i<20000; i++) {
+        snprintf(many, sizeof(many), "v%u", i);
+        rpn_variable_set(ctxt, many, i);
+    }
+    bench_process(ctxt, "lookup", "variable_20k",
+        "$v0 $v1 $v2 $v3 $v4 $v5 $v6 $v7 $v19992 $v19993 $v19994 $v19995 $v19996 $v19997 $v19998 $v19999", true);
+    rpn_variables_clear(ctxt);
+
+}
+
+// Calls every builtin callback directly. The builtin group has the time
+// per call including pushing its arguments, builtin_net the same minus the
+// time taken to push them alone. Within noise, that can be below 0.
+void bench_builtins(rpn_context & ctxt) {
+
+    for (auto & f : ctxt.operators) {
+
+        std::vector<float> args;
+        if (strcmp(f.name, "index") == 0) {
+            args = {2, 10, 20, 30, 3};
+        } else {
+            const float defaults[] = {7, 3, 2, 1.5, 0.5};
+            for (unsigned char i=0; i<f.argc; i++) args.push_back(defaults[i]);
+        }
+
+        double start = now_ns();
+        for (unsigned long i=0; i<iterations; i++) {
+            for (auto value : args) rpn_stack_push(ctxt, value);
+            rpn_stack_clear(ctxt);
+        }
+        double baseline = now_ns() - start;
+
+        start = now_ns();
+        for (unsigned long i=0; i<iterations; i++) {
+            for (auto value : args) rpn_stack_push(ctxt, value);
+            (f.callback)(ctxt);
+            rpn_stack_clear(ctxt);
+        }
+        double elapsed = now_ns() - start;
+
+        report("builtin", f.name, 1, elapsed);
+        report("builtin_net", f.name, 1, elapsed - baseline);
+
+    }
+
+    rpn_error = RPN_ERROR_OK;
+
+}
+
+// Expressions from the examples folder, time functions are emulated
+void bench_examples(rpn_context & ctxt) {
+
+    bench_process(ctxt, "example", "basic", "5 dup *");
+    bench_program(ctxt, "compiled", "basic", "5 dup *");
+
+    rpn_variable_set(ctxt, "temperature", 22);
+    rpn_variable_set(ctxt, "relay", 1);
+    bench_process(ctxt, "example", "debug", "$temperature 18 21 cmp3 1 + 1 $relay 0 3 index", true);
+    bench_program(ctxt, "compiled", "debug", "$temperature 18 21 cmp3 1 + 1 $relay 0 3 index", true);
+
+    rpn_operator_set(ctxt, "now", 0, [](rpn_context & ctxt) {
+        rpn_stack_push(ctxt, 1545844104);
+        return true;
+    });
+    rpn_operator_set(ctxt, "dow", 1, [](rpn_context & ctxt) {
+        float a;
+        rpn_stack_pop(ctxt, a);
+        time_t t = a;
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        rpn_stack_push(ctxt, (tm.tm_wday + 6) % 7);
+        return true;
+    });
+    rpn_operator_set(ctxt, "hour", 1, [](rpn_context & ctxt) {
+        float a;
+        rpn_stack_pop(ctxt, a);
+        rpn_stack_push(ctxt, ((unsigned long) a / 3600) % 24);
+        return true;
+    });
+    rpn_operator_set(ctxt, "minute", 1, [](rpn_context & ctxt) {
+        float a;
+        rpn_stack_pop(ctxt, a);
+        rpn_stack_push(ctxt, ((unsigned long) a / 60) % 60);
+        return true;
+    });
+    bench_process(ctxt, "example", "time", "now dup dup dow rot hour rot minute");
+    bench_program(ctxt, "compiled", "time", "now dup dup dow rot hour rot minute");
+
+}
+
+// Per request evaluation, a fresh context every time against a pooled one
+void bench_requests() {
+
+    const char * expression = "$input 18 21 cmp3 1 +";
+
+    double start = now_ns();
+    for (unsigned long i=0; i<iterations; i++) {
+        rpn_context ctxt;
+        rpn_init(ctxt);
+        rpn_variable_set(ctxt, "input", i);
+        rpn_process(ctxt, expression);
+        rpn_clear(ctxt);
+    }
+    report("request", "init_clear", 5, now_ns() - start);
+
+    rpn_pool pool;
+    rpn_pool_init(pool, 1);
+    start = now_ns();
+    for (unsigned long i=0; i<iterations; i++) {
+        rpn_context * ctxt = rpn_pool_acquire(pool);
+        rpn_variable_set(*ctxt, "input", i);
+        rpn_process(*ctxt, expression);
+        rpn_pool_release(pool, ctxt);
+    }
+    report("request", "pool", 5, now_ns() - start);
+    rpn_pool_clear(pool);
+
+    // What if scenarios forked from a shared context
+    rpn_context parent;
+    rpn_init(parent);
+    rpn_variable_set(parent, "input", 0);
+    start = now_ns();
+    for (unsigned long i=0; i<iterations; i++) {
+        rpn_context fork;
+        rpn_fork(parent, fork);
+        rpn_variable_set(fork, "input", i);
+        rpn_process(fork, expression);
+        rpn_clear(fork);
+    }
+    report("request", "fork", 5, now_ns() - start);
+    rpn_clear(parent);
+
+}
+
+// A frame of readings written into a context holding 1000 variables
+void bench_updates() {
+
+    const size_t size = 16;
+    char names[size][16];
+    const char * frame[size];
+    float values[size];
+    rpn_variable_handle handles[size];
+
+    rpn_context ctxt;
+    rpn_init(ctxt);
+    for (unsigned int i=0; i<1000; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "sensor%u", i);
+        rpn_variable_set(ctxt, name, 0);
+    }
+    for (size_t i=0; i<size; i++) {
+        snprintf(names[i], sizeof(names[i]), "sensor%u", (unsigned int) (i * 61));
+        frame[i] = names[i];
+        values[i] = i;
+        rpn_variable_resolve(ctxt, frame[i], handles[i]);
+    }
+
+    double start = now_ns();
+    for (unsigned long i=0; i<iterations; i++) {
+        for (size_t j=0; j<size; j++) rpn_variable_set(ctxt, frame[j], values[j]);
+    }
+    report("update", "set", size, now_ns() - start);
+
+    start = now_ns();
+    for (unsigned long i=0; i<iterations; i++) {
+        rpn_variables_set_many(ctxt, frame, values, size);
+    }
+    report("update", "set_many", size, now_ns() - start);
+
+    start = now_ns();
+    for (unsigned long i=0; i<iterations; i++) {
+        rpn_variables_set_many(ctxt, handles, values, size);
+    }
+    report("update", "set_many_handles", size, now_ns() - start);
+
+    rpn_clear(ctxt);
+
+}
+
+// Whole rule set evaluated at once, with 1, 2, 4... workers up to one per core
+void bench_parallel() {
+
+    const size_t size = 1024;
+    std::string text;
+    for (size_t i=0; i<size; i++) {
+        char rule[64];
+        snprintf(rule, sizeof(rule), "$s%u 18 21 cmp3 1 + 1 0 0 3 index\n", (unsigned int) (i % 100));
+        text += rule;
+    }
+
+    rpn_context ctxt;
+    rpn_init(ctxt);
+    for (unsigned int i=0; i<100; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "s%u", i);
+        rpn_variable_set(ctxt, name, i % 40);
+    }
+    rpn_ruleset ruleset;
+    rpn_ruleset_compile(ctxt, ruleset, text.c_str(), text.size(), true);
+    std::vector<float> values(size);
+
+    unsigned long runs = iterations / 100 ? iterations / 100 : 1;
+    size_t cores = std::thread::hardware_concurrency();
+    std::vector<size_t> counts;
+    for (size_t workers = 1; workers < cores; workers *= 2) counts.push_back(workers);
+    counts.push_back(cores ? cores : 1);
+
+    for (auto workers : counts) {
+        rpn_executor executor;
+        rpn_executor_init(executor, ctxt, workers);
+        double start = now_ns();
+        for (unsigned long i=0; i<runs; i++) {
+            rpn_executor_run(executor, ruleset, values.data());
+        }
+        report("parallel", "workers_" + std::to_string(workers), size, now_ns() - start, runs);
+        rpn_executor_clear(executor);
+    }
+
+    rpn_ruleset_clear(ruleset);
+    rpn_clear(ctxt);
+
+}
+
+// Submitting alone (a batch at a time, so the queue never fills up)
+// and the round trip to a background evaluator
+void bench_queue() {
+
+    rpn_context ctxt;
+    rpn_init(ctxt);
+    rpn_variable_set(ctxt, "input", 0);
+    rpn_program program;
+    rpn_compile(ctxt, "$input 18 21 cmp3 1 +", program);
+
+    rpn_queue queue;
+    rpn_queue_init(queue, ctxt, 1024);
+    const size_t size = 256;
+    std::vector<rpn_request> requests(size);
+    for (auto & request : requests) request.program = &program;
+
+    double submit = 0;
+    unsigned long batches = iterations / size ? iterations / size : 1;
+    for (unsigned long i=0; i<batches; i++) {
+        double start = now_ns();
+        for (auto & request : requests) rpn_queue_submit(queue, request);
+        submit += now_ns() - start;
+        for (auto & request : requests) rpn_request_wait(request);
+    }
+    report("queue", "submit", 1, submit, batches * size);
+
+    double start = now_ns();
+    for (unsigned long i=0; i<iterations; i++) {
+        rpn_queue_submit(queue, requests[0]);
+        rpn_request_wait(requests[0]);
+    }
+    report("queue", "round_trip", 5, now_ns() - start);
+
+    rpn_queue_clear(queue);
+    rpn_clear(ctxt);
+
+}
+
+// -----------------------------------------------------------------------------
+// Main
+// -----------------------------------------------------------------------------
+
+void usage(const char * name) {
+    printf("Usage: %s [--json] [--iterations N]\n", name);
+}
+
+int main(int argc, char ** argv) {
+
+    bool json = false;
+    for (int i=1; i<argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else if ((strcmp(argv[i], "--iterations") == 0) && (i+1 < argc)) {
+            iterations = strtoul(argv[++i], NULL, 10);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (0 == iterations) iterations = 1;
+
+    rpn_context ctxt;
+    rpn_init(ctxt);
+    bench_builtins(ctxt);
+    bench_tokens(ctxt);
+    bench_examples(ctxt);
+    rpn_clear(ctxt);
+    bench_updates();
+    bench_requests();
+    bench_parallel();
+    bench_queue();
+
+    if (json) {
+        print_json();
+    } else {
+        print_csv();
+    }
+
+    return 0;
+
+}
@@ -0,0 +1,340 @@
+/*
+
+RPNlib
+
+Rule engine scale benchmark
+
+Copyright (C) 2018-2019 by Xose Pérez <xose dot perez at gmail dot com>
+
+The rpnlib library is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+The rpnlib library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with the rpnlib library.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// Generates N sensor variables and M rules from a configurable mix of
+// hysteresis, scaling (map / constrain) and math-heavy rules, then drives
+// them with a synthetic stream of sensor updates. Every update re-evaluates
+// the rules that read the updated sensor.
+
+#include "rpnlib.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+// -----------------------------------------------------------------------------
+// Heap tracking (glibc only)
+// -----------------------------------------------------------------------------
+
+size_t heap_current = 0;
+size_t heap_peak = 0;
+
+#ifdef __GLIBC__
+
+#include <malloc.h>
+
+extern "C" {
+
+void * __libc_malloc(size_t);
+void * __libc_calloc(size_t, size_t);
+void * __libc_realloc(void *, size_t);
+void __libc_free(void *);
+
+void heap_add(void * ptr) {
+    if (!ptr) return;
+    heap_current += malloc_usable_size(ptr);
+    if (heap_current > heap_peak) heap_peak = heap_current;
+}
+
+void heap_remove(void * ptr) {
+    if (!ptr) return;
+    heap_current -= malloc_usable_size(ptr);
+}
+
+void * malloc(size_t size) {
+    void * ptr = __libc_malloc(size);
+    heap_add(ptr);
+    return ptr;
+}
+
+void * calloc(size_t count, size_t size) {
+    void * ptr = __libc_calloc(count, size);
+    heap_add(ptr);
+    return ptr;
+}
+
+void * realloc(void * ptr, size_t size) {
+    heap_remove(ptr);
+    ptr = __libc_realloc(ptr, size);
+    heap_add(ptr);
+    return ptr;
+}
+
+void free(void * ptr) {
+    heap_remove(ptr);
+    __libc_free(ptr);
+}
+
+}
+
+#endif
+
+// -----------------------------------------------------------------------------
+// Configuration
+// -----------------------------------------------------------------------------
+
+unsigned long variables = 100;
+unsigned long rules = 1000;
+unsigned long updates = 100000;
+unsigned long seed = 1;
+unsigned long mix[3] = {50, 30, 20};
+bool json = false;
+
+const char * mix_names[3] = {"hysteresis", "scaling", "math"};
+
+// -----------------------------------------------------------------------------
+// Scenario
+// -----------------------------------------------------------------------------
+
+struct rule {
+    std::string expression;
+    unsigned char kind;
+};
+
+std::vector<rule> rule_list;
+std::vector<std::vector<unsigned long>> dependants;
+
+void add_rule(unsigned char kind, std::vector<unsigned long> sensors, const char * format, ...) {
+
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+
+    unsigned long index = rule_list.size();
+    rule_list.push_back({buffer, kind});
+    std::sort(sensors.begin(), sensors.end());
+    sensors.erase(std::unique(sensors.begin(), sensors.end()), sensors.end());
+    for (auto sensor : sensors) dependants[sensor].push_back(index);
+
+}
+
+void generate(std::mt19937 & random) {
+
+    std::uniform_int_distribution<unsigned long> sensor(0, variables - 1);
+    std::uniform_int_distribution<unsigned long> kind(0, mix[0] + mix[1] + mix[2] - 1);
+    std::uniform_int_distribution<int> threshold(10, 30);
+
+    dependants.resize(variables);
+
+    for (unsigned long i=0; i<rules; i++) {
+
+        unsigned long k = kind(random);
+        unsigned long a = sensor(random);
+
+        if (k < mix[0]) {
+
+            // Hysteresis, as in examples/debug
+            int low = threshold(random);
+            add_rule(0, {a}, "$s%lu %d %d cmp3 1 + 1 $r%lu 0 3 index", a, low, low + 3, i);
+
+        } else if (k < mix[0] + mix[1]) {
+
+            // Scaling
+            add_rule(1, {a}, "$s%lu 0 50 0 1024 map 100 900 constrain", a);
+
+        } else {
+
+            // Math-heavy
+            unsigned long b = sensor(random);
+            unsigned long c = sensor(random);
+            #ifdef RPNLIB_ADVANCED_MATH
+                add_rule(2, {a, b, c}, "$s%lu $s%lu - abs $s%lu 2 pow + sqrt 1 + log 10 * 3 round", a, b, c);
+            #else
+                add_rule(2, {a, b, c}, "$s%lu $s%lu - abs $s%lu dup * + 10 * 7 mod 3 round", a, b, c);
+            #endif
+
+        }
+
+    }
+
+}
+
+// -----------------------------------------------------------------------------
+// Reporting
+// -----------------------------------------------------------------------------
+
+double percentile(std::vector<double> & sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t index = p * (sorted.size() - 1);
+    return sorted[index];
+}
+
+void report(double elapsed_ns, std::vector<double> & latencies, size_t heap_setup, size_t heap_run, const rpn_memory & memory, unsigned long errors) {
+
+    std::sort(latencies.begin(), latencies.end());
+    double evaluations = latencies.size();
+    double p50 = percentile(latencies, 0.50);
+    double p99 = percentile(latencies, 0.99);
+    double p999 = percentile(latencies, 0.999);
+    double max = latencies.empty() ? 0 : latencies.back();
+
+    if (json) {
+        printf("{\n");
+        printf("  \"variables\": %lu,\n  \"rules\": %lu,\n  \"updates\": %lu,\n  \"seed\": %lu,\n", variables, rules, updates, seed);
+        printf("  \"mix\": {\"%s\": %lu, \"%s\": %lu, \"%s\": %lu},\n", mix_names[0], mix[0], mix_names[1], mix[1], mix_names[2], mix[2]);
+        printf("  \"evaluations\": %.0f,\n  \"errors\": %lu,\n", evaluations, errors);
+        printf("  \"updates_per_second\": %.1f,\n", updates / (elapsed_ns / 1e9));
+        printf("  \"evaluations_per_second\": %.1f,\n", evaluations / (elapsed_ns / 1e9));
+        printf("  \"latency_ns\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f},\n", p50, p99, p999, max);
+        printf("  \"heap_bytes\": {\"setup\": %zu, \"peak\": %zu},\n", heap_setup, heap_run);
+        printf("  \"context_bytes\": {\"live\": %zu, \"peak\": %zu, \"stack\": %zu, \"variables\": %zu, \"operators\": %zu, \"names\": %zu}\n",
+            memory.bytes, memory.peak, memory.stack.bytes, memory.variables.bytes, memory.operators.bytes, memory.names.bytes);
+        printf("}\n");
+    } else {
+        printf("variables            %lu\n", variables);
+        printf("rules                %lu (%s %lu%%, %s %lu%%, %s %lu%%)\n", rules,
+            mix_names[0], mix[0], mix_names[1], mix[1], mix_names[2], mix[2]);
+        printf("updates              %lu\n", updates);
+        printf("evaluations          %.0f (%lu errors)\n", evaluations, errors);
+        printf("updates/s            %.1f\n", updates / (elapsed_ns / 1e9));
+        printf("evaluations/s        %.1f\n", evaluations / (elapsed_ns / 1e9));
+        printf("latency p50          %.1f ns\n", p50);
+        printf("latency p99          %.1f ns\n", p99);
+        printf("latency p999         %.1f ns\n", p999);
+        printf("latency max          %.1f ns\n", max);
+        printf("heap after setup     %zu bytes\n", heap_setup);
+        printf("heap peak            %zu bytes\n", heap_run);
+        printf("context memory       %zu bytes (peak %zu)\n", memory.bytes, memory.peak);
+        printf("  stack              %zu bytes (%zu of %zu values)\n", memory.stack.bytes, memory.stack.size, memory.stack.capacity);
+        printf("  variables          %zu bytes (%zu of %zu)\n", memory.variables.bytes, memory.variables.size, memory.variables.capacity);
+        printf("  operators          %zu bytes (%zu of %zu)\n", memory.operators.bytes, memory.operators.size, memory.operators.capacity);
+        printf("  names              %zu bytes (%zu names)\n", memory.names.bytes, memory.names.size);
+    }
+
+}
+
+// -----------------------------------------------------------------------------
+// Main
+// -----------------------------------------------------------------------------
+
+void usage(const char * name) {
+    printf("Usage: %s [--variables N] [--rules M] [--updates U] [--mix H,S,M] [--seed S] [--json]\n", name);
+}
+
+int main(int argc, char ** argv) {
+
+    for (int i=1; i<argc; i++) {
+        bool value = (i+1 < argc);
+        if (strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else if (value && (strcmp(argv[i], "--variables") == 0)) {
+            variables = strtoul(argv[++i], NULL, 10);
+        } else if (value && (strcmp(argv[i], "--rules") == 0)) {
+            rules = strtoul(argv[++i], NULL, 10);
+        } else if (value && (strcmp(argv[i], "--updates") == 0)) {
+            updates = strtoul(argv[++i], NULL, 10);
+        } else if (value && (strcmp(argv[i], "--seed") == 0)) {
+            seed = strtoul(argv[++i], NULL, 10);
+        } else if (value && (strcmp(argv[i], "--mix") == 0)) {
+            if (3 != sscanf(argv[++i], "%lu,%lu,%lu", &mix[0], &mix[1], &mix[2])) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if ((0 == variables) || (0 == mix[0] + mix[1] + mix[2])) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::mt19937 random(seed);
+    generate(random);
+
+    // Updates are generated upfront so the feed does not show in the timings
+    std::normal_distribution<float> step(0, 0.5);
+    std::uniform_int_distribution<unsigned long> sensor(0, variables - 1);
+    std::vector<float> values(variables, 20);
+    std::vector<std::pair<unsigned long, float>> feed;
+    feed.reserve(updates);
+    for (unsigned long i=0; i<updates; i++) {
+        unsigned long s = sensor(random);
+        values[s] = std::max(0.0f, std::min(50.0f, values[s] + step(random)));
+        feed.push_back({s, values[s]});
+    }
+
+    unsigned long evaluations = 0;
+    for (auto & update : feed) evaluations += dependants[update.first].size();
+    std::vector<double> latencies;
+    latencies.reserve(evaluations);
+
+    // Setup the context
+    size_t heap_before = heap_current;
+    rpn_context ctxt;
+    rpn_init(ctxt);
+    char name[22];                          // prefix, up to 20 digits of an unsigned long and the null
+    for (unsigned long i=0; i<variables; i++) {
+        snprintf(name, sizeof(name), "s%lu", i);
+        rpn_variable_set(ctxt, name, 20);
+    }
+    for (unsigned long i=0; i<rule_list.size(); i++) {
+        snprintf(name, sizeof(name), "r%lu", i);
+        if (0 == rule_list[i].kind) rpn_variable_set(ctxt, name, 0);
+    }
+    size_t heap_setup = heap_current - heap_before;
+
+    // Run
+    heap_peak = heap_current;
+    unsigned long errors = 0;
+    float result;
+    auto start = std::chrono::steady_clock::now();
+    for (auto & update : feed) {
+        snprintf(name, sizeof(name), "s%lu", update.first);
+        rpn_variable_set(ctxt, name, update.second);
+        for (auto index : dependants[update.first]) {
+            auto rule_start = std::chrono::steady_clock::now();
+            bool ok = rpn_process(ctxt, rule_list[index].expression.c_str(), true);
+            ok = ok && rpn_stack_pop(ctxt, result);
+            rpn_stack_clear(ctxt);
+            latencies.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - rule_start).count());
+            if (!ok) {
+                errors++;
+            } else if (0 == rule_list[index].kind) {
+                snprintf(name, sizeof(name), "r%lu", index);
+                rpn_variable_set(ctxt, name, result);
+            }
+        }
+    }
+    double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    size_t heap_run = heap_peak - heap_before;
+
+    rpn_memory memory;
+    rpn_memory_get(ctxt, memory);
+    rpn_clear(ctxt);
+
+    report(elapsed, latencies, heap_setup, heap_run, memory, errors);
+
+    return 0;
+
+}
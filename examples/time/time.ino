@@ -26,11 +26,10 @@ along with the rpnlib library.  If not, see <http://www.gnu.org/licenses/>.
 #include <Time.h>
 
 void dump_stack(rpn_context & ctxt) {
-    float value;
-    unsigned char index = rpn_stack_size(ctxt)-1;
+    rpn_stack_span stack = rpn_stack_view(ctxt);
     Serial.printf("Stack\n--------------------\n");
-    while (rpn_stack_get(ctxt, index, value)) {
-        Serial.printf("[%02d] %.2f\n", index--, value);
+    for (size_t i=0; i<stack.size; i++) {
+        Serial.printf("[%02u] %.2f\n", (unsigned int) (stack.size - i - 1), stack[i]);
     }
     Serial.println();
 }
@@ -0,0 +1,81 @@
+/*
+
+RPNlib
+
+Trace example
+
+Copyright (C) 2018-2019 by Xose Pérez <xose dot perez at gmail dot com>
+
+The rpnlib library is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+The rpnlib library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with the rpnlib library.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// This example requires the RPNLIB_TRACE build flag (see platformio.ini)
+
+#include <Arduino.h>
+#include "rpnlib.h"
+
+// Events are stored in binary form while processing and printed afterwards
+rpn_trace_buffer trace;
+
+void dump_trace(rpn_context & ctxt) {
+    char line[80];
+    rpn_trace_event event;
+    rpn_trace_event first;
+    unsigned int index = 0;
+    rpn_trace_get(trace, 0, first);
+    Serial.printf("Trace\n--------------------\n");
+    while (rpn_trace_get(trace, index++, event)) {
+        rpn_trace_format(ctxt, event, first.timestamp, line, sizeof(line));
+        Serial.println(line);
+    }
+    Serial.println();
+}
+
+void setup() {
+    
+    // Init serial communication with the computer
+    Serial.begin(115200);
+    delay(2000);
+    Serial.println();
+    Serial.println();
+    
+    // Create context
+    rpn_context ctxt;
+    
+    // Initialize context
+    rpn_init(ctxt);
+
+    // Start tracing into the buffer
+    rpn_trace(ctxt, &trace);
+
+    // Load variables
+    rpn_variable_set(ctxt, "temperature", 22);
+    rpn_variable_set(ctxt, "relay", 1);
+
+    // Process command
+    rpn_process(ctxt, "$temperature 18 21 cmp3 1 + 1 $relay 0 3 index", true);
+    
+    // Show what happened
+    dump_trace(ctxt);
+
+    // Clear the context and free resources
+    rpn_trace(ctxt, NULL);
+    rpn_clear(ctxt);
+
+}
+
+void loop() {
+    delay(1);
+}
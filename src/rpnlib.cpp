@@ -20,29 +20,37 @@ along with the rpnlib library.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "rpnlib.h"
+#include "rpnlib_internal.h"
 #include "rpnlib_operators.cpp"
 
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
 
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include <time.h>
+#endif
+
+#include <stdio.h>
+
 // ----------------------------------------------------------------------------
 // Globals
 // ----------------------------------------------------------------------------
 
-rpn_errors rpn_error = RPN_ERROR_OK;
+RPNLIB_THREAD_LOCAL rpn_errors rpn_error = RPN_ERROR_OK;
 void(*_rpn_debug_callback)(rpn_context &, char *) = NULL;
 
 // ----------------------------------------------------------------------------
 // Utils
 // ----------------------------------------------------------------------------
 
-bool _rpn_is_number(const char * s) {
-    unsigned char len = strlen(s);
+bool _rpn_is_number(const char * s, unsigned int len) {
     if (0 == len) return false;
     bool decimal = false;
     bool digit = false;
-    for (unsigned char i=0; i<len; i++) {
+    for (unsigned int i=0; i<len; i++) {
         if (('-' == s[i]) || ('+' == s[i])) {
             if (i>0) return false;
         } else if (s[i] == '.') {
@@ -58,11 +66,72 @@ bool _rpn_is_number(const char * s) {
     return digit;
 }
 
+// Control flow words (and those defining words) take precedence
+// over operators with the same name
+unsigned char _rpn_keyword(const char * s, unsigned int len) {
+    static const char * const keywords[] = {"if", "else", "then", "do", "loop", ":", ";"};
+    if (len > 4) return RPN_KEYWORD_NONE;
+    for (unsigned char i=0; i<sizeof(keywords) / sizeof(keywords[0]); i++) {
+        if ((strlen(keywords[i]) == len) && (strncmp(keywords[i], s, len) == 0)) return RPN_KEYWORD_IF + i;
+    }
+    return RPN_KEYWORD_NONE;
+}
+
+// Cycle counter on the ESP, nanoseconds on the host
+unsigned long _rpn_ticks() {
+    #ifdef ARDUINO
+        return ESP.getCycleCount();
+    #else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (unsigned long) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+    #endif
+}
+
+unsigned long long _rpn_ticks_to_ns(unsigned long long ticks) {
+    #ifdef ARDUINO
+        return ticks * 1000 / ESP.getCpuFreqMHz();
+    #else
+        return ticks;
+    #endif
+}
+
+unsigned long _rpn_us_to_ticks(unsigned long us) {
+    #ifdef ARDUINO
+        return us * ESP.getCpuFreqMHz();
+    #else
+        return us * 1000;
+    #endif
+}
+
+// ----------------------------------------------------------------------------
+// Context
+// ----------------------------------------------------------------------------
+
+rpn_context::rpn_context(rpn_allocator & allocator) {
+    stack.set_allocator(&allocator);
+    variables.set_allocator(&allocator);
+    index.set_allocator(&allocator);
+    providers.set_allocator(&allocator);
+    provided.set_allocator(&allocator);
+    provided_names.set_allocator(&allocator);
+    overrides.set_allocator(&allocator);
+    operators.set_allocator(&allocator);
+    profile.set_allocator(&allocator);
+    words.set_allocator(&allocator);
+    word_code.set_allocator(&allocator);
+    word_bindings.set_allocator(&allocator);
+    values.set_allocator(&allocator);
+    symbols.chunks.set_allocator(&allocator);
+    symbols.names.set_allocator(&allocator);
+    symbols.table.set_allocator(&allocator);
+}
+
 // ----------------------------------------------------------------------------
 // Stack methods
 // ----------------------------------------------------------------------------
 
-unsigned char rpn_stack_size(rpn_context & ctxt) {
+size_t rpn_stack_size(rpn_context & ctxt) {
     return ctxt.stack.size();
 }
 
@@ -72,7 +141,12 @@ bool rpn_stack_clear(rpn_context & ctxt) {
 }
 
 bool rpn_stack_push(rpn_context & ctxt, float value) {
-    ctxt.stack.push_back(value);
+    size_t capacity = ctxt.stack.capacity();
+    if (!ctxt.stack.push_back(value)) {
+        rpn_error = RPN_ERROR_OUT_OF_MEMORY;
+        return false;
+    }
+    if (capacity != ctxt.stack.capacity()) _rpn_memory_update(ctxt);
     return true;
 }
 
@@ -83,140 +157,533 @@ bool rpn_stack_pop(rpn_context & ctxt, float & value) {
     return true;
 }
 
-bool rpn_stack_get(rpn_context & ctxt, unsigned char index, float & value) {
-    unsigned char size = ctxt.stack.size();
+// Index 0 is the top of the stack
+bool rpn_stack_get(rpn_context & ctxt, size_t index, float & value) {
+    size_t size = ctxt.stack.size();
     if (index >= size) return false;
     value = ctxt.stack[size-index-1];
     return true;
 }
 
+rpn_stack_span rpn_stack_view(rpn_context & ctxt) {
+    return {ctxt.stack.data(), ctxt.stack.size()};
+}
+
+// Values are pushed in order, the last one ends on top. Either all of
+// them are pushed or none is.
+bool rpn_stack_push_many(rpn_context & ctxt, const float values[], size_t count) {
+    size_t capacity = ctxt.stack.capacity();
+    if (!ctxt.stack.append(values, count)) {
+        rpn_error = RPN_ERROR_OUT_OF_MEMORY;
+        return false;
+    }
+    if (capacity != ctxt.stack.capacity()) _rpn_memory_update(ctxt);
+    return true;
+}
+
+// Opposite of rpn_stack_push_many, the top ends up last
+bool rpn_stack_pop_many(rpn_context & ctxt, float values[], size_t count) {
+    if (!count) return true;
+    size_t size = ctxt.stack.size();
+    if (count > size) return false;
+    memcpy(values, ctxt.stack.data() + size - count, count * sizeof(float));
+    ctxt.stack.resize(size - count);
+    return true;
+}
+
 // ----------------------------------------------------------------------------
 // Functions methods
 // ----------------------------------------------------------------------------
 
-bool rpn_operator_set(rpn_context & ctxt, const char * name, unsigned char argc, bool (*callback)(rpn_context &)) {
+// Control flow words (and the ones defining words) are looked up before
+// operators, an operator with one of those names could never be called
+bool rpn_operator_set(rpn_context & ctxt, const char * name, unsigned char argc, bool (*callback)(rpn_context &), unsigned char results) {
+    if (RPN_KEYWORD_NONE != _rpn_keyword(name, strlen(name))) {
+        rpn_error = RPN_ERROR_UNVALID_ARGUMENT;
+        return false;
+    }
+    _rpn_spin_lock lock(_rpn_root(ctxt).writer);
+    unsigned int symbol = RPN_SYMBOL_NONE;
+    if (!ctxt.operators.full()) symbol = _rpn_symbol_intern(ctxt, name, strlen(name));
     rpn_operator f;
-    f.name = strdup(name);
-    f.argc = argc;
-    f.callback = callback;
-    ctxt.operators.push_back(f);
-    return true;
+    if (RPN_SYMBOL_NONE != symbol) {
+        f.name = _rpn_symbol_name(ctxt, symbol);
+        f.symbol = symbol;
+        f.argc = argc;
+        f.results = results;
+        f.pure = false;
+        f.callback = callback;
+        if (ctxt.operators.push_back(f)) {
+            _rpn_memory_recount(ctxt);
+            return true;
+        }
+    }
+    rpn_error = RPN_ERROR_OUT_OF_MEMORY;
+    return false;
 }
 
 bool rpn_operators_clear(rpn_context & ctxt) {
-    for (auto & v : ctxt.operators) {
-        free(v.name);
-    }
     ctxt.operators.clear();
+    ctxt.profile.clear();
+    ctxt.checkpoint.operators = 0;
+    if (ctxt.variables.empty() && ctxt.words.empty()) _rpn_symbols_clear(ctxt);
+    _rpn_memory_recount(ctxt);
     return true;
 }
 
+// Index of the first operator with that name, or the number of operators
+unsigned int _rpn_operator_find(rpn_context & ctxt, const char * name, unsigned int length) {
+    unsigned int symbol = _rpn_symbol_find(ctxt, name, length);
+    if (RPN_SYMBOL_NONE == symbol) return ctxt.operators.size();
+    unsigned int index;
+    for (index = 0; index < ctxt.operators.size(); index++) {
+        if (ctxt.operators[index].symbol == symbol) break;
+    }
+    return index;
+}
+
+bool _rpn_operator_call(rpn_context & ctxt, unsigned int index) {
+
+    if (!ctxt.profiling) {
+        return (ctxt.operators[index].callback)(ctxt);
+    }
+
+    unsigned long start = _rpn_ticks();
+    bool result = (ctxt.operators[index].callback)(ctxt);
+    unsigned long elapsed = _rpn_ticks() - start;
+
+    // Operators might have been added since profiling was enabled
+    if (index >= ctxt.profile.size()) {
+        ctxt.profile.resize(ctxt.operators.size(), {0, 0});
+        _rpn_memory_update(ctxt);
+    }
+    if (index < ctxt.profile.size()) {
+        ctxt.profile[index].calls++;
+        ctxt.profile[index].ticks += elapsed;
+    }
+
+    return result;
+
+}
+
+// Fails if any of them could not be added
 bool rpn_operators_init(rpn_context & ctxt) {
 
-    rpn_operator_set(ctxt, "pi", 0, _rpn_pi);
-    rpn_operator_set(ctxt, "e", 0, _rpn_e);
+    rpn_error = RPN_ERROR_OK;
+    size_t first = ctxt.operators.size();
 
-    rpn_operator_set(ctxt, "+", 2, _rpn_sum);
-    rpn_operator_set(ctxt, "-", 2, _rpn_substract);
-    rpn_operator_set(ctxt, "*", 2, _rpn_times);
-    rpn_operator_set(ctxt, "/", 2, _rpn_divide);
-    rpn_operator_set(ctxt, "mod", 2, _rpn_mod);
-    rpn_operator_set(ctxt, "abs", 1, _rpn_abs);
+    rpn_operator_set(ctxt, "pi", 0, _rpn_pi, 1);
+    rpn_operator_set(ctxt, "e", 0, _rpn_e, 1);
 
-    rpn_operator_set(ctxt, "round", 2, _rpn_round);
-    rpn_operator_set(ctxt, "ceil", 1, _rpn_ceil);
-    rpn_operator_set(ctxt, "floor", 1, _rpn_floor);
-    rpn_operator_set(ctxt, "int", 1, _rpn_floor);
+    rpn_operator_set(ctxt, "+", 2, _rpn_sum, 1);
+    rpn_operator_set(ctxt, "-", 2, _rpn_substract, 1);
+    rpn_operator_set(ctxt, "*", 2, _rpn_times, 1);
+    rpn_operator_set(ctxt, "/", 2, _rpn_divide, 1);
+    rpn_operator_set(ctxt, "mod", 2, _rpn_mod, 1);
+    rpn_operator_set(ctxt, "abs", 1, _rpn_abs, 1);
+
+    rpn_operator_set(ctxt, "round", 2, _rpn_round, 1);
+    rpn_operator_set(ctxt, "ceil", 1, _rpn_ceil, 1);
+    rpn_operator_set(ctxt, "floor", 1, _rpn_floor, 1);
+    rpn_operator_set(ctxt, "int", 1, _rpn_floor, 1);
 
     #ifdef RPNLIB_ADVANCED_MATH
-    rpn_operator_set(ctxt, "sqrt", 1, _rpn_sqrt);
-    rpn_operator_set(ctxt, "log", 1, _rpn_log);
-    rpn_operator_set(ctxt, "log10", 1, _rpn_log10);
-    rpn_operator_set(ctxt, "exp", 1, _rpn_exp);
-    rpn_operator_set(ctxt, "fmod", 2, _rpn_fmod);
-    rpn_operator_set(ctxt, "pow", 2, _rpn_pow);
-    rpn_operator_set(ctxt, "cos", 1, _rpn_cos);
-    rpn_operator_set(ctxt, "sin", 1, _rpn_sin);
-    rpn_operator_set(ctxt, "tan", 1, _rpn_tan);
+    rpn_operator_set(ctxt, "sqrt", 1, _rpn_sqrt, 1);
+    rpn_operator_set(ctxt, "log", 1, _rpn_log, 1);
+    rpn_operator_set(ctxt, "log10", 1, _rpn_log10, 1);
+    rpn_operator_set(ctxt, "exp", 1, _rpn_exp, 1);
+    rpn_operator_set(ctxt, "fmod", 2, _rpn_fmod, 1);
+    rpn_operator_set(ctxt, "pow", 2, _rpn_pow, 1);
+    rpn_operator_set(ctxt, "cos", 1, _rpn_cos, 1);
+    rpn_operator_set(ctxt, "sin", 1, _rpn_sin, 1);
+    rpn_operator_set(ctxt, "tan", 1, _rpn_tan, 1);
     #endif
 
-    rpn_operator_set(ctxt, "eq", 2, _rpn_eq);
-    rpn_operator_set(ctxt, "ne", 2, _rpn_ne);
-    rpn_operator_set(ctxt, "gt", 2, _rpn_gt);
-    rpn_operator_set(ctxt, "ge", 2, _rpn_ge);
-    rpn_operator_set(ctxt, "lt", 2, _rpn_lt);
-    rpn_operator_set(ctxt, "le", 2, _rpn_le);
-
-    rpn_operator_set(ctxt, "cmp", 2, _rpn_cmp);
-    rpn_operator_set(ctxt, "cmp3", 3, _rpn_cmp3);
-    rpn_operator_set(ctxt, "index", 1, _rpn_index);
-    rpn_operator_set(ctxt, "map", 5, _rpn_map);
-    rpn_operator_set(ctxt, "constrain", 3, _rpn_constrain);
-
-    rpn_operator_set(ctxt, "and", 2, _rpn_and);
-    rpn_operator_set(ctxt, "or", 2, _rpn_or);
-    rpn_operator_set(ctxt, "xor", 2, _rpn_xor);
-    rpn_operator_set(ctxt, "not", 1, _rpn_not);
-
-    rpn_operator_set(ctxt, "dup", 1, _rpn_dup);
-    rpn_operator_set(ctxt, "dup2", 2, _rpn_dup2);
-    rpn_operator_set(ctxt, "swap", 2, _rpn_swap);
-    rpn_operator_set(ctxt, "rot", 3, _rpn_rot);
-    rpn_operator_set(ctxt, "unrot", 3, _rpn_unrot);
-    rpn_operator_set(ctxt, "drop", 1, _rpn_drop);
-    rpn_operator_set(ctxt, "over", 2, _rpn_over);
-    rpn_operator_set(ctxt, "depth", 0, _rpn_depth);
-
-    rpn_operator_set(ctxt, "ifn", 3, _rpn_ifn);
-    rpn_operator_set(ctxt, "end", 1, _rpn_end);
+    rpn_operator_set(ctxt, "eq", 2, _rpn_eq, 1);
+    rpn_operator_set(ctxt, "ne", 2, _rpn_ne, 1);
+    rpn_operator_set(ctxt, "gt", 2, _rpn_gt, 1);
+    rpn_operator_set(ctxt, "ge", 2, _rpn_ge, 1);
+    rpn_operator_set(ctxt, "lt", 2, _rpn_lt, 1);
+    rpn_operator_set(ctxt, "le", 2, _rpn_le, 1);
 
-    return true;
+    rpn_operator_set(ctxt, "cmp", 2, _rpn_cmp, 1);
+    rpn_operator_set(ctxt, "cmp3", 3, _rpn_cmp3, 1);
+    rpn_operator_set(ctxt, "index", 1, _rpn_index, RPN_RESULTS_VARIABLE);
+    rpn_operator_set(ctxt, "map", 5, _rpn_map, 1);
+    rpn_operator_set(ctxt, "constrain", 3, _rpn_constrain, 1);
+
+    rpn_operator_set(ctxt, "and", 2, _rpn_and, 1);
+    rpn_operator_set(ctxt, "or", 2, _rpn_or, 1);
+    rpn_operator_set(ctxt, "xor", 2, _rpn_xor, 1);
+    rpn_operator_set(ctxt, "not", 1, _rpn_not, 1);
+
+    rpn_operator_set(ctxt, "dup", 1, _rpn_dup, 2);
+    rpn_operator_set(ctxt, "dup2", 2, _rpn_dup2, 4);
+    rpn_operator_set(ctxt, "swap", 2, _rpn_swap, 2);
+    rpn_operator_set(ctxt, "rot", 3, _rpn_rot, 3);
+    rpn_operator_set(ctxt, "unrot", 3, _rpn_unrot, 3);
+    rpn_operator_set(ctxt, "drop", 1, _rpn_drop, 0);
+    rpn_operator_set(ctxt, "over", 2, _rpn_over, 3);
+    rpn_operator_set(ctxt, "depth", 0, _rpn_depth, 1);
+
+    rpn_operator_set(ctxt, "ifn", 3, _rpn_ifn, 1);
+    rpn_operator_set(ctxt, "end", 1, _rpn_end, 0);
+
+    // Those computing a single value out of the ones they take,
+    // rule sets can share them between rules, see rpn_ruleset_optimize
+    for (size_t i=first; i<ctxt.operators.size(); i++) {
+        rpn_operator & f = ctxt.operators[i];
+        f.pure = (1 == f.results) && (_rpn_depth != f.callback);
+    }
+
+    return (RPN_ERROR_OK == rpn_error);
 }
 
 // ----------------------------------------------------------------------------
 // Variables methods
 // ----------------------------------------------------------------------------
+//
+// Variables never move once added and their values are read and written
+// atomically, so they can be set from one thread while others evaluate
+// expressions reading them. Every update is published as a new epoch of
+// the context (the first one of a fork chain). Evaluations pin the current
+// epoch and read every variable as of that epoch, so they never see one
+// update half applied. Writers hold the writer lock while updating, readers
+// never take it nor wait for writers. Deleting or clearing variables must
+// not race with anything else.
 
-bool rpn_variable_set(rpn_context & ctxt, const char * name, float value) {
-    for (auto & v : ctxt.variables) {
-        if (strcmp(v.name, name) == 0) {
-            v.value = value;
-            return true;
+rpn_context & _rpn_root(rpn_context & ctxt) {
+    rpn_context * root = &ctxt;
+    while (root->parent) root = root->parent;
+    return *root;
+}
+
+// Epochs wrap around (0 is skipped), an epoch comes after the snapshot
+// if it was published between the snapshot and now (or is being published).
+// Now must be read after the epoch being checked.
+bool _rpn_epoch_after(unsigned long epoch, unsigned long snapshot, unsigned long now) {
+    return (epoch - snapshot - 1) <= (now - snapshot);
+}
+
+unsigned long _rpn_epoch_next(rpn_context & root) {
+    unsigned long epoch = root.epoch.load(std::memory_order_relaxed) + 1;
+    return epoch ? epoch : 1;
+}
+
+// Overwrites the oldest version, with the writer lock held. Readers
+// do not look at it until the caller publishes the epoch.
+void _rpn_variable_write(rpn_variable & variable, float value, unsigned long epoch) {
+    unsigned int writes = variable.writes.load(std::memory_order_relaxed);
+    rpn_variable_version & version = variable.versions[writes & (RPNLIB_VARIABLE_VERSIONS - 1)];
+    version.epoch.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    version.value.store(value, std::memory_order_relaxed);
+    version.epoch.store(epoch, std::memory_order_release);
+    variable.writes.store(writes + 1, std::memory_order_release);
+}
+
+// Newest version published at or before the snapshot. Fails when the
+// variable did not exist yet or when that version was already rewritten,
+// the latter flags the snapshot as expired.
+bool _rpn_variable_read(rpn_context & root, const rpn_variable & variable, unsigned long snapshot, float & value, bool & expired) {
+    if (_rpn_epoch_after(variable.created, snapshot, root.epoch.load(std::memory_order_acquire))) return false;
+    unsigned int writes = variable.writes.load(std::memory_order_acquire);
+    unsigned int count = (writes < RPNLIB_VARIABLE_VERSIONS) ? writes : RPNLIB_VARIABLE_VERSIONS;
+    for (unsigned int i=1; i<=count; i++) {
+        const rpn_variable_version & version = variable.versions[(writes - i) & (RPNLIB_VARIABLE_VERSIONS - 1)];
+        unsigned long epoch = version.epoch.load(std::memory_order_acquire);
+        if ((0 == epoch) || _rpn_epoch_after(epoch, snapshot, root.epoch.load(std::memory_order_acquire))) continue;
+        value = version.value.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (version.epoch.load(std::memory_order_relaxed) == epoch) return true;
+    }
+    expired = true;
+    return false;
+}
+
+// Position of a variable of this context only (not one inherited from the
+// parent), or the number of variables if there is none. Probes the index
+// comparing hashes first, names are only read on a likely match.
+size_t _rpn_variable_position(rpn_context & ctxt, const char * name, unsigned int length, unsigned int hash) {
+    unsigned int mask = 0;
+    std::atomic<unsigned int> * slots = ctxt.index.slots(mask);
+    if (slots) {
+        for (unsigned int slot = hash & mask; unsigned int entry = slots[slot].load(std::memory_order_acquire); slot = (slot + 1) & mask) {
+            const rpn_variable & variable = ctxt.variables[entry - 1];
+            if ((variable.hash == hash) && (strncmp(variable.name, name, length) == 0) && (0 == variable.name[length])) {
+                return entry - 1;
+            }
         }
     }
-    rpn_variable v;
-    v.name = strdup(name);
-    v.value = value;
-    ctxt.variables.push_back(v);
+    return ctxt.variables.size();
+}
+
+rpn_variable * _rpn_variable_own(rpn_context & ctxt, const char * name, unsigned int length, unsigned int hash) {
+    size_t position = _rpn_variable_position(ctxt, name, length, hash);
+    return (position < ctxt.variables.size()) ? &ctxt.variables[position] : nullptr;
+}
+
+// Makes room in the index for that many more variables at once,
+// the bigger index is filled before readers can see it
+bool _rpn_variables_grow(rpn_context & ctxt, size_t extra) {
+    size_t size = ctxt.variables.size();
+    if (4 * (size + extra) <= 3 * ctxt.index.size()) return true;
+    size_t count = ctxt.index.empty() ? 16 : 2 * ctxt.index.size();
+    while (4 * (size + extra) > 3 * count) count *= 2;
+    std::atomic<unsigned int> * slots = ctxt.index.create(count);
+    if (!slots) return (size + extra < ctxt.index.size());
+    for (size_t position = 0; position < size; position++) {
+        _rpn_table_insert(slots, count - 1, ctxt.variables[position].hash, position + 1);
+    }
+    ctxt.index.publish(slots);
     return true;
 }
 
-bool rpn_variable_get(rpn_context & ctxt, const char * name, float & value) {
-    for (auto & v : ctxt.variables) {
-        if (strcmp(v.name, name) == 0) {
-            value = v.value;
+// Refills the index in place, only safe while nothing else is reading it
+void _rpn_variables_reindex(rpn_context & ctxt) {
+    unsigned int mask = 0;
+    ctxt.index.clear();
+    std::atomic<unsigned int> * slots = ctxt.index.slots(mask);
+    if (!slots) return;
+    for (size_t position = 0; position < ctxt.variables.size(); position++) {
+        _rpn_table_insert(slots, mask, ctxt.variables[position].hash, position + 1);
+    }
+}
+
+// Drops the variables from that position on, just a few of them
+// are taken out of the index one by one
+void _rpn_variables_truncate(rpn_context & ctxt, size_t size) {
+    size_t current = ctxt.variables.size();
+    if (current <= size) return;
+    if (4 * (current - size) > ctxt.index.size()) {
+        ctxt.variables.truncate(size);
+        _rpn_variables_reindex(ctxt);
+        return;
+    }
+    for (size_t position = current; position > size; position--) {
+        _rpn_table_erase(ctxt.index, position, ctxt.variables[position - 1].hash, [&ctxt](unsigned int entry) {
+            return ctxt.variables[entry - 1].hash;
+        });
+    }
+    ctxt.variables.truncate(size);
+}
+
+// Provider for a variable that was not set, from the closest context of the
+// fork chain that has one. Exact names go before prefixes, and longer
+// prefixes before shorter ones.
+rpn_provider * _rpn_provider_find(rpn_context & ctxt, const char * name, unsigned int length) {
+    for (rpn_context * context = &ctxt; context; context = context->parent) {
+        rpn_provider * best = nullptr;
+        for (auto & provider : context->providers) {
+            if ((provider.length > length) || (memcmp(provider.name, name, provider.length) != 0)) continue;
+            if (!provider.prefix) {
+                if (provider.length == length) return &provider;
+            } else if (!best || (provider.length > best->length)) {
+                best = &provider;
+            }
+        }
+        if (best) return best;
+    }
+    return nullptr;
+}
+
+// Keeps what a provider said (values as well as misses) until the next
+// snapshot is pinned. There might be no room for it, it is then asked again.
+void _rpn_provided_keep(rpn_context & ctxt, const char * name, unsigned int length, unsigned int hash, float value, bool found) {
+    size_t capacity = ctxt.provided.capacity() + ctxt.provided_names.capacity();
+    size_t offset = ctxt.provided_names.size();
+    if (!ctxt.provided_names.resize(offset + length)) return;
+    memcpy(ctxt.provided_names.data() + offset, name, length);
+    if (!ctxt.provided.push_back({hash, (unsigned int) offset, length, value, found})) {
+        ctxt.provided_names.resize(offset);
+    }
+    if (capacity != ctxt.provided.capacity() + ctxt.provided_names.capacity()) _rpn_memory_update(ctxt);
+}
+
+// Asks the provider for a variable that was not set, at most once per pinned
+// snapshot. Without one it is asked every time.
+bool _rpn_variable_provide(rpn_context & ctxt, const char * name, unsigned int length, unsigned int hash, float & value) {
+    rpn_provider * provider = _rpn_provider_find(ctxt, name, length);
+    if (!provider || (length > 0xFF)) return false;
+    if (ctxt.pins) {
+        for (auto & provided : ctxt.provided) {
+            if ((provided.hash == hash) && (provided.length == length)
+                && (memcmp(ctxt.provided_names.data() + provided.name, name, length) == 0)) {
+                if (provided.found) value = provided.value;
+                return provided.found;
+            }
+        }
+    }
+    // Callbacks get the name as a C string
+    char buffer[0x100];
+    memcpy(buffer, name, length);
+    buffer[length] = 0;
+    float provided = 0;
+    bool found = provider->callback(ctxt, buffer, provided);
+    if (found) value = provided;
+    if (ctxt.pins) _rpn_provided_keep(ctxt, name, length, hash, provided, found);
+    return found;
+}
+
+// Forks read their parent variables unless they override them. Reads the
+// pinned snapshot, without one the latest value is read (starting over if
+// it keeps changing meanwhile). Variables that were not set at all are
+// asked to the providers.
+bool _rpn_variable_get(rpn_context & ctxt, const char * name, unsigned int length, float & value) {
+    unsigned int hash = _rpn_symbol_hash(name, length);
+    for (size_t i = ctxt.overrides.size(); i > 0; i--) {
+        const rpn_override & entry = ctxt.overrides[i - 1];
+        if ((entry.hash == hash) && (entry.length == length) && (memcmp(entry.name, name, length) == 0)) {
+            value = entry.value;
             return true;
         }
     }
-    return false;
+    rpn_context & root = _rpn_root(ctxt);
+    bool expired;
+    do {
+        expired = false;
+        unsigned long snapshot = ctxt.pins ? ctxt.snapshot : root.epoch.load(std::memory_order_acquire);
+        for (rpn_context * context = &ctxt; context && !expired; context = context->parent) {
+            rpn_variable * variable = _rpn_variable_own(*context, name, length, hash);
+            if (variable && _rpn_variable_read(root, *variable, snapshot, value, expired)) return true;
+        }
+    } while (expired && !ctxt.pins);
+    if (expired) {
+        rpn_error = RPN_ERROR_SNAPSHOT_EXPIRED;
+        return false;
+    }
+    return _rpn_variable_provide(ctxt, name, length, hash, value);
 }
 
-bool rpn_variable_del(rpn_context & ctxt, const char * name) {
-    for (auto v = ctxt.variables.begin(); v != ctxt.variables.end(); v++) {
-        if (strcmp((*v).name, name) == 0) {
-            free((*v).name);
-            ctxt.variables.erase(v);
+// Sets (or adds) a variable as part of an epoch the caller publishes,
+// with the writer lock held
+bool _rpn_variable_put(rpn_context & ctxt, const char * name, float value, unsigned long epoch) {
+    unsigned int length = strlen(name);
+    unsigned int hash = _rpn_symbol_hash(name, length);
+    rpn_variable * variable = _rpn_variable_own(ctxt, name, length, hash);
+    if (variable) {
+        _rpn_variable_write(*variable, value, epoch);
+        return true;
+    }
+    unsigned int symbol = RPN_SYMBOL_NONE;
+    if (!ctxt.variables.full() && _rpn_variables_grow(ctxt, 1)) {
+        symbol = _rpn_symbol_intern(ctxt, name, length);
+    }
+    if (RPN_SYMBOL_NONE != symbol) {
+        size_t position = ctxt.variables.size();
+        if (ctxt.variables.push_back(rpn_variable(_rpn_symbol_name(ctxt, symbol), symbol, hash, value, epoch))) {
+            unsigned int mask = 0;
+            std::atomic<unsigned int> * slots = ctxt.index.slots(mask);
+            _rpn_table_insert(slots, mask, hash, position + 1);
             return true;
         }
     }
+    rpn_error = RPN_ERROR_OUT_OF_MEMORY;
     return false;
 }
 
-unsigned char rpn_variables_size(rpn_context & ctxt) {
+bool rpn_variable_set(rpn_context & ctxt, const char * name, float value) {
+    rpn_context & root = _rpn_root(ctxt);
+    _rpn_spin_lock lock(root.writer);
+    unsigned long epoch = _rpn_epoch_next(root);
+    size_t variables = _rpn_memory_variables(ctxt);
+    size_t names = _rpn_memory_names(ctxt);
+    bool result = _rpn_variable_put(ctxt, name, value, epoch);
+    root.epoch.store(epoch, std::memory_order_release);
+    _rpn_memory_add(ctxt, variables, names);
+    return result;
+}
+
+// A whole frame of readings at once: storage grows (at most) once and all
+// values are published together as a single epoch, so evaluations see
+// either none or all of them. Keeps going after a failure, which is
+// reported at the end.
+bool rpn_variables_set_many(rpn_context & ctxt, const char * const names[], const float values[], size_t count) {
+    rpn_context & root = _rpn_root(ctxt);
+    _rpn_spin_lock lock(root.writer);
+    unsigned long epoch = _rpn_epoch_next(root);
+    size_t variables = _rpn_memory_variables(ctxt);
+    size_t bytes = _rpn_memory_names(ctxt);
+    _rpn_variables_grow(ctxt, count);
+    _rpn_symbols_reserve(ctxt, count);
+    bool result = true;
+    for (size_t i=0; i<count; i++) {
+        result = _rpn_variable_put(ctxt, names[i], values[i], epoch) && result;
+    }
+    root.epoch.store(epoch, std::memory_order_release);
+    _rpn_memory_add(ctxt, variables, bytes);
+    return result;
+}
+
+// Values only evaluations on this context see, until rpn_reset. They are
+// not published, so they neither take the writer lock nor start an epoch,
+// and later ones win. Names are not copied.
+bool _rpn_variables_override(rpn_context & ctxt, const char * const names[], const float values[], size_t count) {
+    size_t capacity = ctxt.overrides.capacity();
+    bool result = ctxt.overrides.reserve(ctxt.overrides.size() + count);
+    for (size_t i=0; result && (i<count); i++) {
+        unsigned int length = strlen(names[i]);
+        result = ctxt.overrides.push_back({names[i], length, _rpn_symbol_hash(names[i], length), values[i]});
+    }
+    if (capacity != ctxt.overrides.capacity()) _rpn_memory_update(ctxt);
+    if (!result) rpn_error = RPN_ERROR_OUT_OF_MEMORY;
+    return result;
+}
+
+// Handles skip the name lookup, they belong to the variables of this
+// context (not the inherited ones) and stay valid until variables are
+// deleted, cleared or reset
+bool rpn_variable_resolve(rpn_context & ctxt, const char * name, rpn_variable_handle & handle) {
+    unsigned int length = strlen(name);
+    size_t position = _rpn_variable_position(ctxt, name, length, _rpn_symbol_hash(name, length));
+    if (position == ctxt.variables.size()) return false;
+    handle.position = position;
+    handle.symbol = ctxt.variables[position].symbol;
+    return true;
+}
+
+// Handles no longer valid are skipped and make it fail with RPN_ERROR_UNVALID_ARGUMENT
+bool rpn_variables_set_many(rpn_context & ctxt, const rpn_variable_handle handles[], const float values[], size_t count) {
+    rpn_context & root = _rpn_root(ctxt);
+    _rpn_spin_lock lock(root.writer);
+    unsigned long epoch = _rpn_epoch_next(root);
+    size_t size = ctxt.variables.size();
+    bool result = true;
+    for (size_t i=0; i<count; i++) {
+        const rpn_variable_handle & handle = handles[i];
+        if ((handle.position < size) && (ctxt.variables[handle.position].symbol == handle.symbol)) {
+            _rpn_variable_write(ctxt.variables[handle.position], values[i], epoch);
+        } else {
+            rpn_error = RPN_ERROR_UNVALID_ARGUMENT;
+            result = false;
+        }
+    }
+    root.epoch.store(epoch, std::memory_order_release);
+    return result;
+}
+
+bool rpn_variable_get(rpn_context & ctxt, const char * name, float & value) {
+    return _rpn_variable_get(ctxt, name, strlen(name), value);
+}
+
+// The name stays interned, setting the variable again will reuse it.
+// Later variables move one position down, enumeration order is kept.
+bool rpn_variable_del(rpn_context & ctxt, const char * name) {
+    unsigned int length = strlen(name);
+    size_t position = _rpn_variable_position(ctxt, name, length, _rpn_symbol_hash(name, length));
+    if (position == ctxt.variables.size()) return false;
+    if (position < ctxt.checkpoint.variables) ctxt.checkpoint.variables--;
+    ctxt.variables.erase(position);
+    _rpn_variables_reindex(ctxt);
+    _rpn_memory_recount(ctxt);
+    return true;
+}
+
+size_t rpn_variables_size(rpn_context & ctxt) {
     return ctxt.variables.size();
 }
 
-char * rpn_variable_name(rpn_context & ctxt, unsigned char i) {
+char * rpn_variable_name(rpn_context & ctxt, size_t i) {
     if (i < ctxt.variables.size()) {
         return ctxt.variables[i].name;
     }
@@ -224,71 +691,464 @@ char * rpn_variable_name(rpn_context & ctxt, unsigned char i) {
 }
 
 bool rpn_variables_clear(rpn_context & ctxt) {
-    for (auto & v : ctxt.variables) {
-        free(v.name);
-    }
     ctxt.variables.clear();
+    ctxt.index.clear();
+    ctxt.checkpoint.variables = 0;
+    if (ctxt.operators.empty() && ctxt.words.empty()) _rpn_symbols_clear(ctxt);
+    _rpn_memory_recount(ctxt);
+    return true;
+}
+
+// Providers are called with the name of a variable being read that was not
+// set, they give back its value or false if they do not know it. Names
+// ending with '*' are prefixes. They are not copied and must outlive the
+// provider. Like operators, they must not change while evaluating.
+bool rpn_provider_set(rpn_context & ctxt, const char * name, bool (*callback)(rpn_context &, const char *, float &)) {
+    unsigned int length = strlen(name);
+    bool prefix = (length > 0) && ('*' == name[length - 1]);
+    if (prefix) length--;
+    for (auto & provider : ctxt.providers) {
+        if ((provider.prefix == prefix) && (provider.length == length) && (strncmp(provider.name, name, length) == 0)) {
+            provider.callback = callback;
+            return true;
+        }
+    }
+    if (!ctxt.providers.push_back({name, length, prefix, callback})) {
+        rpn_error = RPN_ERROR_OUT_OF_MEMORY;
+        return false;
+    }
+    _rpn_memory_recount(ctxt);
+    return true;
+}
+
+bool rpn_provider_del(rpn_context & ctxt, const char * name) {
+    unsigned int length = strlen(name);
+    bool prefix = (length > 0) && ('*' == name[length - 1]);
+    if (prefix) length--;
+    for (auto & provider : ctxt.providers) {
+        if ((provider.prefix == prefix) && (provider.length == length) && (strncmp(provider.name, name, length) == 0)) {
+            size_t position = &provider - ctxt.providers.data();
+            if (position < ctxt.checkpoint.providers) ctxt.checkpoint.providers--;
+            ctxt.providers.erase(&provider);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool rpn_providers_clear(rpn_context & ctxt) {
+    ctxt.providers.clear();
+    ctxt.checkpoint.providers = 0;
+    ctxt.provided.clear();
+    ctxt.provided_names.clear();
+    return true;
+}
+
+// Reads (and evaluations) until released see every variable as of the
+// current epoch. Pins nest, only the outermost one takes a new snapshot
+// (and forgets the values providers gave for the previous one).
+bool rpn_snapshot_acquire(rpn_context & ctxt) {
+    return _rpn_snapshot_acquire(ctxt, _rpn_root(ctxt).epoch.load(std::memory_order_acquire));
+}
+
+// Same at a given epoch, so several forks can share a snapshot
+bool _rpn_snapshot_acquire(rpn_context & ctxt, unsigned long epoch) {
+    if (0 == ctxt.pins++) {
+        ctxt.snapshot = epoch;
+        ctxt.provided.clear();
+        ctxt.provided_names.clear();
+    }
+    return true;
+}
+
+bool rpn_snapshot_release(rpn_context & ctxt) {
+    if (0 == ctxt.pins) return false;
+    ctxt.pins--;
+    return true;
+}
+
+// Whether an evaluation that just failed can be run again from the start:
+// its snapshot expired, it was the one pinning it (outer pins must keep
+// theirs) and it started on an empty stack, which is emptied again.
+bool _rpn_snapshot_retry(rpn_context & ctxt, bool empty, unsigned int & retries) {
+    if ((RPN_ERROR_SNAPSHOT_EXPIRED != rpn_error) || ctxt.pins || !empty) return false;
+    if (retries == RPNLIB_SNAPSHOT_RETRIES) return false;
+    retries++;
+    ctxt.stack.clear();
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Trace methods
+// ----------------------------------------------------------------------------
+
+#ifdef RPNLIB_TRACE
+
+    bool rpn_trace(rpn_context & ctxt, rpn_trace_buffer * buffer) {
+        ctxt.trace = buffer;
+        return true;
+    }
+
+    bool rpn_trace_clear(rpn_trace_buffer & buffer) {
+        buffer.head = 0;
+        return true;
+    }
+
+    unsigned int rpn_trace_size(rpn_trace_buffer & buffer) {
+        return (buffer.head < RPNLIB_TRACE_SIZE) ? buffer.head : RPNLIB_TRACE_SIZE;
+    }
+
+    // Index 0 is the oldest event still in the buffer
+    bool rpn_trace_get(rpn_trace_buffer & buffer, unsigned int index, rpn_trace_event & event) {
+        unsigned int size = rpn_trace_size(buffer);
+        if (index >= size) return false;
+        event = buffer.events[(buffer.head - size + index) & (RPNLIB_TRACE_SIZE - 1)];
+        return true;
+    }
+
+    // Decodes an event into a human readable line, timestamp is taken as the origin
+    int rpn_trace_format(rpn_context & ctxt, const rpn_trace_event & event, unsigned int timestamp, char * buffer, unsigned int size) {
+        unsigned long long ns = _rpn_ticks_to_ns((unsigned int) (event.timestamp - timestamp));
+        const char * name;
+        char unknown[8];
+        if (RPN_TRACE_NUMBER == event.opcode) {
+            name = "<number>";
+        } else if (RPN_TRACE_VARIABLE == event.opcode) {
+            name = "<variable>";
+        } else if (RPN_TRACE_ERROR == event.opcode) {
+            return snprintf(buffer, size, "%10llu ns  <error %d>  depth %u",
+                ns, (int) event.top, event.depth);
+        } else if (event.opcode < ctxt.operators.size()) {
+            name = ctxt.operators[event.opcode].name;
+        } else {
+            snprintf(unknown, sizeof(unknown), "#%u", event.opcode);
+            name = unknown;
+        }
+        return snprintf(buffer, size, "%10llu ns  %-12s depth %-3u top %f",
+            ns, name, event.depth, event.top);
+    }
+
+#endif
+
+// ----------------------------------------------------------------------------
+// Histogram methods
+// ----------------------------------------------------------------------------
+
+rpn_histogram::rpn_histogram() {
+    rpn_histogram_reset(*this);
+}
+
+unsigned int _rpn_histogram_index(unsigned long ticks) {
+    if (ticks > 0xFFFFFFFFUL) ticks = 0xFFFFFFFFUL;
+    if (ticks < RPN_HISTOGRAM_SUB_BUCKETS) return ticks;
+    unsigned int msb = 31 - __builtin_clz((unsigned int) ticks);
+    unsigned int shift = msb - 3;
+    return (shift + 1) * RPN_HISTOGRAM_SUB_BUCKETS + ((ticks >> shift) & (RPN_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// Highest value that falls into the bucket
+unsigned long long _rpn_histogram_value(unsigned int index) {
+    if (index < RPN_HISTOGRAM_SUB_BUCKETS) return index;
+    unsigned int shift = index / RPN_HISTOGRAM_SUB_BUCKETS - 1;
+    unsigned long long sub = RPN_HISTOGRAM_SUB_BUCKETS + (index % RPN_HISTOGRAM_SUB_BUCKETS);
+    return ((sub + 1) << shift) - 1;
+}
+
+void _rpn_histogram_record(rpn_histogram & histogram, unsigned long ticks) {
+    histogram.counts[_rpn_histogram_index(ticks)].fetch_add(1, std::memory_order_relaxed);
+    histogram.calls.fetch_add(1, std::memory_order_relaxed);
+    unsigned long max = histogram.max.load(std::memory_order_relaxed);
+    while ((ticks > max) && !histogram.max.compare_exchange_weak(max, ticks, std::memory_order_relaxed));
+}
+
+bool rpn_histogram_reset(rpn_histogram & histogram) {
+    for (auto & count : histogram.counts) {
+        count.store(0, std::memory_order_relaxed);
+    }
+    histogram.calls.store(0, std::memory_order_relaxed);
+    histogram.max.store(0, std::memory_order_relaxed);
     return true;
 }
 
+unsigned long rpn_histogram_calls(rpn_histogram & histogram) {
+    return histogram.calls.load(std::memory_order_relaxed);
+}
+
+unsigned long long rpn_histogram_percentile(rpn_histogram & histogram, float percentile) {
+
+    // Buckets are summed up instead of using the calls counter,
+    // they might be updated while we read them
+    unsigned long total = 0;
+    for (auto & count : histogram.counts) {
+        total += count.load(std::memory_order_relaxed);
+    }
+    if (0 == total) return 0;
+
+    if (percentile < 0) percentile = 0;
+    if (percentile > 100) percentile = 100;
+    unsigned long rank = (percentile * total + 99) / 100;
+    if (0 == rank) rank = 1;
+
+    unsigned long long max = histogram.max.load(std::memory_order_relaxed);
+    unsigned long seen = 0;
+    for (unsigned int i=0; i<RPN_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram.counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            unsigned long long value = _rpn_histogram_value(i);
+            if (value > max) value = max;
+            return _rpn_ticks_to_ns(value);
+        }
+    }
+    return _rpn_ticks_to_ns(max);
+
+}
+
+unsigned long long rpn_histogram_max(rpn_histogram & histogram) {
+    return _rpn_ticks_to_ns(histogram.max.load(std::memory_order_relaxed));
+}
+
 // ----------------------------------------------------------------------------
 // Main methods
 // ----------------------------------------------------------------------------
 
-bool rpn_process(rpn_context & ctxt, const char * input, bool variable_must_exist) {
+// Blocks rpn_process is in the middle of, innermost last (if, else or do,
+// the way the compiler keeps them), at most RPNLIB_BLOCK_DEPTH of them so
+// nothing is allocated. Loops also keep where their body starts and how
+// many more times it runs.
+struct _rpn_blocks {
+    unsigned char open[RPNLIB_BLOCK_DEPTH];
+    unsigned char depth = 0;
+    unsigned char loops = 0;
+    struct {
+        const char * body;
+        unsigned long left;
+    } counters[RPNLIB_LOOP_DEPTH];
+};
 
-    char * token;
-    char * base = strdup(input);
+bool _rpn_blocks_push(_rpn_blocks & blocks, unsigned char keyword) {
+    if (blocks.depth == RPNLIB_BLOCK_DEPTH) {
+        rpn_error = RPN_ERROR_OUT_OF_MEMORY;
+        return false;
+    }
+    blocks.open[blocks.depth++] = keyword;
+    return true;
+}
+
+// Token after the word closing the block the given one opens: the then
+// of an if or an else (or the else of an if, if wanted) or the loop of a
+// do. Blocks opened in between are pushed on the open ones while skipping
+// them, so they must be closed in order too. Null if the block is not
+// closed, something in it is closed out of order or nested too deep.
+const char * _rpn_skip(_rpn_blocks & blocks, const char * token, unsigned char keyword, bool at_else, unsigned char & found) {
+    unsigned char base = blocks.depth;
+    const char * result = nullptr;
+    while (true) {
+        while (' ' == *token) token++;
+        if (0 == *token) break;
+        unsigned int length = 0;
+        while ((0 != token[length]) && (' ' != token[length])) length++;
+        found = _rpn_keyword(token, length);
+        token += length;
+        if ((RPN_KEYWORD_IF == found) || (RPN_KEYWORD_DO == found)) {
+            if (!_rpn_blocks_push(blocks, found)) break;
+            continue;
+        }
+        if ((RPN_KEYWORD_ELSE != found) && (RPN_KEYWORD_THEN != found) && (RPN_KEYWORD_LOOP != found)) continue;
+        bool nested = blocks.depth > base;
+        unsigned char inner = nested ? blocks.open[blocks.depth - 1] : keyword;
+        bool closes = (RPN_KEYWORD_LOOP == found)
+            ? (RPN_KEYWORD_DO == inner)
+            : ((RPN_KEYWORD_IF == inner) || ((RPN_KEYWORD_ELSE == inner) && (RPN_KEYWORD_THEN == found)));
+        if (!closes) break;
+        if (nested) {
+            if (RPN_KEYWORD_ELSE == found) blocks.open[blocks.depth - 1] = found;
+            else blocks.depth--;
+            continue;
+        }
+        if (at_else || (RPN_KEYWORD_ELSE != found)) result = token;
+        break;
+    }
+    blocks.depth = base;
+    return result;
+}
+
+// Runs a control flow word, gives back the token to go on from
+// (or null on errors). Untaken branches are skipped, not evaluated.
+// Every then, else and loop must close the innermost open block.
+const char * _rpn_process_keyword(rpn_context & ctxt, _rpn_blocks & blocks, unsigned char keyword, const char * next) {
+
+    unsigned char found;
+
+    if ((RPN_KEYWORD_IF == keyword) || (RPN_KEYWORD_DO == keyword)) {
+        float value;
+        if (!rpn_stack_pop(ctxt, value)) {
+            rpn_error = RPN_ERROR_ARGUMENT_COUNT_MISMATCH;
+            return nullptr;
+        }
+        if (RPN_KEYWORD_IF == keyword) {
+            if (0 != value) {
+                return _rpn_blocks_push(blocks, keyword) ? next : nullptr;
+            }
+            next = _rpn_skip(blocks, next, keyword, true, found);
+            if (next && (RPN_KEYWORD_ELSE == found) && !_rpn_blocks_push(blocks, found)) return nullptr;
+        } else if (!(value <= RPNLIB_LOOP_MAX)) {
+            rpn_error = RPN_ERROR_UNVALID_ARGUMENT;
+            return nullptr;
+        } else if (value < 1) {
+            next = _rpn_skip(blocks, next, keyword, false, found);
+        } else if (blocks.loops == RPNLIB_LOOP_DEPTH) {
+            rpn_error = RPN_ERROR_OUT_OF_MEMORY;
+            return nullptr;
+        } else {
+            if (!_rpn_blocks_push(blocks, keyword)) return nullptr;
+            blocks.counters[blocks.loops++] = {next, (unsigned long) value};
+        }
+
+    } else {
+        unsigned char inner = blocks.depth ? blocks.open[blocks.depth - 1] : (unsigned char) RPN_KEYWORD_NONE;
+        if (RPN_KEYWORD_LOOP == keyword) {
+            if (RPN_KEYWORD_DO != inner) {
+                next = nullptr;
+            } else if (--blocks.counters[blocks.loops - 1].left) {
+                return blocks.counters[blocks.loops - 1].body;
+            } else {
+                blocks.loops--;
+                blocks.depth--;
+            }
+        } else if (RPN_KEYWORD_ELSE == keyword) {
+            if (RPN_KEYWORD_IF != inner) {
+                next = nullptr;
+            } else {
+                blocks.depth--;
+                next = _rpn_skip(blocks, next, keyword, false, found);
+            }
+        } else if ((RPN_KEYWORD_THEN == keyword) && ((RPN_KEYWORD_IF == inner) || (RPN_KEYWORD_ELSE == inner))) {
+            blocks.depth--;
+        } else {
+            next = nullptr;
+        }
+    }
+
+    if (!next && (RPN_ERROR_OK == rpn_error)) rpn_error = RPN_ERROR_UNBALANCED;
+    return next;
+
+}
+
+// Defines a word, ": name body ;", gives back the token after the ;
+const char * _rpn_process_define(rpn_context & ctxt, const char * token) {
+    while (' ' == *token) token++;
+    const char * name = token;
+    while ((0 != *token) && (' ' != *token)) token++;
+    const char * body = token;
+    while (true) {
+        while (' ' == *token) token++;
+        if ((0 == *token) || (name == body)) {
+            rpn_error = RPN_ERROR_UNBALANCED;
+            return nullptr;
+        }
+        unsigned int length = 0;
+        while ((0 != token[length]) && (' ' != token[length])) length++;
+        if (RPN_KEYWORD_END == _rpn_keyword(token, length)) break;
+        token += length;
+    }
+    if (!_rpn_word_set(ctxt, name, body - name, body, token - body)) return nullptr;
+    return token + 1;
+}
+
+// Tokens are read in place, the input is not copied
+bool _rpn_process(rpn_context & ctxt, const char * input, bool variable_must_exist) {
 
     rpn_error = RPN_ERROR_OK;
+    _rpn_snapshot snapshot(ctxt);
+    _rpn_blocks blocks;
+
+    const char * token = input;
+    while (true) {
 
-    for (token = strtok(base, " "); token != NULL; token = strtok(NULL, " ")) {
-        
-        // Debug callback
+        // Multiple spaces
+        while (' ' == *token) token++;
+        if (0 == *token) break;
+
+        unsigned int length = 0;
+        while ((0 != token[length]) && (' ' != token[length])) length++;
+        const char * next = token + length;
+
+        // Debug callback, it gets a copy of the token
         if (_rpn_debug_callback) {
-            (*_rpn_debug_callback)(ctxt, token);
+            char buffer[32];
+            char * copy = (length < sizeof(buffer)) ? buffer : (char *) malloc(length + 1);
+            if (copy) {
+                memcpy(copy, token, length);
+                copy[length] = 0;
+                (*_rpn_debug_callback)(ctxt, copy);
+                if (copy != buffer) free(copy);
+            }
         }
 
-        // Multiple spaces
-        if (0 == strlen(token)) {
+        // Is token a control flow word?
+        unsigned char keyword = _rpn_keyword(token, length);
+        if (RPN_KEYWORD_DEFINE == keyword) {
+            token = _rpn_process_define(ctxt, next);
+            if (!token) break;
+            continue;
+        }
+        if (RPN_KEYWORD_NONE != keyword) {
+            token = _rpn_process_keyword(ctxt, blocks, keyword, next);
+            if (!token) break;
             continue;
         }
 
         // Is token a number?
-        if (_rpn_is_number(token)) {
-            ctxt.stack.push_back(atof(token));
+        // (atof stops at the space that follows it)
+        if (_rpn_is_number(token, length)) {
+            if (!rpn_stack_push(ctxt, atof(token))) break;
+            RPN_TRACE(ctxt, RPN_TRACE_NUMBER);
+            token = next;
             continue;
         }
 
+        // Is token a word?
+        if (!ctxt.words.empty()) {
+            unsigned int i = _rpn_word_find(ctxt, token, length);
+            if (i < ctxt.words.size()) {
+                if (!_rpn_word_call(ctxt, i)) break;
+                token = next;
+                continue;
+            }
+        }
+
         // Is token a operator?
         {
-            bool found = false;
-            for (auto & f : ctxt.operators) {
-                if (strcmp(f.name, token) == 0) {
-                    if (rpn_stack_size(ctxt) < f.argc) {
-                        rpn_error = RPN_ERROR_ARGUMENT_COUNT_MISMATCH;
-                        break;
-                    }
-                    if (!(f.callback)(ctxt)) {
-                        // Method should set rpn_error
-                        break;
-                    }
-                    found = true;
+            unsigned int i = _rpn_operator_find(ctxt, token, length);
+            if (i < ctxt.operators.size()) {
+                if (rpn_stack_size(ctxt) < ctxt.operators[i].argc) {
+                    rpn_error = RPN_ERROR_ARGUMENT_COUNT_MISMATCH;
                     break;
                 }
+                if (!_rpn_operator_call(ctxt, i)) {
+                    // Method should set rpn_error
+                    if (RPN_ERROR_OK == rpn_error) rpn_error = RPN_ERROR_UNKNOWN_TOKEN;
+                    break;
+                }
+                // Or the stack might be full
+                if (RPN_ERROR_OK != rpn_error) break;
+                RPN_TRACE(ctxt, i);
+                token = next;
+                continue;
             }
-            if (RPN_ERROR_OK != rpn_error) break;
-            if (found) continue;
         }
 
         // Is token a variable?
         {
             if (token[0] == '$') {
                 float value = 0;
-                bool exists = rpn_variable_get(ctxt, &token[1], value);
-                if (exists || !variable_must_exist) {
-                ctxt.stack.push_back(value);
-                continue;
+                bool found = _rpn_variable_get(ctxt, token + 1, length - 1, value);
+                if (RPN_ERROR_OK != rpn_error) break;
+                if (found || !variable_must_exist) {
+                    if (!rpn_stack_push(ctxt, value)) break;
+                    RPN_TRACE(ctxt, RPN_TRACE_VARIABLE);
+                    token = next;
+                    continue;
                 }
             }
         }
@@ -298,24 +1158,271 @@ bool rpn_process(rpn_context & ctxt, const char * input, bool variable_must_exis
         break;
 
     }
-    
-    free(base);
+
+    // An if without its then or a do without its loop
+    if ((RPN_ERROR_OK == rpn_error) && blocks.depth) {
+        rpn_error = RPN_ERROR_UNBALANCED;
+    }
+
+    if (RPN_ERROR_OK != rpn_error) {
+        RPN_TRACE(ctxt, RPN_TRACE_ERROR);
+    }
     return (RPN_ERROR_OK == rpn_error);
 
 }
 
+// Runs the expression again from the start, on a new snapshot, if the one
+// it read the variables at expired before it was done (see _rpn_snapshot_retry):
+// operators, and words defined by it, might then be called more than once.
+// Pin a snapshot around it (or set RPNLIB_SNAPSHOT_RETRIES to 0) to have it
+// fail with RPN_ERROR_SNAPSHOT_EXPIRED instead.
+bool rpn_process(rpn_context & ctxt, const char * input, bool variable_must_exist) {
+    bool empty = ctxt.stack.empty();
+    unsigned int retries = 0;
+    bool result;
+    do {
+        result = _rpn_process(ctxt, input, variable_must_exist);
+    } while (!result && _rpn_snapshot_retry(ctxt, empty, retries));
+    return result;
+}
+
+bool rpn_process(rpn_context & ctxt, const char * input, rpn_histogram & histogram, bool variable_must_exist) {
+    unsigned long start = _rpn_ticks();
+    bool result = rpn_process(ctxt, input, variable_must_exist);
+    _rpn_histogram_record(histogram, _rpn_ticks() - start);
+    return result;
+}
+
 bool rpn_debug(void(*callback)(rpn_context &, char *)) {
     _rpn_debug_callback = callback;
     return true;
 }
 
+bool rpn_profile(rpn_context & ctxt, bool enable) {
+    ctxt.profiling = enable;
+    if (enable) {
+        ctxt.profile.resize(ctxt.operators.size(), {0, 0});
+        _rpn_memory_update(ctxt);
+    }
+    return true;
+}
+
+bool rpn_profile_reset(rpn_context & ctxt) {
+    for (auto & p : ctxt.profile) {
+        p.calls = 0;
+        p.ticks = 0;
+    }
+    return true;
+}
+
+bool rpn_profile_get(rpn_context & ctxt, size_t index, const char * & name, unsigned long & calls, unsigned long long & ns) {
+    if (index >= ctxt.operators.size()) return false;
+    name = ctxt.operators[index].name;
+    calls = 0;
+    ns = 0;
+    if (index < ctxt.profile.size()) {
+        calls = ctxt.profile[index].calls;
+        ns = _rpn_ticks_to_ns(ctxt.profile[index].ticks);
+    }
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Memory methods
+// ----------------------------------------------------------------------------
+
+template <typename T>
+size_t _rpn_memory_usage(rpn_memory_usage & usage, const rpn_vector<T> & vector) {
+    usage.size = vector.size();
+    usage.capacity = vector.capacity();
+    return vector.capacity() * sizeof(T);
+}
+
+template <typename T>
+size_t _rpn_memory_usage(rpn_memory_usage & usage, const rpn_segments<T> & segments) {
+    usage.size = segments.size();
+    usage.capacity = segments.capacity();
+    return segments.capacity() * sizeof(T);
+}
+
+void _rpn_memory_track(rpn_memory_usage & usage, size_t bytes) {
+    usage.bytes = bytes;
+    if (bytes > usage.peak) usage.peak = bytes;
+}
+
+// Bytes held by the variables (and their index) and by the names, only
+// read with the writer lock held or while nothing else runs
+size_t _rpn_memory_variables(const rpn_context & ctxt) {
+    return ctxt.variables.capacity() * sizeof(rpn_variable) + ctxt.index.bytes();
+}
+
+size_t _rpn_memory_names(const rpn_context & ctxt) {
+    const rpn_symbols & symbols = ctxt.symbols;
+    size_t bytes = symbols.names.capacity() * sizeof(char *) + symbols.table.bytes();
+    bytes += symbols.chunks.capacity() * sizeof(rpn_symbols::chunk);
+    bytes += symbols.initial_size;
+    for (auto & chunk : symbols.chunks) {
+        bytes += chunk.size;
+    }
+    return bytes;
+}
+
+// Writers setting variables add what they allocated since they took the
+// figures above, they do not touch anything the evaluating thread owns
+void _rpn_memory_add(rpn_context & ctxt, size_t variables, size_t names) {
+    ctxt.variables_bytes.fetch_add(_rpn_memory_variables(ctxt) - variables, std::memory_order_relaxed);
+    ctxt.names_bytes.fetch_add(_rpn_memory_names(ctxt) - names, std::memory_order_relaxed);
+}
+
+// Called by the thread evaluating whenever one of its buffers is allocated
+// or released (not on every change), and when the figures are read
+void _rpn_memory_update(rpn_context & ctxt) {
+
+    rpn_memory & memory = ctxt.memory;
+
+    _rpn_memory_track(memory.stack, _rpn_memory_usage(memory.stack, ctxt.stack));
+
+    // Variables include the providers and their cached values, the
+    // overrides and the rule set temporaries computed out of them
+    rpn_memory_usage scratch;
+    memory.variables.size = ctxt.variables.size();
+    memory.variables.capacity = ctxt.variables.capacity();
+    size_t bytes = ctxt.variables_bytes.load(std::memory_order_relaxed);
+    bytes += _rpn_memory_usage(scratch, ctxt.providers);
+    bytes += _rpn_memory_usage(scratch, ctxt.provided);
+    bytes += _rpn_memory_usage(scratch, ctxt.provided_names);
+    bytes += _rpn_memory_usage(scratch, ctxt.overrides);
+    bytes += _rpn_memory_usage(scratch, ctxt.values);
+    _rpn_memory_track(memory.variables, bytes);
+
+    // Operators include the words
+    bytes = _rpn_memory_usage(memory.operators, ctxt.operators);
+    bytes += _rpn_memory_usage(scratch, ctxt.words);
+    bytes += _rpn_memory_usage(scratch, ctxt.word_code);
+    bytes += _rpn_memory_usage(scratch, ctxt.word_bindings);
+    if (ctxt.parent) bytes = 0;             // shared with the parent
+    bytes += _rpn_memory_usage(scratch, ctxt.profile);
+    _rpn_memory_track(memory.operators, bytes);
+
+    // Names count the interned ones, bytes the whole arena
+    memory.names.size = ctxt.symbols.names.size();
+    memory.names.capacity = ctxt.symbols.names.capacity();
+    _rpn_memory_track(memory.names, ctxt.names_bytes.load(std::memory_order_relaxed));
+
+    memory.bytes = memory.stack.bytes + memory.variables.bytes + memory.operators.bytes + memory.names.bytes;
+    if (memory.bytes > memory.peak) memory.peak = memory.bytes;
+
+}
+
+// Everything over again, after changes made while nothing else runs
+void _rpn_memory_recount(rpn_context & ctxt) {
+    ctxt.variables_bytes.store(_rpn_memory_variables(ctxt), std::memory_order_relaxed);
+    ctxt.names_bytes.store(_rpn_memory_names(ctxt), std::memory_order_relaxed);
+    _rpn_memory_update(ctxt);
+}
+
+bool rpn_memory_get(rpn_context & ctxt, rpn_memory & memory) {
+    _rpn_memory_update(ctxt);
+    memory = ctxt.memory;
+    return true;
+}
+
+// Peaks start over from the current values
+bool rpn_memory_reset(rpn_context & ctxt) {
+    rpn_memory & memory = ctxt.memory;
+    memory.stack.peak = memory.variables.peak = memory.operators.peak = memory.names.peak = memory.peak = 0;
+    _rpn_memory_update(ctxt);
+    return true;
+}
+
+// The builtins are part of the first checkpoint
 bool rpn_init(rpn_context & ctxt) {
-    return rpn_operators_init(ctxt);
+    return rpn_operators_init(ctxt) && rpn_checkpoint(ctxt);
 }
 
+// Names are released in bulk, a chunk at a time
 bool rpn_clear(rpn_context & ctxt) {
-    rpn_operators_clear(ctxt);
-    rpn_variables_clear(ctxt);
+    ctxt.operators.clear();
+    ctxt.profile.clear();
+    ctxt.words.clear();
+    ctxt.word_code.clear();
+    ctxt.word_bindings.clear();
+    ctxt.variables.clear();
+    ctxt.index.clear();
+    ctxt.checkpoint = {};
+    ctxt.paused = rpn_resume {};
+    ctxt.values.clear();
+    ctxt.values_ruleset = 0;
+    ctxt.overrides.clear();
+    rpn_providers_clear(ctxt);
     rpn_stack_clear(ctxt);
+    _rpn_symbols_clear(ctxt);
+    if (ctxt.parent) {
+        ctxt.operators.set_allocator(ctxt.operators.get_allocator());
+        ctxt.words.set_allocator(ctxt.words.get_allocator());
+        ctxt.word_code.set_allocator(ctxt.word_code.get_allocator());
+        ctxt.word_bindings.set_allocator(ctxt.word_bindings.get_allocator());
+        ctxt.symbols.base = 0;
+        ctxt.parent = nullptr;
+    }
+    return true;
+}
+
+// Makes fork a lightweight copy of parent: it shares the parent operators
+// and words (and cannot add its own) and reads the parent variables unless it sets
+// them itself. Forks can be evaluated from different threads, while the
+// parent variables keep being set, but nothing else in the parent may
+// change while it has forks. Release them with rpn_clear.
+bool rpn_fork(rpn_context & parent, rpn_context & fork) {
+    rpn_clear(fork);
+    fork.parent = &parent;
+    fork.operators.attach(parent.operators.data(), parent.operators.size(), parent.operators.size());
+    fork.words.attach(parent.words.data(), parent.words.size(), parent.words.size());
+    fork.word_code.attach(parent.word_code.data(), parent.word_code.size(), parent.word_code.size());
+    fork.word_bindings.attach(parent.word_bindings.data(), parent.word_bindings.size(), parent.word_bindings.size());
+    fork.symbols.base = parent.symbols.base + RPN_SYMBOL_DEPTH;
+    fork.checkpoint.operators = fork.operators.size();
+    fork.checkpoint.words = fork.words.size();
+    return true;
+}
+
+// Current variables, operators, words and providers (and their names)
+// will survive rpn_reset
+bool rpn_checkpoint(rpn_context & ctxt) {
+    ctxt.checkpoint.variables = ctxt.variables.size();
+    ctxt.checkpoint.operators = ctxt.operators.size();
+    ctxt.checkpoint.words = ctxt.words.size();
+    ctxt.checkpoint.providers = ctxt.providers.size();
+    _rpn_symbols_checkpoint(ctxt);
+    return true;
+}
+
+// Cheap alternative to rpn_clear and rpn_init between requests: empties
+// the stack and drops whatever was added since the checkpoint, so nothing
+// one request defines is seen by the next one. Those that were there
+// before stay as they are now (values set, words redefined or deleted
+// since are not brought back). No memory is released, other than extra
+// name chunks.
+bool rpn_reset(rpn_context & ctxt) {
+    ctxt.stack.clear();
+    ctxt.paused = rpn_resume {};
+    ctxt.values_ruleset = 0;
+    ctxt.overrides.clear();
+    _rpn_variables_truncate(ctxt, ctxt.checkpoint.variables);
+    if (ctxt.operators.size() > ctxt.checkpoint.operators) {
+        ctxt.operators.resize(ctxt.checkpoint.operators);
+    }
+    if (ctxt.profile.size() > ctxt.checkpoint.operators) {
+        ctxt.profile.resize(ctxt.checkpoint.operators);
+    }
+    while (ctxt.words.size() > ctxt.checkpoint.words) {
+        _rpn_word_release(ctxt, ctxt.words.back());
+        ctxt.words.pop_back();
+    }
+    if (ctxt.providers.size() > ctxt.checkpoint.providers) {
+        ctxt.providers.resize(ctxt.checkpoint.providers);
+    }
+    _rpn_symbols_rollback(ctxt);
+    _rpn_memory_recount(ctxt);
     return true;
 }
\ No newline at end of file
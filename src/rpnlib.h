@@ -24,67 +24,976 @@ along with the rpnlib library.  If not, see <http://www.gnu.org/licenses/>.
 
 // ----------------------------------------------------------------------------
 
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 #include <vector>
+#include <atomic>
+#include <new>
+
+// Rule sets can be evaluated on a pool of threads (see rpn_executor),
+// except on the ESP8266 which has none
+#ifndef ARDUINO_ARCH_ESP8266
+#define RPNLIB_THREADS
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+// ----------------------------------------------------------------------------
+
+// Source of memory for a context, modelled after std::pmr::memory_resource
+// (not available on the ESP toolchains). Returning nullptr is reported as
+// RPN_ERROR_OUT_OF_MEMORY.
+class rpn_allocator {
+
+    public:
+
+        virtual ~rpn_allocator() {}
+        virtual void * allocate(size_t size, size_t alignment) = 0;
+        virtual void deallocate(void * ptr, size_t size, size_t alignment) = 0;
+
+};
+
+// Hands out memory from a single buffer, only the last allocation can be
+// given back. Everything else is released at once with reset().
+class rpn_bump_allocator : public rpn_allocator {
+
+    public:
+
+        rpn_bump_allocator(void * buffer, size_t size);
+        void * allocate(size_t size, size_t alignment) override;
+        void deallocate(void * ptr, size_t size, size_t alignment) override;
+        void reset();
+        size_t used() const;
+
+    private:
+
+        unsigned char * _buffer;
+        size_t _size;
+        size_t _used = 0;
+
+};
+
+// Growable array of plain values (they are moved around with memcpy).
+// It uses malloc/realloc unless given an allocator. It can also be given
+// fixed storage, then it never allocates and growing past that capacity
+// fails instead.
+template <typename T>
+class rpn_vector {
+
+    public:
+
+        rpn_vector() {}
+        rpn_vector(const rpn_vector & other) : _allocator(other._allocator) { *this = other; }
+        ~rpn_vector() { _release(); }
+
+        rpn_vector & operator=(const rpn_vector & other) {
+            if ((this != &other) && reserve(other._size)) {
+                memcpy(_data, other._data, other._size * sizeof(T));
+                _size = other._size;
+            }
+            return *this;
+        }
+
+        // Storage is not owned and must outlive the vector
+        void attach(T * storage, size_t capacity, size_t size = 0) {
+            _release();
+            _data = storage;
+            _size = size;
+            _capacity = capacity;
+            _fixed = true;
+        }
+
+        // Drops the current contents, nullptr goes back to malloc
+        void set_allocator(rpn_allocator * allocator) {
+            _release();
+            _allocator = allocator;
+        }
+
+        rpn_allocator * get_allocator() const { return _allocator; }
+
+        bool reserve(size_t capacity) {
+            if (capacity <= _capacity) return true;
+            if (_fixed) return false;
+            T * data;
+            if (_allocator) {
+                data = (T *) _allocator->allocate(capacity * sizeof(T), alignof(T));
+                if (!data) return false;
+                if (_data) {
+                    memcpy(data, _data, _size * sizeof(T));
+                    _allocator->deallocate(_data, _capacity * sizeof(T), alignof(T));
+                }
+            } else {
+                data = (T *) realloc(_data, capacity * sizeof(T));
+                if (!data) return false;
+            }
+            _data = data;
+            _capacity = capacity;
+            return true;
+        }
+
+        bool push_back(const T & value) {
+            if ((_size == _capacity) && !reserve(_capacity ? 2 * _capacity : 4)) return false;
+            _data[_size++] = value;
+            return true;
+        }
+
+        bool append(const T * values, size_t count) {
+            if (!reserve(_size + count)) return false;
+            memcpy(_data + _size, values, count * sizeof(T));
+            _size += count;
+            return true;
+        }
+
+        bool resize(size_t size, const T & value = T()) {
+            if (!reserve(size)) return false;
+            for (size_t i=_size; i<size; i++) _data[i] = value;
+            _size = size;
+            return true;
+        }
+
+        bool assign(size_t size, const T & value) {
+            if (!reserve(size)) return false;
+            _size = 0;
+            return resize(size, value);
+        }
+
+        T * erase(T * position) {
+            memmove(position, position + 1, (end() - position - 1) * sizeof(T));
+            _size--;
+            return position;
+        }
+
+        void pop_back() { _size--; }
+        void clear() { _size = 0; }
+
+        size_t size() const { return _size; }
+        size_t capacity() const { return _capacity; }
+        bool empty() const { return 0 == _size; }
+        bool fixed() const { return _fixed; }
+        bool full() const { return _fixed && (_size == _capacity); }
+
+        T * data() { return _data; }
+        T * begin() { return _data; }
+        T * end() { return _data + _size; }
+        T & back() { return _data[_size - 1]; }
+        T & operator[](size_t index) { return _data[index]; }
+        const T * begin() const { return _data; }
+        const T * end() const { return _data + _size; }
+        const T & operator[](size_t index) const { return _data[index]; }
+
+    private:
+
+        void _release() {
+            if (!_fixed && _data) {
+                if (_allocator) {
+                    _allocator->deallocate(_data, _capacity * sizeof(T), alignof(T));
+                } else {
+                    free(_data);
+                }
+            }
+            _data = nullptr;
+            _size = 0;
+            _capacity = 0;
+            _fixed = false;
+        }
+
+        T * _data = nullptr;
+        size_t _size = 0;
+        size_t _capacity = 0;
+        bool _fixed = false;
+        rpn_allocator * _allocator = nullptr;
+
+};
+
+// Array that grows by adding segments, each twice the size of the previous
+// one, instead of moving its elements around. Elements can then be read
+// while a single writer appends more of them, readers only look at the
+// first size() ones. Erasing and shrinking must not race with readers.
+// Memory comes from the same places as for rpn_vector.
+#define RPN_SEGMENT_SIZE            16      // elements in the first segment
+#define RPN_SEGMENTS                24
+
+template <typename T>
+class rpn_segments {
+
+    public:
+
+        rpn_segments() {}
+        ~rpn_segments() { _release(); }
+
+        rpn_segments(const rpn_segments &) = delete;
+        rpn_segments & operator=(const rpn_segments &) = delete;
+
+        // Storage is not owned and must outlive the segments
+        void attach(T * storage, size_t capacity) {
+            _release();
+            _segments[0] = storage;
+            _capacity.store(capacity, std::memory_order_relaxed);
+            _fixed = true;
+        }
+
+        // Drops the current contents, nullptr goes back to malloc
+        void set_allocator(rpn_allocator * allocator) {
+            _release();
+            _allocator = allocator;
+        }
+
+        rpn_allocator * get_allocator() const { return _allocator; }
+
+        bool push_back(const T & value) {
+            size_t size = _size.load(std::memory_order_relaxed);
+            if ((size == _capacity.load(std::memory_order_relaxed)) && !_grow()) return false;
+            new (&_at(size)) T(value);
+            _size.store(size + 1, std::memory_order_release);
+            return true;
+        }
+
+        void erase(size_t index) {
+            size_t size = _size.load(std::memory_order_relaxed);
+            for (size_t i=index+1; i<size; i++) _at(i - 1) = _at(i);
+            _size.store(size - 1, std::memory_order_release);
+        }
+
+        // Only ever shrinks, capacity is kept
+        void truncate(size_t size) {
+            if (size < this->size()) _size.store(size, std::memory_order_release);
+        }
+
+        void clear() { truncate(0); }
+
+        size_t size() const { return _size.load(std::memory_order_acquire); }
+        size_t capacity() const { return _capacity.load(std::memory_order_relaxed); }
+        bool empty() const { return 0 == size(); }
+        bool fixed() const { return _fixed; }
+        bool full() const { return _fixed && (size() == capacity()); }
+
+        T & back() { return _at(size() - 1); }
+        T & operator[](size_t index) { return _at(index); }
+        const T & operator[](size_t index) const { return _at(index); }
+
+    private:
+
+        // Segment k holds the RPN_SEGMENT_SIZE << k elements after the
+        // RPN_SEGMENT_SIZE * (2^k - 1) in the previous segments
+        T & _at(size_t index) const {
+            if (_fixed) return _segments[0][index];
+            unsigned long block = index / RPN_SEGMENT_SIZE + 1;
+            unsigned int segment = 8 * sizeof(unsigned long) - 1 - __builtin_clzl(block);
+            return _segments[segment][index - RPN_SEGMENT_SIZE * ((1UL << segment) - 1)];
+        }
+
+        bool _grow() {
+            if (_fixed || (_count == RPN_SEGMENTS)) return false;
+            size_t size = (size_t) RPN_SEGMENT_SIZE << _count;
+            T * segment = (T *) (_allocator ? _allocator->allocate(size * sizeof(T), alignof(T)) : malloc(size * sizeof(T)));
+            if (!segment) return false;
+            _segments[_count++] = segment;
+            _capacity.store(_capacity.load(std::memory_order_relaxed) + size, std::memory_order_relaxed);
+            return true;
+        }
+
+        void _release() {
+            for (unsigned int k=0; k<_count; k++) {
+                if (_allocator) {
+                    _allocator->deallocate(_segments[k], (RPN_SEGMENT_SIZE << k) * sizeof(T), alignof(T));
+                } else {
+                    free(_segments[k]);
+                }
+            }
+            for (auto & segment : _segments) segment = nullptr;
+            _size.store(0, std::memory_order_relaxed);
+            _capacity.store(0, std::memory_order_relaxed);
+            _count = 0;
+            _fixed = false;
+        }
+
+        T * _segments[RPN_SEGMENTS] = {};
+        std::atomic<size_t> _size {0};
+        std::atomic<size_t> _capacity {0};  // read by rpn_memory_get while appending
+        unsigned int _count = 0;            // allocated segments
+        bool _fixed = false;
+        rpn_allocator * _allocator = nullptr;
+
+};
+
+// Open addressing hash table of unsigned ints, 0 marks an empty slot. It can
+// be probed while a single writer inserts into it: growing publishes a new
+// table and keeps the old ones around until clear(), as readers might still
+// be probing them.
+class rpn_table {
+
+    public:
+
+        rpn_table() {}
+        ~rpn_table() { _release(); }
+
+        rpn_table(const rpn_table &) = delete;
+        rpn_table & operator=(const rpn_table &) = delete;
+
+        // Storage is not owned and must outlive the table, size is a power of two
+        void attach(std::atomic<unsigned int> * storage, size_t size);
+        void set_allocator(rpn_allocator * allocator);
+        rpn_allocator * get_allocator() const { return _allocator; }
+
+        // Safe while a writer inserts, nullptr if there is no table yet
+        std::atomic<unsigned int> * slots(unsigned int & mask) const {
+            _block * block = _current.load(std::memory_order_acquire);
+            if (!block) return nullptr;
+            mask = block->size - 1;
+            return block->slots;
+        }
+
+        // Writer side. Created tables are not seen until they are published.
+        std::atomic<unsigned int> * create(size_t size);
+        void publish(std::atomic<unsigned int> * slots);
+        void clear();                       // empties the current table, releases the old ones
+
+        size_t size() const;
+        size_t bytes() const;               // including the old tables
+        bool empty() const { return 0 == size(); }
+        bool fixed() const { return _fixed.slots; }
+
+    private:
+
+        struct _block {
+            _block * retired;               // previous table
+            size_t size;
+            std::atomic<unsigned int> * slots;
+        };
+
+        void _free(_block *);
+        void _release();
+
+        std::atomic<_block *> _current {nullptr};
+        _block _fixed {nullptr, 0, nullptr};
+        rpn_allocator * _allocator = nullptr;
+
+};
 
 // ----------------------------------------------------------------------------
 
+// Variables keep their last few values, each one tagged with the epoch it
+// was published at, so evaluations can read them as of a given epoch (see
+// rpn_snapshot_acquire). Versions are rewritten in turns and read like a
+// seqlock, epoch 0 marks a version being written.
+#ifndef RPNLIB_VARIABLE_VERSIONS
+#define RPNLIB_VARIABLE_VERSIONS    2       // must be a power of two
+#endif
+
+// Evaluations whose snapshot expired are run again on a new one at most
+// that many times, see _rpn_snapshot_retry
+#ifndef RPNLIB_SNAPSHOT_RETRIES
+#define RPNLIB_SNAPSHOT_RETRIES     4
+#endif
+
+struct rpn_variable_version {
+    std::atomic<unsigned long> epoch;
+    std::atomic<float> value;
+};
+
 struct rpn_variable {
     char * name;
-    float value;
+    unsigned int symbol;
+    unsigned int hash;                      // of the name, checked before comparing names
+    unsigned long created;                  // epoch it was first set at
+    std::atomic<unsigned int> writes;       // versions written so far
+    rpn_variable_version versions[RPNLIB_VARIABLE_VERSIONS];
+    rpn_variable() {}
+    rpn_variable(char * name, unsigned int symbol, unsigned int hash, float value, unsigned long epoch) :
+        name(name), symbol(symbol), hash(hash), created(epoch), writes(1) {
+        for (auto & version : versions) {
+            version.epoch.store(0, std::memory_order_relaxed);
+            version.value.store(value, std::memory_order_relaxed);
+        }
+        versions[0].epoch.store(epoch, std::memory_order_relaxed);
+    }
+    rpn_variable(const rpn_variable & other) { *this = other; }
+    rpn_variable & operator=(const rpn_variable & other) {
+        name = other.name;
+        symbol = other.symbol;
+        hash = other.hash;
+        created = other.created;
+        writes.store(other.writes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        for (unsigned int i=0; i<RPNLIB_VARIABLE_VERSIONS; i++) {
+            versions[i].epoch.store(other.versions[i].epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            versions[i].value.store(other.versions[i].value.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        return *this;
+    }
 };
 
 struct rpn_context;
 
+enum rpn_errors {
+    RPN_ERROR_OK,
+    RPN_ERROR_UNKNOWN_TOKEN,
+    RPN_ERROR_ARGUMENT_COUNT_MISMATCH,
+    RPN_ERROR_DIVIDE_BY_ZERO,
+    RPN_ERROR_UNVALID_ARGUMENT,
+    RPN_ERROR_INVALID_PROGRAM,
+    RPN_ERROR_OUT_OF_MEMORY,
+    RPN_ERROR_SNAPSHOT_EXPIRED,
+    RPN_ERROR_NOT_FINISHED,
+    RPN_ERROR_UNBALANCED,
+    RPN_ERROR_STALE_PROGRAM,
+    RPN_ERROR_FILE
+};
+
+// Value of a sub-expression shared by the rules of a rule set, and the
+// error evaluating it gave, reported by the rules reading it
+struct rpn_temporary {
+    float value;
+    rpn_errors error;
+};
+
+// Resolved variable for bulk updates, see rpn_variable_resolve
+struct rpn_variable_handle {
+    size_t position;
+    unsigned int symbol;
+};
+
+// Read only view of the stack, bottom first (the top is the last value).
+// It is valid until the stack changes.
+struct rpn_stack_span {
+    const float * data;
+    size_t size;
+    const float * begin() const { return data; }
+    const float * end() const { return data + size; }
+    const float & operator[](size_t index) const { return data[index]; }
+};
+
+// Supplies the value of variables that were not set, see rpn_provider_set
+struct rpn_provider {
+    const char * name;                      // not copied, must outlive the provider
+    unsigned int length;
+    bool prefix;                            // name ended with '*'
+    bool (*callback)(rpn_context &, const char *, float &);
+};
+
+// Value a provider gave while a snapshot was pinned
+struct rpn_provided {
+    unsigned int hash;
+    unsigned int name;                      // offset in the cached names
+    unsigned int length;
+    float value;
+    bool found;
+};
+
+// Value a single context reads for a variable instead of the shared one,
+// see rpn_queue
+struct rpn_override {
+    const char * name;                      // not copied, must outlive it
+    unsigned int length;
+    unsigned int hash;
+    float value;
+};
+
+// Operators take argc values and leave results on the stack, the compiler
+// uses that to check that both arms of a conditional leave the same depth
+#define RPN_RESULTS_VARIABLE        0xFF    // depends on the values taken
+
 struct rpn_operator {
     char * name;
+    unsigned int symbol;
     unsigned char argc;
+    unsigned char results;
+    bool pure;                              // builtin, depends only on the values it takes
     bool (*callback)(rpn_context &);
 };
 
+// Word defined from an expression and kept compiled, see rpn_word_set.
+// Bodies and their bindings are kept back to back in the context.
+#ifndef RPNLIB_WORD_INLINE
+#define RPNLIB_WORD_INLINE          8       // instructions, words up to this long are inlined
+#endif
+
+struct rpn_word {
+    char * name;
+    unsigned int symbol;
+    unsigned int version;                   // changes when redefined, 0 once deleted
+    unsigned int program;                   // offset of the body in the word code
+    unsigned int size;
+    unsigned int bindings;                  // offset in the word bindings
+    unsigned int count;                     // number of bindings
+    unsigned char argc;
+    unsigned char results;
+    bool inlined;                           // short and without control flow
+};
+
+struct rpn_operator_profile {
+    unsigned long calls;
+    unsigned long long ticks;
+};
+
+// Binary trace of every executed token, only available when built with
+// the RPNLIB_TRACE flag. Otherwise the tracing code is not compiled in.
+#ifdef RPNLIB_TRACE
+
+#ifndef RPNLIB_TRACE_SIZE
+#define RPNLIB_TRACE_SIZE           128     // number of events, must be a power of two
+#endif
+
+#define RPN_TRACE_NUMBER            0xFFFD
+#define RPN_TRACE_VARIABLE          0xFFFE
+#define RPN_TRACE_ERROR             0xFFFF  // top holds the error code
+
+struct rpn_trace_event {
+    unsigned int timestamp;                 // ticks
+    float top;                              // top of the stack after the token
+    unsigned short opcode;                  // operator index or one of the above
+    unsigned short depth;                   // stack size after the token
+};
+
+struct rpn_trace_buffer {
+    rpn_trace_event events[RPNLIB_TRACE_SIZE];
+    unsigned long head = 0;
+};
+
+#endif
+
+// Operator and variable names, interned once per context into fixed size
+// chunks and compared by id. They are only released all at once, when the
+// context has neither operators nor variables left.
+#ifndef RPNLIB_ARENA_CHUNK_SIZE
+#define RPNLIB_ARENA_CHUNK_SIZE     256
+#endif
+
+struct rpn_symbols {
+    rpn_symbols() {}
+    rpn_symbols(const rpn_symbols &) = delete;
+    rpn_symbols & operator=(const rpn_symbols &) = delete;
+    ~rpn_symbols();                         // releases the chunks, so does rpn_clear
+    struct chunk {
+        char * data;
+        unsigned int size;
+    };
+    rpn_vector<chunk> chunks;
+    char * initial = nullptr;               // first chunk, not owned
+    unsigned int initial_size = 0;
+    char * next = nullptr;                  // free space in the current chunk
+    unsigned int left = 0;
+    unsigned int base = 0;                  // ids below belong to the parent context
+    rpn_segments<char *> names;             // indexed by symbol id - base
+    rpn_table table;                        // hash table of symbol id - base + 1
+    struct {                                // state saved by rpn_checkpoint
+        unsigned int names;
+        unsigned int chunks;
+        char * next;
+        unsigned int left;
+    } checkpoint {};
+};
+
+// Memory held by a context, refreshed whenever one of its buffers changes
+// (variables and names by the writers, the rest by the thread evaluating)
+struct rpn_memory_usage {
+    size_t size;                            // elements in use
+    size_t capacity;                        // elements there is room for
+    size_t bytes;
+    size_t peak;                            // most bytes held at once
+};
+
+struct rpn_memory {
+    rpn_memory_usage stack;
+    rpn_memory_usage variables;
+    rpn_memory_usage operators;             // including the profiling counters and words
+    rpn_memory_usage names;                 // bytes include the lookup tables
+    size_t bytes;
+    size_t peak;
+};
+
+// Loops (do ... loop) run at most RPNLIB_LOOP_MAX times each, and at most
+// RPNLIB_LOOP_DEPTH of them can be nested in one another
+#ifndef RPNLIB_LOOP_MAX
+#define RPNLIB_LOOP_MAX             1000
+#endif
+
+#ifndef RPNLIB_LOOP_DEPTH
+#define RPNLIB_LOOP_DEPTH           4
+#endif
+
+// Blocks (if, else and do) rpn_process can be in at once, loops included
+#ifndef RPNLIB_BLOCK_DEPTH
+#define RPNLIB_BLOCK_DEPTH          16
+#endif
+
+// Program left half way, see rpn_execute_budget
+struct rpn_resume {
+    unsigned long program;                  // id of the paused program, 0 if none
+    size_t depth;                           // stack size when it started
+    unsigned long position;                 // offset of the next instruction
+    unsigned char loops;                    // open loops
+    unsigned long counters[RPNLIB_LOOP_DEPTH];  // iterations left in each of them
+};
+
+// Memory comes from malloc unless an allocator is given, which covers the
+// stack, variables, operators and names. It must outlive the context.
 struct rpn_context {
-    std::vector<float> stack;
-    std::vector<rpn_variable> variables;
-    std::vector<rpn_operator> operators;
+    rpn_context() {}
+    explicit rpn_context(rpn_allocator &);
+    rpn_vector<float> stack;
+    rpn_segments<rpn_variable> variables;   // in the order they were first set
+    rpn_table index;                        // hash table of variable position + 1, by name
+    rpn_vector<rpn_provider> providers;
+    rpn_vector<rpn_provided> provided;      // cached until the next snapshot is pinned
+    rpn_vector<char> provided_names;
+    rpn_vector<rpn_override> overrides;     // seen by this context only, dropped by rpn_reset
+    rpn_vector<rpn_operator> operators;
+    rpn_vector<rpn_operator_profile> profile;
+    rpn_vector<rpn_word> words;
+    rpn_vector<unsigned char> word_code;
+    rpn_vector<unsigned int> word_bindings;
+    unsigned int word_versions = 0;         // last version given to a word
+    rpn_symbols symbols;
+    rpn_context * parent = nullptr;         // see rpn_fork
+    struct {                                // kept by rpn_reset, see rpn_checkpoint
+        size_t variables;
+        size_t operators;
+        size_t words;
+        size_t providers;
+    } checkpoint {};
+    rpn_memory memory {};                   // refreshed by the thread evaluating, see rpn_memory_get
+    std::atomic<size_t> variables_bytes {0};  // kept by writers as they allocate, with the names
+    std::atomic<size_t> names_bytes {0};
+    std::atomic<bool> writer {false};       // held while setting variables and adding names,
+                                            // forks use the ones of the first context instead
+    std::atomic<unsigned long> epoch {0};   // last published variable update
+    unsigned long snapshot = 0;             // epoch variables are read at while pinned
+    unsigned int pins = 0;
+    rpn_resume paused {};
+    const rpn_temporary * temporaries = nullptr;    // of the rule set being executed
+    size_t temporaries_size = 0;
+    rpn_vector<rpn_temporary> values;       // temporaries of the rule set last updated here
+    unsigned long values_ruleset = 0;       // its id, 0 if none
+    unsigned long values_snapshot = 0;      // epoch they were computed at
+    bool profiling = false;
+    #ifdef RPNLIB_TRACE
+    rpn_trace_buffer * trace = nullptr;
+    #endif
 };
 
-enum rpn_errors {
-    RPN_ERROR_OK,
-    RPN_ERROR_UNKNOWN_TOKEN,
-    RPN_ERROR_ARGUMENT_COUNT_MISMATCH,
-    RPN_ERROR_DIVIDE_BY_ZERO,
-    RPN_ERROR_UNVALID_ARGUMENT
+// Context that keeps everything in fixed size arrays and never allocates
+// memory. Anything that would go over one of the capacities fails with
+// RPN_ERROR_OUT_OF_MEMORY. OPERATORS must leave room for the builtin ones
+// and NAMES is the room (in bytes) for all operator and variable names.
+// There is room for a few providers, but their values are not cached,
+// and for the temporaries of a rule set, but none for words.
+#ifndef RPNLIB_STATIC_PROVIDERS
+#define RPNLIB_STATIC_PROVIDERS     4
+#endif
+
+#ifndef RPNLIB_STATIC_TEMPORARIES
+#define RPNLIB_STATIC_TEMPORARIES   16
+#endif
+
+void _rpn_memory_recount(rpn_context &);
+
+constexpr size_t _rpn_pow2(size_t n, size_t p = 16) {
+    return (p >= n) ? p : _rpn_pow2(n, 2 * p);
+}
+
+template <size_t STACK, size_t VARIABLES, size_t OPERATORS, size_t NAMES = 12 * (VARIABLES + OPERATORS)>
+class rpn_static_context : public rpn_context {
+
+    public:
+
+        rpn_static_context() {
+            stack.attach(_stack, STACK);
+            variables.attach(_variables, VARIABLES);
+            index.attach(_index, INDEX);
+            providers.attach(_providers, RPNLIB_STATIC_PROVIDERS);
+            provided.attach(nullptr, 0);
+            provided_names.attach(nullptr, 0);
+            overrides.attach(nullptr, 0);
+            operators.attach(_operators, OPERATORS);
+            profile.attach(_profile, OPERATORS);
+            words.attach(nullptr, 0);
+            word_code.attach(nullptr, 0);
+            word_bindings.attach(nullptr, 0);
+            values.attach(_values, RPNLIB_STATIC_TEMPORARIES);
+            symbols.chunks.attach(nullptr, 0);
+            symbols.names.attach(_symbols, VARIABLES + OPERATORS);
+            symbols.table.attach(_table, TABLE);
+            symbols.initial = symbols.next = _arena;
+            symbols.initial_size = symbols.left = NAMES;
+            _rpn_memory_recount(*this);
+        }
+
+        rpn_static_context(const rpn_static_context &) = delete;
+        rpn_static_context & operator=(const rpn_static_context &) = delete;
+
+    private:
+
+        // Hash tables at most half full, so they never need to grow
+        static constexpr size_t TABLE = _rpn_pow2(2 * (VARIABLES + OPERATORS));
+        static constexpr size_t INDEX = _rpn_pow2(2 * VARIABLES);
+
+        float _stack[STACK];
+        rpn_variable _variables[VARIABLES];
+        std::atomic<unsigned int> _index[INDEX];
+        rpn_provider _providers[RPNLIB_STATIC_PROVIDERS];
+        rpn_operator _operators[OPERATORS];
+        rpn_operator_profile _profile[OPERATORS];
+        rpn_temporary _values[RPNLIB_STATIC_TEMPORARIES];
+        char * _symbols[VARIABLES + OPERATORS];
+        std::atomic<unsigned int> _table[TABLE];
+        char _arena[NAMES];
+
+};
+
+// Pre-initialized contexts to be handed out per request. Contexts are reset
+// when given back, the pool grows when all of them are in use.
+struct rpn_pool {
+    std::vector<rpn_context *> contexts;
+    std::vector<rpn_context *> available;
+    bool (*setup)(rpn_context &) = nullptr;
+    std::atomic<bool> locked {false};
+    ~rpn_pool();
+};
+
+// Log-linear latency histogram, 8 linear sub-buckets per power of two
+// (12.5% precision) covering up to 2^32 ticks. Safe to read while
+// other threads record into it.
+#define RPN_HISTOGRAM_SUB_BUCKETS   8
+#define RPN_HISTOGRAM_BUCKETS       240
+
+struct rpn_histogram {
+    std::atomic<unsigned long> counts[RPN_HISTOGRAM_BUCKETS];
+    std::atomic<unsigned long> calls;
+    std::atomic<unsigned long> max;
+    rpn_histogram();
+};
+
+// Compiled program, see rpnlib_program.cpp for the binary format.
+// Programs are bound to the context they were compiled or loaded for.
+#define RPN_PROGRAM_VERSION         1
+
+struct rpn_program {
+    std::vector<unsigned char> storage;     // serialized program, empty when loaded in place
+    const unsigned char * external = nullptr;
+    std::vector<unsigned int> bindings;     // context operator indexes, variable name offsets, then words
+    unsigned int size = 0;
+    unsigned long id = 0;                   // new one every time it is compiled or loaded
+};
+
+// Many programs compiled back to back into a single arena
+struct rpn_ruleset {
+    struct rule {
+        unsigned int program;               // offset in arena
+        unsigned int bindings;              // offset in bindings
+    };
+    std::vector<unsigned char> arena;
+    std::vector<unsigned int> bindings;
+    std::vector<rule> rules;
+    std::vector<rule> temporaries;          // shared sub-expressions, see rpn_ruleset_optimize
+    unsigned long id = 0;                   // new one every time it is compiled or optimized
+    unsigned long error_line = 0;           // line that failed to compile, 1-based
+};
+
+// Evaluates every rule of a rule set at once, spread over a pool of threads
+// plus the calling one. Each worker is a fork of the context with its own
+// stack, and all of them read the variables as of the same snapshot. Rules
+// are split evenly between workers, who take them in batches from the
+// front of their share and then from the shares of the others.
+#ifdef RPNLIB_THREADS
+
+#define RPN_EXECUTOR_BATCH          16      // rules taken at once
+
+struct rpn_executor_worker {
+    rpn_context context;
+    std::atomic<size_t> next {0};           // first rule of its share not taken yet
+    size_t end = 0;
+    size_t failed = 0;                      // first rule it saw failing in the last run
+    rpn_errors error = RPN_ERROR_OK;
+};
+
+struct rpn_executor {
+    std::vector<rpn_executor_worker *> workers;
+    std::vector<std::thread> threads;       // one less than workers, the caller is the first one
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    unsigned long runs = 0;
+    size_t running = 0;                     // threads still working on the current run
+    bool stopping = false;
+    const rpn_ruleset * ruleset = nullptr;  // current run
+    float * results = nullptr;
+    rpn_errors * errors = nullptr;
+    unsigned long snapshot = 0;
+    std::vector<rpn_temporary> temporaries; // shared sub-expressions, evaluated before the rules
+    ~rpn_executor();
 };
 
+// Programs submitted from any thread and evaluated in the background, see
+// rpnlib_queue.cpp. Requests belong to the caller and must stay around
+// (along with their program and inputs) until they are done.
+#define RPN_QUEUE_BATCH             32      // requests taken at once
+
+struct rpn_queue;
+
+struct rpn_request {
+    const rpn_program * program = nullptr;
+    const char * const * names = nullptr;   // inputs, set on the evaluating context
+    const float * values = nullptr;
+    size_t count = 0;
+    void (*callback)(rpn_request &) = nullptr;
+    void * data = nullptr;                  // for the callback
+    float result = 0;                       // top of the stack, 0 if it was empty
+    rpn_errors error = RPN_ERROR_OK;
+    std::atomic<bool> done {false};
+    rpn_queue * queue = nullptr;            // set when submitted
+};
+
+// Threads sleeping until something happens, see rpnlib_queue.cpp. Waking
+// them up never takes a lock on Linux (futex), elsewhere it takes one but
+// only while there is somebody sleeping.
+struct rpn_event {
+    std::atomic<unsigned int> count {0};    // bumped on every wake up
+    std::atomic<unsigned int> sleepers {0};
+    #ifndef __linux__
+    std::mutex lock;
+    std::condition_variable wake;
+    #endif
+};
+
+struct rpn_queue {
+    struct cell {
+        std::atomic<size_t> sequence;
+        rpn_request * request;
+    };
+    alignas(64) std::atomic<size_t> head {0};       // next to be taken
+    alignas(64) std::atomic<size_t> tail {0};       // next to be submitted
+    alignas(64) cell * cells = nullptr;
+    size_t mask = 0;
+    std::vector<rpn_context *> evaluators;  // forks of the queue context
+    std::vector<std::thread> threads;
+    rpn_event submitted;                    // idle evaluators sleep on it
+    rpn_event completed;                    // and rpn_request_wait on this one
+    std::atomic<unsigned int> submitting {0};   // submissions rpn_queue_clear waits for
+    std::atomic<bool> closed {false};       // to submissions
+    std::atomic<bool> stopping {false};     // evaluators, once closed and drained
+    ~rpn_queue();
+};
+
+#endif
+
 // ----------------------------------------------------------------------------
 
-extern rpn_errors rpn_error;
+// The last error is kept per thread, except on the ESP8266 (no threads)
+#ifdef ARDUINO_ARCH_ESP8266
+#define RPNLIB_THREAD_LOCAL
+#else
+#define RPNLIB_THREAD_LOCAL thread_local
+#endif
+
+extern RPNLIB_THREAD_LOCAL rpn_errors rpn_error;
 extern void(*_rpn_debug_callback)(rpn_context &, char *);
 
 // ----------------------------------------------------------------------------
 
 bool rpn_operators_init(rpn_context &);
-bool rpn_operator_set(rpn_context &, const char *, unsigned char, bool (*)(rpn_context &));
+bool rpn_operator_set(rpn_context &, const char *, unsigned char, bool (*)(rpn_context &), unsigned char results = RPN_RESULTS_VARIABLE);
 bool rpn_operators_clear(rpn_context &);
 
+bool rpn_word_set(rpn_context &, const char *, const char *);
+bool rpn_word_del(rpn_context &, const char *);
+bool rpn_words_clear(rpn_context &);
+
 bool rpn_variable_set(rpn_context &, const char *, float);
 bool rpn_variable_get(rpn_context &, const char *, float &);
 bool rpn_variable_del(rpn_context &, const char *);
-unsigned char rpn_variables_size(rpn_context &);
-char * rpn_variable_name(rpn_context &, unsigned char);
+size_t rpn_variables_size(rpn_context &);
+char * rpn_variable_name(rpn_context &, size_t);
 bool rpn_variables_clear(rpn_context &);
+bool rpn_variables_set_many(rpn_context &, const char * const [], const float [], size_t);
+bool rpn_variable_resolve(rpn_context &, const char *, rpn_variable_handle &);
+bool rpn_variables_set_many(rpn_context &, const rpn_variable_handle [], const float [], size_t);
+
+bool rpn_provider_set(rpn_context &, const char *, bool (*)(rpn_context &, const char *, float &));
+bool rpn_provider_del(rpn_context &, const char *);
+bool rpn_providers_clear(rpn_context &);
+
+bool rpn_snapshot_acquire(rpn_context &);
+bool rpn_snapshot_release(rpn_context &);
 
 bool rpn_stack_clear(rpn_context &);
 bool rpn_stack_push(rpn_context &, float);
 bool rpn_stack_pop(rpn_context &, float &);
-unsigned char rpn_stack_size(rpn_context &);
-bool rpn_stack_get(rpn_context &, unsigned char, float &);
+size_t rpn_stack_size(rpn_context &);
+bool rpn_stack_get(rpn_context &, size_t, float &);
+rpn_stack_span rpn_stack_view(rpn_context &);
+bool rpn_stack_push_many(rpn_context &, const float [], size_t);
+bool rpn_stack_pop_many(rpn_context &, float [], size_t);
 
 bool rpn_process(rpn_context &, const char *, bool variable_must_exist = false);
+bool rpn_process(rpn_context &, const char *, rpn_histogram &, bool variable_must_exist = false);
 bool rpn_init(rpn_context &);
+
+bool rpn_compile(rpn_context &, const char *, rpn_program &, bool variable_must_exist = false);
+bool rpn_execute(rpn_context &, const rpn_program &);
+bool rpn_execute(rpn_context &, const rpn_program &, rpn_histogram &);
+bool rpn_execute_budget(rpn_context &, const rpn_program &, unsigned long instructions, unsigned long microseconds = 0);
+bool rpn_execute_reset(rpn_context &);
+unsigned int rpn_program_size(const rpn_program &);
+bool rpn_program_serialize(const rpn_program &, unsigned char *, unsigned int);
+bool rpn_program_load(rpn_context &, rpn_program &, const unsigned char *, unsigned int);
+bool rpn_program_clear(rpn_program &);
+
+bool rpn_ruleset_compile(rpn_context &, rpn_ruleset &, const char *, size_t, bool variable_must_exist = false);
+#ifndef ARDUINO
+bool rpn_ruleset_load(rpn_context &, rpn_ruleset &, const char *, bool variable_must_exist = false);
+#endif
+size_t rpn_ruleset_size(const rpn_ruleset &);
+bool rpn_ruleset_execute(rpn_context &, const rpn_ruleset &, size_t);
+bool rpn_ruleset_optimize(rpn_context &, rpn_ruleset &);
+bool rpn_ruleset_update(rpn_context &, const rpn_ruleset &);
+bool rpn_ruleset_clear(rpn_ruleset &);
+
+#ifdef RPNLIB_THREADS
+bool rpn_executor_init(rpn_executor &, rpn_context &, size_t workers = 0);
+bool rpn_executor_run(rpn_executor &, const rpn_ruleset &, float [], rpn_errors [] = nullptr);
+size_t rpn_executor_workers(rpn_executor &);
+bool rpn_executor_clear(rpn_executor &);
+
+bool rpn_queue_init(rpn_queue &, rpn_context &, size_t capacity, size_t evaluators = 1);
+bool rpn_queue_submit(rpn_queue &, rpn_request &);
+bool rpn_request_wait(rpn_request &);
+bool rpn_queue_clear(rpn_queue &);
+#endif
 bool rpn_clear(rpn_context &);
+bool rpn_fork(rpn_context &, rpn_context &);
+bool rpn_checkpoint(rpn_context &);
+bool rpn_reset(rpn_context &);
+
+bool rpn_pool_init(rpn_pool &, size_t, bool (*)(rpn_context &) = nullptr);
+rpn_context * rpn_pool_acquire(rpn_pool &);
+bool rpn_pool_release(rpn_pool &, rpn_context *);
+size_t rpn_pool_available(rpn_pool &);
+bool rpn_pool_clear(rpn_pool &);
 
 bool rpn_debug(void(*)(rpn_context &, char *));
 
+bool rpn_profile(rpn_context &, bool);
+bool rpn_profile_reset(rpn_context &);
+bool rpn_profile_get(rpn_context &, size_t, const char * &, unsigned long &, unsigned long long &);
+
+#ifdef RPNLIB_TRACE
+bool rpn_trace(rpn_context &, rpn_trace_buffer *);
+bool rpn_trace_clear(rpn_trace_buffer &);
+unsigned int rpn_trace_size(rpn_trace_buffer &);
+bool rpn_trace_get(rpn_trace_buffer &, unsigned int, rpn_trace_event &);
+int rpn_trace_format(rpn_context &, const rpn_trace_event &, unsigned int, char *, unsigned int);
+#endif
+
+bool rpn_memory_get(rpn_context &, rpn_memory &);
+bool rpn_memory_reset(rpn_context &);
+
+bool rpn_histogram_reset(rpn_histogram &);
+unsigned long rpn_histogram_calls(rpn_histogram &);
+unsigned long long rpn_histogram_percentile(rpn_histogram &, float);
+unsigned long long rpn_histogram_max(rpn_histogram &);
+
 // ----------------------------------------------------------------------------
 
 #endif // rpnlib_h
@@ -0,0 +1,54 @@
+/*
+
+RPNlib
+
+Copyright (C) 2018-2019 by Xose Pérez <xose dot perez at gmail dot com>
+
+The rpnlib library is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+The rpnlib library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with the rpnlib library.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "rpnlib.h"
+
+// ----------------------------------------------------------------------------
+// Bump allocator
+// ----------------------------------------------------------------------------
+
+rpn_bump_allocator::rpn_bump_allocator(void * buffer, size_t size) :
+    _buffer((unsigned char *) buffer), _size(size) {}
+
+void * rpn_bump_allocator::allocate(size_t size, size_t alignment) {
+    size_t start = _used;
+    size_t misalignment = (size_t) (_buffer + start) % alignment;
+    if (misalignment) start += alignment - misalignment;
+    if ((start > _size) || (size > _size - start)) return nullptr;
+    _used = start + size;
+    return _buffer + start;
+}
+
+// Vectors give back the previous block after growing, only
+// the most recent one can be reused
+void rpn_bump_allocator::deallocate(void * ptr, size_t size, size_t) {
+    if ((unsigned char *) ptr + size == _buffer + _used) {
+        _used -= size;
+    }
+}
+
+void rpn_bump_allocator::reset() {
+    _used = 0;
+}
+
+size_t rpn_bump_allocator::used() const {
+    return _used;
+}
@@ -0,0 +1,213 @@
+/*
+
+RPNlib
+
+Copyright (C) 2018-2019 by Xose Pérez <xose dot perez at gmail dot com>
+
+The rpnlib library is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+The rpnlib library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with the rpnlib library.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "rpnlib.h"
+#include "rpnlib_internal.h"
+
+#ifdef RPNLIB_THREADS
+
+#include <new>
+
+// ----------------------------------------------------------------------------
+// Rule set executor
+// ----------------------------------------------------------------------------
+//
+// Threads sleep between runs. A run hands every worker an even share of
+// the rules, the shares are consumed from the front with an atomic counter
+// by their owner and, once it is done with its own, by any other worker.
+// Nothing else is shared while evaluating: each worker has its own stack,
+// error and provider cache, and results go to distinct slots. Temporaries
+// of an optimized rule set are evaluated by the caller before the run.
+
+rpn_executor::~rpn_executor() {
+    rpn_executor_clear(*this);
+}
+
+void _rpn_executor_rule(rpn_executor & executor, rpn_executor_worker & worker, size_t index) {
+    rpn_context & ctxt = worker.context;
+    rpn_stack_clear(ctxt);
+    bool result = _rpn_ruleset_execute(ctxt, *executor.ruleset, index, executor.temporaries.data());
+    executor.results[index] = (result && !ctxt.stack.empty()) ? ctxt.stack.back() : 0;
+    if (executor.errors) executor.errors[index] = rpn_error;
+    if (!result && (index < worker.failed)) {
+        worker.failed = index;
+        worker.error = rpn_error;
+    }
+}
+
+// Own share first, then the others, starting with the next worker
+void _rpn_executor_work(rpn_executor & executor, size_t id) {
+    rpn_executor_worker & worker = *executor.workers[id];
+    size_t count = executor.workers.size();
+    _rpn_snapshot_acquire(worker.context, executor.snapshot);
+    for (size_t k=0; k<count; k++) {
+        rpn_executor_worker & share = *executor.workers[(id + k) % count];
+        while (true) {
+            size_t first = share.next.fetch_add(RPN_EXECUTOR_BATCH, std::memory_order_relaxed);
+            if (first >= share.end) break;
+            size_t last = (share.end - first < RPN_EXECUTOR_BATCH) ? share.end : first + RPN_EXECUTOR_BATCH;
+            for (size_t index = first; index < last; index++) {
+                _rpn_executor_rule(executor, worker, index);
+            }
+        }
+    }
+    rpn_snapshot_release(worker.context);
+    rpn_stack_clear(worker.context);
+}
+
+void _rpn_executor_thread(rpn_executor & executor, size_t id) {
+    unsigned long runs = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(executor.lock);
+            executor.wake.wait(lock, [&executor, runs]() {
+                return executor.stopping || (executor.runs != runs);
+            });
+            if (executor.stopping) return;
+            runs = executor.runs;
+        }
+        _rpn_executor_work(executor, id);
+        {
+            std::lock_guard<std::mutex> lock(executor.lock);
+            if (0 == --executor.running) executor.done.notify_one();
+        }
+    }
+}
+
+// Workers are forks of the context, so nothing but its variables may
+// change until the executor is cleared. Defaults to a worker per core.
+bool rpn_executor_init(rpn_executor & executor, rpn_context & ctxt, size_t workers) {
+    rpn_executor_clear(executor);
+    if (0 == workers) workers = std::thread::hardware_concurrency();
+    if (0 == workers) workers = 1;
+    executor.workers.reserve(workers);
+    for (size_t i=0; i<workers; i++) {
+        rpn_executor_worker * worker = new (std::nothrow) rpn_executor_worker();
+        if (!worker) {
+            rpn_executor_clear(executor);
+            rpn_error = RPN_ERROR_OUT_OF_MEMORY;
+            return false;
+        }
+        rpn_fork(ctxt, worker->context);
+        executor.workers.push_back(worker);
+    }
+    executor.threads.reserve(workers - 1);
+    for (size_t i=1; i<workers; i++) {
+        executor.threads.emplace_back(_rpn_executor_thread, std::ref(executor), i);
+    }
+    return true;
+}
+
+// Every rule once, against a single snapshot
+bool _rpn_executor_run(rpn_executor & executor, const rpn_ruleset & ruleset, float results[], rpn_errors errors[]) {
+
+    size_t count = executor.workers.size();
+    size_t rules = ruleset.rules.size();
+    for (size_t i=0; i<count; i++) {
+        rpn_executor_worker & worker = *executor.workers[i];
+        worker.next.store(rules * i / count, std::memory_order_relaxed);
+        worker.end = rules * (i + 1) / count;
+        worker.failed = rules;
+        worker.error = RPN_ERROR_OK;
+    }
+
+    // All of them read the variables as of now, sub-expressions
+    // shared by the rules are evaluated before waking the workers
+    rpn_context & first = executor.workers[0]->context;
+    unsigned long snapshot = _rpn_root(first).epoch.load(std::memory_order_acquire);
+    if (!ruleset.temporaries.empty()) {
+        executor.temporaries.resize(ruleset.temporaries.size());
+        _rpn_snapshot_acquire(first, snapshot);
+        _rpn_ruleset_update(first, ruleset, executor.temporaries.data());
+        rpn_snapshot_release(first);
+    }
+    {
+        std::lock_guard<std::mutex> lock(executor.lock);
+        executor.ruleset = &ruleset;
+        executor.results = results;
+        executor.errors = errors;
+        executor.snapshot = snapshot;
+        executor.running = count - 1;
+        executor.runs++;
+    }
+    executor.wake.notify_all();
+    _rpn_executor_work(executor, 0);
+    {
+        std::unique_lock<std::mutex> lock(executor.lock);
+        executor.done.wait(lock, [&executor]() { return 0 == executor.running; });
+        executor.ruleset = nullptr;
+    }
+
+    size_t failed = rules;
+    rpn_error = RPN_ERROR_OK;
+    for (auto worker : executor.workers) {
+        if (worker->failed < failed) {
+            failed = worker->failed;
+            rpn_error = worker->error;
+        }
+    }
+    return (RPN_ERROR_OK == rpn_error);
+
+}
+
+// Evaluates every rule, results[i] gets the top of the stack left by rule
+// i (0 if it left nothing or failed) and errors[i], if given, its error.
+// Fails if any rule did, rpn_error is then the error of the first of them.
+// Runs that lost their snapshot start over on a new one, a bounded number
+// of times, like evaluations on a single context.
+bool rpn_executor_run(rpn_executor & executor, const rpn_ruleset & ruleset, float results[], rpn_errors errors[]) {
+    if (executor.workers.empty()) {
+        rpn_error = RPN_ERROR_UNVALID_ARGUMENT;
+        return false;
+    }
+    rpn_context & first = executor.workers[0]->context;
+    unsigned int retries = 0;
+    bool result;
+    do {
+        result = _rpn_executor_run(executor, ruleset, results, errors);
+    } while (!result && _rpn_snapshot_retry(first, true, retries));
+    return result;
+}
+
+size_t rpn_executor_workers(rpn_executor & executor) {
+    return executor.workers.size();
+}
+
+// Stops the threads and releases the forks, the executor can be
+// initialized again afterwards
+bool rpn_executor_clear(rpn_executor & executor) {
+    {
+        std::lock_guard<std::mutex> lock(executor.lock);
+        executor.stopping = true;
+    }
+    executor.wake.notify_all();
+    for (auto & thread : executor.threads) thread.join();
+    executor.threads.clear();
+    for (auto worker : executor.workers) {
+        rpn_clear(worker->context);
+        delete worker;
+    }
+    executor.workers.clear();
+    executor.stopping = false;
+    return true;
+}
+
+#endif
@@ -0,0 +1,280 @@
+/*
+
+RPNlib
+
+Copyright (C) 2018-2019 by Xose Pérez <xose dot perez at gmail dot com>
+
+The rpnlib library is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+The rpnlib library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with the rpnlib library.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// Helpers shared by the library sources, not part of the public API
+
+#ifndef rpnlib_internal_h
+#define rpnlib_internal_h
+
+#include "rpnlib.h"
+
+#include <string.h>
+
+// ----------------------------------------------------------------------------
+
+// Programs might be executed straight from flash,
+// the ESP8266 can only read it 32 bits at a time
+#ifdef ARDUINO_ARCH_ESP8266
+    #include <pgmspace.h>
+    #define RPN_READ_BYTE(p)            pgm_read_byte(p)
+    #define RPN_READ_BLOCK(d, s, n)     memcpy_P(d, s, n)
+#else
+    #define RPN_READ_BYTE(p)            (*(const unsigned char *) (p))
+    #define RPN_READ_BLOCK(d, s, n)     memcpy(d, s, n)
+#endif
+
+// ----------------------------------------------------------------------------
+
+// Program format, see rpnlib_program.cpp
+#define RPN_PROGRAM_HEADER_SIZE     20
+#define RPN_PROGRAM_FLAG_MUST_EXIST 0x01
+
+#define RPN_OPCODE_NUMBER           0x01
+#define RPN_OPCODE_VARIABLE         0x02
+#define RPN_OPCODE_OPERATOR         0x03
+#define RPN_OPCODE_BRANCH           0x04    // pops a value, jumps if it is 0
+#define RPN_OPCODE_JUMP             0x05
+#define RPN_OPCODE_DO               0x06    // pops the count, jumps past the loop if below 1
+#define RPN_OPCODE_LOOP             0x07    // jumps back to the body while iterations are left
+#define RPN_OPCODE_CALL             0x08    // runs a word
+#define RPN_OPCODE_TEMPORARY        0x09    // pushes a value shared by the rules of a rule set
+#define RPN_INSTRUCTION_SIZE        3
+
+// ----------------------------------------------------------------------------
+
+// Control flow words, see rpn_process and _rpn_compile
+enum {
+    RPN_KEYWORD_NONE,
+    RPN_KEYWORD_IF,
+    RPN_KEYWORD_ELSE,
+    RPN_KEYWORD_THEN,
+    RPN_KEYWORD_DO,
+    RPN_KEYWORD_LOOP,
+    RPN_KEYWORD_DEFINE,
+    RPN_KEYWORD_END
+};
+
+bool _rpn_is_number(const char *, unsigned int);
+unsigned char _rpn_keyword(const char *, unsigned int);
+unsigned long _rpn_ticks();
+unsigned long long _rpn_ticks_to_ns(unsigned long long);
+unsigned long _rpn_us_to_ticks(unsigned long);
+bool _rpn_operator_call(rpn_context &, unsigned int);
+unsigned int _rpn_operator_find(rpn_context &, const char *, unsigned int);
+rpn_context & _rpn_root(rpn_context &);
+bool _rpn_snapshot_acquire(rpn_context &, unsigned long);
+bool _rpn_snapshot_retry(rpn_context &, bool, unsigned int &);
+bool _rpn_variable_get(rpn_context &, const char *, unsigned int, float &);
+bool _rpn_variables_override(rpn_context &, const char * const [], const float [], size_t);
+size_t _rpn_memory_variables(const rpn_context &);
+size_t _rpn_memory_names(const rpn_context &);
+void _rpn_memory_add(rpn_context &, size_t, size_t);
+void _rpn_memory_update(rpn_context &);
+void _rpn_histogram_record(rpn_histogram &, unsigned long);
+
+// Spin lock for the short sections where writers change shared state,
+// it works on every platform the library runs on. Waiters spin on reads,
+// pausing the core, and after RPN_SPIN_PAUSES of them give the rest of
+// their time slice away so a holder preempted on the same core can finish.
+#define RPN_SPIN_PAUSES             64
+
+inline void _rpn_spin_pause(unsigned int & spins) {
+    if (spins < RPN_SPIN_PAUSES) {
+        spins++;
+        #if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+        #elif defined(__aarch64__) || defined(__ARM_ARCH_7A__) || defined(__ARM_ARCH_8A__)
+            __asm__ __volatile__("yield");
+        #endif
+        return;
+    }
+    #ifdef RPNLIB_THREADS
+        std::this_thread::yield();
+    #endif
+}
+
+class _rpn_spin_lock {
+
+    public:
+
+        explicit _rpn_spin_lock(std::atomic<bool> & flag) : _flag(flag) {
+            unsigned int spins = 0;
+            while (_flag.exchange(true, std::memory_order_acquire)) {
+                while (_flag.load(std::memory_order_relaxed)) _rpn_spin_pause(spins);
+            }
+        }
+
+        ~_rpn_spin_lock() {
+            _flag.store(false, std::memory_order_release);
+        }
+
+    private:
+
+        std::atomic<bool> & _flag;
+
+};
+
+// Pins a snapshot of the variables for the duration of an evaluation
+class _rpn_snapshot {
+
+    public:
+
+        explicit _rpn_snapshot(rpn_context & ctxt) : _ctxt(ctxt) {
+            rpn_snapshot_acquire(_ctxt);
+        }
+
+        ~_rpn_snapshot() {
+            rpn_snapshot_release(_ctxt);
+        }
+
+    private:
+
+        rpn_context & _ctxt;
+
+};
+
+// Open addressing helpers shared by the symbol table and the variables
+// index, entries are positions + 1. Inserting can race with readers,
+// erasing cannot. Home gives back the hash of an entry.
+void _rpn_table_insert(std::atomic<unsigned int> *, unsigned int, unsigned int, unsigned int);
+
+// Backward shift deletion, entries after the hole that could live
+// in it are moved there so lookups never stop early
+template <typename Home>
+void _rpn_table_erase(rpn_table & table, unsigned int entry, unsigned int hash, Home home) {
+    unsigned int mask = 0;
+    std::atomic<unsigned int> * slots = table.slots(mask);
+    unsigned int hole = hash & mask;
+    while (slots[hole].load(std::memory_order_relaxed) != entry) {
+        hole = (hole + 1) & mask;
+    }
+    slots[hole].store(0, std::memory_order_relaxed);
+    for (unsigned int slot = (hole + 1) & mask; unsigned int other = slots[slot].load(std::memory_order_relaxed); slot = (slot + 1) & mask) {
+        unsigned int start = home(other) & mask;
+        bool stays = (hole <= slot) ? ((hole < start) && (start <= slot)) : ((hole < start) || (start <= slot));
+        if (stays) continue;
+        slots[hole].store(other, std::memory_order_relaxed);
+        slots[slot].store(0, std::memory_order_relaxed);
+        hole = slot;
+    }
+}
+
+// Symbol table, see rpnlib_symbols.cpp
+#define RPN_SYMBOL_NONE             0xFFFFFFFF
+#define RPN_SYMBOL_DEPTH            0x01000000  // ids per context along a fork chain
+
+unsigned int _rpn_symbol_hash(const char *, unsigned int);
+unsigned int _rpn_symbol_find(rpn_context &, const char *, unsigned int);
+unsigned int _rpn_symbol_intern(rpn_context &, const char *, unsigned int);
+char * _rpn_symbol_name(rpn_context &, unsigned int);
+bool _rpn_symbols_reserve(rpn_context &, unsigned int);
+void _rpn_symbols_clear(rpn_context &);
+void _rpn_symbols_checkpoint(rpn_context &);
+bool _rpn_symbols_rollback(rpn_context &);
+
+// Scratch space for the compiler, reused between expressions
+struct _rpn_token {
+    const char * name;
+    unsigned int length;
+};
+
+// If, else or do waiting for the word that closes it, with the
+// stack depth (relative to the start) at the start of the arm or body
+// and, after an else, the depth the first arm left
+struct _rpn_block {
+    unsigned char keyword;
+    unsigned int instruction;               // jump to patch
+    long depth;
+    bool known;                             // false after operators leaving a variable number of values
+    long arm;
+    bool arm_known;
+};
+
+// Word a program depends on, and the version it was compiled against
+struct _rpn_use {
+    unsigned int word;
+    unsigned int version;
+};
+
+struct _rpn_compiler {
+    std::vector<float> literals;
+    std::vector<unsigned int> operators;
+    std::vector<_rpn_token> variables;
+    std::vector<unsigned int> words;        // called
+    std::vector<_rpn_use> uses;             // inlined
+    std::vector<unsigned char> code;
+    std::vector<_rpn_block> blocks;
+    unsigned int defining = RPN_SYMBOL_NONE;    // word being defined, it cannot use itself
+    long depth;
+    long lowest;                            // deepest the stack went below the start
+    bool known;
+    bool jumps;
+};
+
+unsigned int _rpn_read_u16(const unsigned char *);
+unsigned long _rpn_read_u32(const unsigned char *);
+void _rpn_compile_reset(_rpn_compiler &);
+bool _rpn_emit(_rpn_compiler &, unsigned char, unsigned int);
+unsigned int _rpn_compile_literal(_rpn_compiler &, float);
+unsigned int _rpn_compile_index(std::vector<unsigned int> &, unsigned int);
+unsigned int _rpn_compile_variable(_rpn_compiler &, const _rpn_token &);
+bool _rpn_compile(rpn_context &, _rpn_compiler &, const char *, unsigned int, bool, std::vector<unsigned char> &);
+void _rpn_compile_output(rpn_context &, const _rpn_compiler &, unsigned char, std::vector<unsigned char> &);
+bool _rpn_program_bind(rpn_context &, const unsigned char *, unsigned int, std::vector<unsigned int> &);
+bool _rpn_program_link(rpn_context &, const _rpn_compiler &, std::vector<unsigned char> &, size_t, std::vector<unsigned int> &);
+bool _rpn_program_build(rpn_context &, _rpn_compiler &, const char *, unsigned int, bool, std::vector<unsigned char> &, std::vector<unsigned int> &);
+bool _rpn_ruleset_update(rpn_context &, const rpn_ruleset &, rpn_temporary *);
+bool _rpn_ruleset_refresh(rpn_context &, const rpn_ruleset &);
+bool _rpn_ruleset_execute(rpn_context &, const rpn_ruleset &, size_t, const rpn_temporary *);
+unsigned int _rpn_word_find(rpn_context &, const char *, unsigned int, bool deleted = false);
+bool _rpn_word_set(rpn_context &, const char *, unsigned int, const char *, unsigned int);
+void _rpn_word_release(rpn_context &, rpn_word &);
+bool _rpn_word_call(rpn_context &, unsigned int);
+bool _rpn_run(rpn_context &, const unsigned char *, const unsigned int *, rpn_resume * resume = nullptr, unsigned long instructions = 0, unsigned long ticks = 0);
+
+// ----------------------------------------------------------------------------
+
+#ifdef RPNLIB_TRACE
+
+    #define RPN_TRACE(ctxt, opcode) _rpn_trace(ctxt, opcode)
+
+    inline void _rpn_trace(rpn_context & ctxt, unsigned short opcode) {
+        if (!ctxt.trace) return;
+        rpn_trace_event & event = ctxt.trace->events[ctxt.trace->head++ & (RPNLIB_TRACE_SIZE - 1)];
+        event.timestamp = _rpn_ticks();
+        event.opcode = opcode;
+        event.depth = ctxt.stack.size();
+        if (RPN_TRACE_ERROR == opcode) {
+            event.top = rpn_error;
+        } else {
+            event.top = ctxt.stack.empty() ? 0 : ctxt.stack.back();
+        }
+    }
+
+#else
+
+    #define RPN_TRACE(ctxt, opcode)
+
+#endif
+
+// ----------------------------------------------------------------------------
+
+#endif // rpnlib_internal_h
@@ -289,24 +289,20 @@ bool _rpn_index(rpn_context & ctxt) {
 
     // Number of values to map
     rpn_stack_pop(ctxt, tmp);
-    unsigned char num = int(tmp);
-    if (0 == num) return false;
-    
-    // Get mapped values from stack
-    if (rpn_stack_size(ctxt) < num + 1) return false;
-    float values[num];
-    for (unsigned char i=0; i<num; i++) {
-        rpn_stack_pop(ctxt, tmp);    
-        values[num-i-1] = tmp;
-    }
+    if (int(tmp) <= 0) return false;
+    size_t num = int(tmp);
+
+    // Mapped values are read in place, the index is right below them
+    rpn_stack_span stack = rpn_stack_view(ctxt);
+    if (stack.size < num + 1) return false;
+    const float * values = stack.end() - num;
+    int index = int(values[-1]);
 
-    // Get index
-    rpn_stack_pop(ctxt, tmp);
-    unsigned char index = int(tmp);
-    
     // Return indexed value
-    if (index >= num) return false;
-    rpn_stack_push(ctxt, values[index]);
+    if ((index < 0) || ((size_t) index >= num)) return false;
+    float value = values[index];
+    for (size_t i=0; i<=num; i++) rpn_stack_pop(ctxt, tmp);
+    rpn_stack_push(ctxt, value);
     return true;
 
 };    
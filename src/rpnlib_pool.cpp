@@ -0,0 +1,113 @@
+/*
+
+RPNlib
+
+Copyright (C) 2018-2019 by Xose Pérez <xose dot perez at gmail dot com>
+
+The rpnlib library is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+The rpnlib library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with the rpnlib library.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "rpnlib.h"
+#include "rpnlib_internal.h"
+
+#include <new>
+
+// ----------------------------------------------------------------------------
+// Context pool
+// ----------------------------------------------------------------------------
+//
+// The lock only guards the list of available contexts, a spin lock is
+// enough for that.
+
+rpn_pool::~rpn_pool() {
+    rpn_pool_clear(*this);
+}
+
+rpn_context * _rpn_pool_create(rpn_pool & pool) {
+    rpn_context * ctxt = new (std::nothrow) rpn_context();
+    if (!ctxt) return nullptr;
+    if (!rpn_init(*ctxt) || (pool.setup && !pool.setup(*ctxt))) {
+        rpn_clear(*ctxt);
+        delete ctxt;
+        return nullptr;
+    }
+    rpn_checkpoint(*ctxt);
+    return ctxt;
+}
+
+// Every context gets the builtin operators plus whatever the setup
+// callback adds (operators, words, providers and variables) before
+// the checkpoint, anything else is dropped when it is given back
+bool rpn_pool_init(rpn_pool & pool, size_t size, bool (*setup)(rpn_context &)) {
+    rpn_pool_clear(pool);
+    pool.setup = setup;
+    pool.contexts.reserve(size);
+    pool.available.reserve(size);
+    for (size_t i=0; i<size; i++) {
+        rpn_context * ctxt = _rpn_pool_create(pool);
+        if (!ctxt) return false;
+        pool.contexts.push_back(ctxt);
+        pool.available.push_back(ctxt);
+    }
+    return true;
+}
+
+// Contexts are created (outside of the lock) when none is available
+rpn_context * rpn_pool_acquire(rpn_pool & pool) {
+
+    {
+        _rpn_spin_lock lock(pool.locked);
+        if (!pool.available.empty()) {
+            rpn_context * ctxt = pool.available.back();
+            pool.available.pop_back();
+            return ctxt;
+        }
+    }
+
+    rpn_context * ctxt = _rpn_pool_create(pool);
+    if (ctxt) {
+        _rpn_spin_lock lock(pool.locked);
+        pool.contexts.push_back(ctxt);
+        pool.available.reserve(pool.contexts.size());
+    }
+    return ctxt;
+
+}
+
+// The context is reset before it is made available again
+bool rpn_pool_release(rpn_pool & pool, rpn_context * ctxt) {
+    if (!ctxt) return false;
+    rpn_reset(*ctxt);
+    _rpn_spin_lock lock(pool.locked);
+    pool.available.push_back(ctxt);
+    return true;
+}
+
+size_t rpn_pool_available(rpn_pool & pool) {
+    _rpn_spin_lock lock(pool.locked);
+    return pool.available.size();
+}
+
+// Contexts still in use are released too, do not call it while
+// other threads might be using the pool
+bool rpn_pool_clear(rpn_pool & pool) {
+    for (auto ctxt : pool.contexts) {
+        rpn_clear(*ctxt);
+        delete ctxt;
+    }
+    pool.contexts.clear();
+    pool.available.clear();
+    return true;
+}
@@ -0,0 +1,1038 @@
+/*
+
+RPNlib
+
+Copyright (C) 2018-2019 by Xose Pérez <xose dot perez at gmail dot com>
+
+The rpnlib library is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+The rpnlib library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with the rpnlib library.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "rpnlib.h"
+#include "rpnlib_internal.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <string>
+
+// ----------------------------------------------------------------------------
+// Binary format (version 1, little endian)
+//
+//  offset  size    content
+//  0       4       'R' 'P' 'N' version
+//  4       1       flags (bit 0: variables must exist)
+//  5       1       number of words (W)
+//  6       2       number of literals (L)
+//  8       2       number of operators (O)
+//  10      2       number of variables (V)
+//  12      4       offset of the code
+//  16      4       size of the code in bytes (C)
+//  20      4*L     literal pool, IEEE 754 single precision floats
+//  ...             O operators: argc (1), length (1), name, '\0'
+//  ...             V variables: length (1), name, '\0'
+//  ...             W words: length (1), name, '\0'
+//  ...     C       code, 3 bytes per instruction: opcode (1), operand (2)
+//
+// The operand of every instruction is an index into the literal pool, the
+// operator, variable or word table, depending on the opcode, or the number
+// of the instruction to jump to for the control flow ones (or of the shared
+// temporary to read, in the rules of an optimized rule set). Operator and word
+// names are resolved against the context when the program is loaded, so the
+// same bytes can be loaded into any context that has those operators (words
+// that were inlined need not be there). Programs without words are the same
+// as before words were added, the byte was reserved.
+// ----------------------------------------------------------------------------
+
+unsigned int _rpn_read_u16(const unsigned char * p) {
+    return RPN_READ_BYTE(p) | (RPN_READ_BYTE(p + 1) << 8);
+}
+
+unsigned long _rpn_read_u32(const unsigned char * p) {
+    return (unsigned long) _rpn_read_u16(p) | ((unsigned long) _rpn_read_u16(p + 2) << 16);
+}
+
+void _rpn_write_u16(std::vector<unsigned char> & output, unsigned int value) {
+    output.push_back(value & 0xFF);
+    output.push_back((value >> 8) & 0xFF);
+}
+
+void _rpn_write_u32(std::vector<unsigned char> & output, unsigned long value) {
+    _rpn_write_u16(output, value & 0xFFFF);
+    _rpn_write_u16(output, (value >> 16) & 0xFFFF);
+}
+
+const unsigned char * _rpn_program_data(const rpn_program & program) {
+    return program.storage.empty() ? program.external : program.storage.data();
+}
+
+
+// ----------------------------------------------------------------------------
+// Compiler
+// ----------------------------------------------------------------------------
+
+void _rpn_patch(std::vector<unsigned char> & code, unsigned int instruction, unsigned int target) {
+    code[instruction * RPN_INSTRUCTION_SIZE + 1] = target & 0xFF;
+    code[instruction * RPN_INSTRUCTION_SIZE + 2] = (target >> 8) & 0xFF;
+}
+
+bool _rpn_emit(_rpn_compiler & compiler, unsigned char opcode, unsigned int operand) {
+    if (operand > 0xFFFF) {
+        rpn_error = RPN_ERROR_INVALID_PROGRAM;
+        return false;
+    }
+    compiler.code.push_back(opcode);
+    _rpn_write_u16(compiler.code, operand);
+    return true;
+}
+
+// Stack depth after something taking argc values and leaving results
+void _rpn_compile_effect(_rpn_compiler & compiler, unsigned char argc, unsigned char results) {
+    if (compiler.depth - argc < compiler.lowest) compiler.lowest = compiler.depth - argc;
+    if (RPN_RESULTS_VARIABLE == results) compiler.known = false;
+    else compiler.depth += (long) results - (long) argc;
+}
+
+// Table entries are shared by every instruction using them
+template <typename T, typename Same>
+unsigned int _rpn_compile_entry(std::vector<T> & table, const T & entry, Same same) {
+    unsigned int index;
+    for (index = 0; index < table.size(); index++) {
+        if (same(table[index], entry)) break;
+    }
+    if (index == table.size()) table.push_back(entry);
+    return index;
+}
+
+unsigned int _rpn_compile_literal(_rpn_compiler & compiler, float value) {
+    return _rpn_compile_entry(compiler.literals, value, [](float a, float b) {
+        return memcmp(&a, &b, sizeof(float)) == 0;
+    });
+}
+
+unsigned int _rpn_compile_index(std::vector<unsigned int> & table, unsigned int index) {
+    return _rpn_compile_entry(table, index, [](unsigned int a, unsigned int b) { return a == b; });
+}
+
+unsigned int _rpn_compile_variable(_rpn_compiler & compiler, const _rpn_token & variable) {
+    return _rpn_compile_entry(compiler.variables, variable, [](const _rpn_token & a, const _rpn_token & b) {
+        return (a.length == b.length) && (strncmp(a.name, b.name, a.length) == 0);
+    });
+}
+
+// Short words are copied in, instruction by instruction, and the program
+// depends on them (and whatever they depend on) from then on. Longer ones
+// are called, and resolved by name when the program is loaded.
+bool _rpn_compile_word(rpn_context & ctxt, _rpn_compiler & compiler, unsigned int index) {
+
+    rpn_word & word = ctxt.words[index];
+    if (word.symbol == compiler.defining) {
+        rpn_error = RPN_ERROR_UNKNOWN_TOKEN;
+        return false;
+    }
+    _rpn_compile_effect(compiler, word.argc, word.results);
+    if (!word.inlined) {
+        return _rpn_emit(compiler, RPN_OPCODE_CALL, _rpn_compile_index(compiler.words, index));
+    }
+
+    const unsigned char * data = ctxt.word_code.data() + word.program;
+    const unsigned int * bindings = ctxt.word_bindings.data() + word.bindings;
+    unsigned int operators = _rpn_read_u16(data + 8);
+    unsigned int variables = _rpn_read_u16(data + 10);
+    unsigned int words = RPN_READ_BYTE(data + 5);
+    const unsigned char * ip = data + _rpn_read_u32(data + 12);
+    const unsigned char * end = ip + _rpn_read_u32(data + 16);
+
+    for (; ip < end; ip += RPN_INSTRUCTION_SIZE) {
+        unsigned char opcode = RPN_READ_BYTE(ip);
+        unsigned int operand = _rpn_read_u16(ip + 1);
+        if (RPN_OPCODE_NUMBER == opcode) {
+            float value;
+            RPN_READ_BLOCK(&value, data + RPN_PROGRAM_HEADER_SIZE + operand * sizeof(float), sizeof(float));
+            operand = _rpn_compile_literal(compiler, value);
+        } else if (RPN_OPCODE_OPERATOR == opcode) {
+            operand = _rpn_compile_index(compiler.operators, bindings[operand]);
+        } else if (RPN_OPCODE_VARIABLE == opcode) {
+            const char * name = (const char *) data + bindings[operators + operand];
+            _rpn_token variable = {name, RPN_READ_BYTE(name - 1)};
+            operand = _rpn_compile_variable(compiler, variable);
+        } else {
+            operand = _rpn_compile_index(compiler.words, bindings[operators + variables + operand]);
+        }
+        if (!_rpn_emit(compiler, opcode, operand)) return false;
+    }
+
+    const unsigned int * uses = bindings + operators + variables + words;
+    compiler.uses.push_back({index, word.version});
+    for (unsigned int i=0; i<uses[0]; i++) {
+        compiler.uses.push_back({uses[1 + 2 * i], uses[2 + 2 * i]});
+    }
+    return true;
+
+}
+
+// Jumps are patched once the word closing the block is found. Both arms of
+// a conditional must leave the stack as deep as the other one (or as it was
+// at the if, when there is no else), unless it cannot be told beforehand.
+bool _rpn_compile_keyword(_rpn_compiler & compiler, unsigned char keyword) {
+
+    std::vector<unsigned char> & code = compiler.code;
+    std::vector<_rpn_block> & blocks = compiler.blocks;
+    unsigned int next = code.size() / RPN_INSTRUCTION_SIZE;
+    if (next + 1 > 0xFFFF) {
+        rpn_error = RPN_ERROR_INVALID_PROGRAM;
+        return false;
+    }
+
+    // Words are only defined by rpn_process
+    if ((RPN_KEYWORD_DEFINE == keyword) || (RPN_KEYWORD_END == keyword)) {
+        rpn_error = RPN_ERROR_UNKNOWN_TOKEN;
+        return false;
+    }
+    compiler.jumps = true;
+
+    if ((RPN_KEYWORD_IF == keyword) || (RPN_KEYWORD_DO == keyword)) {
+        if (RPN_KEYWORD_DO == keyword) {
+            unsigned char loops = 0;
+            for (auto & block : blocks) {
+                if (RPN_KEYWORD_DO == block.keyword) loops++;
+            }
+            if (loops == RPNLIB_LOOP_DEPTH) {
+                rpn_error = RPN_ERROR_INVALID_PROGRAM;
+                return false;
+            }
+        }
+        _rpn_compile_effect(compiler, 1, 0);
+        blocks.push_back({keyword, next, compiler.depth, compiler.known, 0, false});
+        code.push_back((RPN_KEYWORD_IF == keyword) ? RPN_OPCODE_BRANCH : RPN_OPCODE_DO);
+        _rpn_write_u16(code, 0);
+        return true;
+    }
+
+    if (blocks.empty()) {
+        rpn_error = RPN_ERROR_UNBALANCED;
+        return false;
+    }
+    _rpn_block & block = blocks.back();
+
+    if (RPN_KEYWORD_LOOP == keyword) {
+        if (RPN_KEYWORD_DO != block.keyword) {
+            rpn_error = RPN_ERROR_UNBALANCED;
+            return false;
+        }
+        // Depth depends on the count, unless the body leaves it as it was
+        compiler.known = compiler.known && block.known && (compiler.depth == block.depth);
+        compiler.depth = block.depth;
+        code.push_back(RPN_OPCODE_LOOP);
+        _rpn_write_u16(code, block.instruction + 1);
+        _rpn_patch(code, block.instruction, next + 1);
+        blocks.pop_back();
+        return true;
+    }
+
+    if ((RPN_KEYWORD_IF != block.keyword) && ((RPN_KEYWORD_ELSE != block.keyword) || (RPN_KEYWORD_ELSE == keyword))) {
+        rpn_error = RPN_ERROR_UNBALANCED;
+        return false;
+    }
+
+    if (RPN_KEYWORD_ELSE == keyword) {
+        block.keyword = keyword;
+        block.arm = compiler.depth;
+        block.arm_known = compiler.known;
+        compiler.depth = block.depth;
+        compiler.known = block.known;
+        code.push_back(RPN_OPCODE_JUMP);
+        _rpn_write_u16(code, 0);
+        _rpn_patch(code, block.instruction, next + 1);
+        block.instruction = next;
+        return true;
+    }
+
+    // Then
+    if (RPN_KEYWORD_IF == block.keyword) {
+        block.arm = block.depth;
+        block.arm_known = block.known;
+    }
+    if (compiler.known && block.arm_known && (compiler.depth != block.arm)) {
+        rpn_error = RPN_ERROR_UNBALANCED;
+        return false;
+    }
+    compiler.known = compiler.known && block.arm_known;
+    _rpn_patch(code, block.instruction, next);
+    blocks.pop_back();
+    return true;
+
+}
+
+void _rpn_compile_reset(_rpn_compiler & compiler) {
+    compiler.literals.clear();
+    compiler.operators.clear();
+    compiler.variables.clear();
+    compiler.words.clear();
+    compiler.uses.clear();
+    compiler.code.clear();
+    compiler.blocks.clear();
+    compiler.depth = 0;
+    compiler.lowest = 0;
+    compiler.known = true;
+    compiler.jumps = false;
+}
+
+// Appends the serialized program to output
+bool _rpn_compile(rpn_context & ctxt, _rpn_compiler & compiler, const char * input, unsigned int length, bool variable_must_exist, std::vector<unsigned char> & output) {
+
+    _rpn_compile_reset(compiler);
+    rpn_error = RPN_ERROR_OK;
+
+    unsigned int position = 0;
+    while (position < length) {
+
+        // Multiple spaces
+        if (' ' == input[position]) {
+            position++;
+            continue;
+        }
+
+        const char * token = &input[position];
+        unsigned int token_length = 0;
+        while ((position < length) && (' ' != input[position])) {
+            position++;
+            token_length++;
+        }
+
+        // Is token a control flow word?
+        unsigned char keyword = _rpn_keyword(token, token_length);
+        if (RPN_KEYWORD_NONE != keyword) {
+            if (!_rpn_compile_keyword(compiler, keyword)) break;
+            continue;
+        }
+
+        // Is token a number?
+        if (_rpn_is_number(token, token_length)) {
+            char buffer[32];
+            float value;
+            if (token_length < sizeof(buffer)) {
+                memcpy(buffer, token, token_length);
+                buffer[token_length] = 0;
+                value = atof(buffer);
+            } else {
+                value = atof(std::string(token, token_length).c_str());
+            }
+            _rpn_compile_effect(compiler, 0, 1);
+            if (!_rpn_emit(compiler, RPN_OPCODE_NUMBER, _rpn_compile_literal(compiler, value))) break;
+            continue;
+        }
+
+        // Is token a word?
+        if (!ctxt.words.empty()) {
+            unsigned int index = _rpn_word_find(ctxt, token, token_length);
+            if (index < ctxt.words.size()) {
+                if (!_rpn_compile_word(ctxt, compiler, index)) break;
+                continue;
+            }
+        }
+
+        // Is token a operator?
+        unsigned int index = _rpn_operator_find(ctxt, token, token_length);
+        if (index < ctxt.operators.size()) {
+            if (token_length > 0xFF) {
+                rpn_error = RPN_ERROR_INVALID_PROGRAM;
+                break;
+            }
+            _rpn_compile_effect(compiler, ctxt.operators[index].argc, ctxt.operators[index].results);
+            if (!_rpn_emit(compiler, RPN_OPCODE_OPERATOR, _rpn_compile_index(compiler.operators, index))) break;
+            continue;
+        }
+
+        // Is token a variable?
+        if ('$' == token[0]) {
+            _rpn_token variable = {token + 1, token_length - 1};
+            if (variable.length > 0xFF) {
+                rpn_error = RPN_ERROR_INVALID_PROGRAM;
+                break;
+            }
+            _rpn_compile_effect(compiler, 0, 1);
+            if (!_rpn_emit(compiler, RPN_OPCODE_VARIABLE, _rpn_compile_variable(compiler, variable))) break;
+            continue;
+        }
+
+        // Don't know the token
+        rpn_error = RPN_ERROR_UNKNOWN_TOKEN;
+        break;
+
+    }
+
+    // An if without its then or a do without its loop
+    if ((RPN_ERROR_OK == rpn_error) && !compiler.blocks.empty()) {
+        rpn_error = RPN_ERROR_UNBALANCED;
+    }
+    if ((RPN_ERROR_OK == rpn_error) && (compiler.words.size() > 0xFF)) {
+        rpn_error = RPN_ERROR_INVALID_PROGRAM;
+    }
+
+    if (RPN_ERROR_OK != rpn_error) return false;
+
+    _rpn_compile_output(ctxt, compiler, variable_must_exist ? RPN_PROGRAM_FLAG_MUST_EXIST : 0, output);
+    return true;
+
+}
+
+// Serializes what the compiler was left with
+void _rpn_compile_output(rpn_context & ctxt, const _rpn_compiler & compiler, unsigned char flags, std::vector<unsigned char> & output) {
+
+    const std::vector<unsigned int> & words = compiler.words;
+    const std::vector<unsigned char> & code = compiler.code;
+
+    // Header
+    size_t start = output.size();
+    output.push_back('R');
+    output.push_back('P');
+    output.push_back('N');
+    output.push_back(RPN_PROGRAM_VERSION);
+    output.push_back(flags);
+    output.push_back(words.size());
+    _rpn_write_u16(output, compiler.literals.size());
+    _rpn_write_u16(output, compiler.operators.size());
+    _rpn_write_u16(output, compiler.variables.size());
+    _rpn_write_u32(output, 0);
+    _rpn_write_u32(output, code.size());
+
+    // Tables
+    for (auto & value : compiler.literals) {
+        const unsigned char * bytes = (const unsigned char *) &value;
+        output.insert(output.end(), bytes, bytes + sizeof(float));
+    }
+    for (auto & index : compiler.operators) {
+        rpn_operator & f = ctxt.operators[index];
+        unsigned int name_length = strlen(f.name);
+        output.push_back(f.argc);
+        output.push_back(name_length);
+        output.insert(output.end(), f.name, f.name + name_length + 1);
+    }
+    for (auto & variable : compiler.variables) {
+        output.push_back(variable.length);
+        output.insert(output.end(), variable.name, variable.name + variable.length);
+        output.push_back(0);
+    }
+    for (auto & index : words) {
+        const char * name = ctxt.words[index].name;
+        unsigned int name_length = strlen(name);
+        output.push_back(name_length);
+        output.insert(output.end(), name, name + name_length + 1);
+    }
+
+    // Code, now that we know where it starts
+    unsigned long offset = output.size() - start;
+    for (unsigned char i=0; i<4; i++) {
+        output[start + 12 + i] = (offset >> (8 * i)) & 0xFF;
+    }
+    output.insert(output.end(), code.begin(), code.end());
+
+}
+
+// Binds the program serialized from start on, bindings also get the words
+// that were inlined. The program is taken out of output if it fails.
+bool _rpn_program_link(rpn_context & ctxt, const _rpn_compiler & compiler, std::vector<unsigned char> & output, size_t start, std::vector<unsigned int> & bindings) {
+    size_t first = bindings.size();
+    if (!_rpn_program_bind(ctxt, output.data() + start, output.size() - start, bindings)) {
+        output.resize(start);
+        return false;
+    }
+    if (!compiler.uses.empty()) {
+        bindings[first + compiler.operators.size() + compiler.variables.size() + compiler.words.size()] += compiler.uses.size();
+        for (auto & use : compiler.uses) {
+            bindings.push_back(use.word);
+            bindings.push_back(use.version);
+        }
+    }
+    return true;
+}
+
+// Compiles and binds
+bool _rpn_program_build(rpn_context & ctxt, _rpn_compiler & compiler, const char * input, unsigned int length, bool variable_must_exist, std::vector<unsigned char> & output, std::vector<unsigned int> & bindings) {
+    size_t start = output.size();
+    if (!_rpn_compile(ctxt, compiler, input, length, variable_must_exist, output)) return false;
+    return _rpn_program_link(ctxt, compiler, output, start, bindings);
+}
+
+// ----------------------------------------------------------------------------
+// Loader
+// ----------------------------------------------------------------------------
+
+// Validates the bytes and appends the resolved operator indexes, variable
+// name offsets and word indexes to bindings, then the number of words it
+// depends on and their index and version. The bytes themselves are not copied.
+bool _rpn_program_bind(rpn_context & ctxt, const unsigned char * data, unsigned int size, std::vector<unsigned int> & bindings) {
+
+    rpn_error = RPN_ERROR_INVALID_PROGRAM;
+
+    if (!data || (size < RPN_PROGRAM_HEADER_SIZE)) return false;
+    if ((RPN_READ_BYTE(data) != 'R') || (RPN_READ_BYTE(data + 1) != 'P') || (RPN_READ_BYTE(data + 2) != 'N')) return false;
+    if (RPN_READ_BYTE(data + 3) != RPN_PROGRAM_VERSION) return false;
+    unsigned char flags = RPN_READ_BYTE(data + 4);
+    if (flags & ~RPN_PROGRAM_FLAG_MUST_EXIST) return false;
+
+    unsigned int words = RPN_READ_BYTE(data + 5);
+    unsigned int literals = _rpn_read_u16(data + 6);
+    unsigned int operators = _rpn_read_u16(data + 8);
+    unsigned int variables = _rpn_read_u16(data + 10);
+    unsigned long code = _rpn_read_u32(data + 12);
+    unsigned long code_size = _rpn_read_u32(data + 16);
+
+    unsigned long offset = RPN_PROGRAM_HEADER_SIZE + literals * sizeof(float);
+    if (offset > size) return false;
+    size_t start = bindings.size();
+    bindings.reserve(start + operators + variables + 3 * words + 1);
+
+    // Operators
+    char name[0x100];
+    for (unsigned int i=0; i<operators; i++) {
+        if (offset + 2 > size) break;
+        unsigned char argc = RPN_READ_BYTE(data + offset);
+        unsigned char length = RPN_READ_BYTE(data + offset + 1);
+        offset += 2;
+        if (offset + length + 1 > size) break;
+        RPN_READ_BLOCK(name, data + offset, length + 1);
+        if ((0 != name[length]) || (strlen(name) != length)) break;
+        offset += length + 1;
+        unsigned int index = _rpn_operator_find(ctxt, name, length);
+        if (index == ctxt.operators.size()) {
+            rpn_error = RPN_ERROR_UNKNOWN_TOKEN;
+            break;
+        }
+        if (ctxt.operators[index].argc != argc) break;
+        bindings.push_back(index);
+    }
+
+    // Variables and words, both are names
+    if (bindings.size() == start + operators) {
+        for (unsigned int i=0; i<variables + words; i++) {
+            if (offset + 1 > size) break;
+            unsigned char length = RPN_READ_BYTE(data + offset);
+            offset += 1;
+            if (offset + length + 1 > size) break;
+            RPN_READ_BLOCK(name, data + offset, length + 1);
+            if ((0 != name[length]) || (strlen(name) != length)) break;
+            if (i < variables) {
+                bindings.push_back(offset);
+            } else {
+                unsigned int index = _rpn_word_find(ctxt, name, length);
+                if (index == ctxt.words.size()) {
+                    rpn_error = RPN_ERROR_UNKNOWN_TOKEN;
+                    break;
+                }
+                bindings.push_back(index);
+            }
+            offset += length + 1;
+        }
+    }
+
+    // Code. Only loops jump backwards, to the start of their body,
+    // and they must be nested in one another.
+    bool valid = (bindings.size() == start + operators + variables + words);
+    valid = valid && (code == offset) && (offset + code_size == size) && (0 == code_size % RPN_INSTRUCTION_SIZE);
+    unsigned long instructions = code_size / RPN_INSTRUCTION_SIZE;
+    unsigned int loops[RPNLIB_LOOP_DEPTH];
+    unsigned char open = 0;
+    for (unsigned long instruction = 0; valid && (instruction < instructions); instruction++) {
+        unsigned long position = offset + instruction * RPN_INSTRUCTION_SIZE;
+        unsigned char opcode = RPN_READ_BYTE(data + position);
+        unsigned int operand = _rpn_read_u16(data + position + 1);
+        if (RPN_OPCODE_NUMBER == opcode) {
+            valid = (operand < literals);
+        } else if (RPN_OPCODE_OPERATOR == opcode) {
+            valid = (operand < operators);
+        } else if (RPN_OPCODE_VARIABLE == opcode) {
+            valid = (operand < variables);
+        } else if (RPN_OPCODE_CALL == opcode) {
+            valid = (operand < words);
+        } else if (RPN_OPCODE_TEMPORARY == opcode) {
+            valid = true;
+        } else if ((RPN_OPCODE_BRANCH == opcode) || (RPN_OPCODE_JUMP == opcode)) {
+            valid = (operand > instruction) && (operand <= instructions);
+        } else if (RPN_OPCODE_DO == opcode) {
+            valid = (operand > instruction) && (operand <= instructions) && (open < RPNLIB_LOOP_DEPTH);
+            if (valid) loops[open++] = instruction;
+        } else if (RPN_OPCODE_LOOP == opcode) {
+            valid = (open > 0) && (operand == loops[open - 1] + 1)
+                && (_rpn_read_u16(data + offset + loops[open - 1] * RPN_INSTRUCTION_SIZE + 1) == instruction + 1);
+            open--;
+        } else {
+            valid = false;
+        }
+    }
+    valid = valid && (0 == open);
+
+    if (!valid) {
+        bindings.resize(start);
+        return false;
+    }
+
+    // Words are checked against the version they were loaded with
+    bindings.push_back(words);
+    for (unsigned int i=0; i<words; i++) {
+        unsigned int index = bindings[start + operators + variables + i];
+        bindings.push_back(index);
+        bindings.push_back(ctxt.words[index].version);
+    }
+
+    rpn_error = RPN_ERROR_OK;
+    return true;
+
+}
+
+// ----------------------------------------------------------------------------
+// Program methods
+// ----------------------------------------------------------------------------
+
+// Keeps the memory around, so programs can be recompiled cheaply
+// Tells programs apart for rpn_execute_budget, even when compiled into the same storage
+std::atomic<unsigned long> _rpn_program_ids {0};
+
+void _rpn_program_reset(rpn_program & program) {
+    program.storage.clear();
+    program.external = nullptr;
+    program.bindings.clear();
+    program.size = 0;
+    program.id = _rpn_program_ids.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+bool rpn_program_clear(rpn_program & program) {
+    _rpn_program_reset(program);
+    program.storage.shrink_to_fit();
+    program.bindings.shrink_to_fit();
+    return true;
+}
+
+// Compiling or loading a paused program again drops it, see rpn_execute_reset
+bool rpn_compile(rpn_context & ctxt, const char * input, rpn_program & program, bool variable_must_exist) {
+    _rpn_compiler compiler;
+    if (program.id && (ctxt.paused.program == program.id)) rpn_execute_reset(ctxt);
+    _rpn_program_reset(program);
+    if (!_rpn_program_build(ctxt, compiler, input, strlen(input), variable_must_exist, program.storage, program.bindings)) {
+        rpn_program_clear(program);
+        return false;
+    }
+    program.size = program.storage.size();
+    return true;
+}
+
+bool rpn_program_load(rpn_context & ctxt, rpn_program & program, const unsigned char * data, unsigned int size) {
+    if (program.id && (ctxt.paused.program == program.id)) rpn_execute_reset(ctxt);
+    _rpn_program_reset(program);
+    if (!_rpn_program_bind(ctxt, data, size, program.bindings)) {
+        rpn_program_clear(program);
+        return false;
+    }
+    program.external = data;
+    program.size = size;
+    return true;
+}
+
+unsigned int rpn_program_size(const rpn_program & program) {
+    return program.size;
+}
+
+bool rpn_program_serialize(const rpn_program & program, unsigned char * buffer, unsigned int size) {
+    const unsigned char * data = _rpn_program_data(program);
+    if (!data || (size < program.size)) return false;
+    RPN_READ_BLOCK(buffer, data, program.size);
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Words
+// ----------------------------------------------------------------------------
+//
+// Words are compiled once, when they are defined, and kept back to back in
+// the context. Short ones are copied into the programs using them, others
+// are called. Programs remember the version of every word they use, so
+// redefining or deleting one makes only those programs fail, with
+// RPN_ERROR_STALE_PROGRAM, until they are compiled again. A word cannot
+// use itself, and a word using one defined after it is stale as soon as
+// the later one is redefined, so calls never go round in circles.
+
+// Index of the word with that name, or the number of words. Deleted
+// ones keep their slot (and their name), and are only found if asked.
+unsigned int _rpn_word_find(rpn_context & ctxt, const char * name, unsigned int length, bool deleted) {
+    unsigned int symbol = _rpn_symbol_find(ctxt, name, length);
+    if (RPN_SYMBOL_NONE == symbol) return ctxt.words.size();
+    unsigned int index;
+    for (index = 0; index < ctxt.words.size(); index++) {
+        rpn_word & word = ctxt.words[index];
+        if ((word.symbol == symbol) && (deleted || word.version)) break;
+    }
+    return index;
+}
+
+// Takes the body out of the word code, those after it move down
+void _rpn_word_release(rpn_context & ctxt, rpn_word & word) {
+    // Nothing to move (and maybe no buffer at all) when the word is last
+    size_t tail = ctxt.word_code.size() - word.program - word.size;
+    if (tail) {
+        unsigned char * code = ctxt.word_code.data();
+        memmove(code + word.program, code + word.program + word.size, tail);
+    }
+    ctxt.word_code.resize(ctxt.word_code.size() - word.size);
+    tail = ctxt.word_bindings.size() - word.bindings - word.count;
+    if (tail) {
+        unsigned int * bindings = ctxt.word_bindings.data();
+        memmove(bindings + word.bindings, bindings + word.bindings + word.count, tail * sizeof(unsigned int));
+    }
+    ctxt.word_bindings.resize(ctxt.word_bindings.size() - word.count);
+    for (auto & other : ctxt.words) {
+        if (other.program > word.program) other.program -= word.size;
+        if (other.bindings > word.bindings) other.bindings -= word.count;
+    }
+    word.size = 0;
+    word.count = 0;
+}
+
+bool _rpn_word_set(rpn_context & ctxt, const char * name, unsigned int length, const char * body, unsigned int body_length) {
+
+    // Forks share the words of their parent
+    if (ctxt.words.fixed()) {
+        rpn_error = RPN_ERROR_OUT_OF_MEMORY;
+        return false;
+    }
+    if ((0 == length) || (length > 0xFF) || ('$' == name[0]) || memchr(name, ' ', length)
+        || _rpn_is_number(name, length) || (RPN_KEYWORD_NONE != _rpn_keyword(name, length))) {
+        rpn_error = RPN_ERROR_UNVALID_ARGUMENT;
+        return false;
+    }
+
+    _rpn_compiler compiler;
+    std::vector<unsigned char> code;
+    std::vector<unsigned int> bindings;
+    unsigned int index = _rpn_word_find(ctxt, name, length, true);
+    if (index < ctxt.words.size()) compiler.defining = ctxt.words[index].symbol;
+    if (!_rpn_program_build(ctxt, compiler, body, body_length, false, code, bindings)) return false;
+
+    rpn_word word;
+    word.argc = 0;
+    word.results = RPN_RESULTS_VARIABLE;
+    if (compiler.known && (-compiler.lowest < RPN_RESULTS_VARIABLE) && (compiler.depth - compiler.lowest < RPN_RESULTS_VARIABLE)) {
+        word.argc = -compiler.lowest;
+        word.results = compiler.depth - compiler.lowest;
+    }
+    word.inlined = !compiler.jumps && (compiler.code.size() <= RPNLIB_WORD_INLINE * RPN_INSTRUCTION_SIZE);
+
+    _rpn_spin_lock lock(_rpn_root(ctxt).writer);
+    if (index == ctxt.words.size()) {
+        word.symbol = _rpn_symbol_intern(ctxt, name, length);
+        if (RPN_SYMBOL_NONE == word.symbol) {
+            rpn_error = RPN_ERROR_OUT_OF_MEMORY;
+            return false;
+        }
+        word.name = _rpn_symbol_name(ctxt, word.symbol);
+        word.version = 0;
+        word.program = ctxt.word_code.size();
+        word.size = 0;
+        word.bindings = ctxt.word_bindings.size();
+        word.count = 0;
+        if (!ctxt.words.push_back(word)) {
+            rpn_error = RPN_ERROR_OUT_OF_MEMORY;
+            return false;
+        }
+    } else {
+        word.symbol = ctxt.words[index].symbol;
+        word.name = ctxt.words[index].name;
+    }
+
+    // The old body goes first, so a failure leaves the word deleted
+    rpn_word & slot = ctxt.words[index];
+    _rpn_word_release(ctxt, slot);
+    slot.version = 0;
+    word.program = ctxt.word_code.size();
+    word.size = code.size();
+    word.bindings = ctxt.word_bindings.size();
+    word.count = bindings.size();
+    word.version = ++ctxt.word_versions;
+    if (!ctxt.word_code.append(code.data(), code.size()) || !ctxt.word_bindings.append(bindings.data(), bindings.size())) {
+        ctxt.word_code.resize(word.program);
+        rpn_error = RPN_ERROR_OUT_OF_MEMORY;
+        _rpn_memory_recount(ctxt);
+        return false;
+    }
+    slot = word;
+    _rpn_memory_recount(ctxt);
+    return true;
+
+}
+
+// Runs like an operator would, with its own loops
+bool _rpn_word_call(rpn_context & ctxt, unsigned int index) {
+    rpn_word & word = ctxt.words[index];
+    if (ctxt.stack.size() < word.argc) {
+        rpn_error = RPN_ERROR_ARGUMENT_COUNT_MISMATCH;
+        return false;
+    }
+    return _rpn_run(ctxt, ctxt.word_code.data() + word.program, ctxt.word_bindings.data() + word.bindings);
+}
+
+// The body is an expression, compiled right away
+bool rpn_word_set(rpn_context & ctxt, const char * name, const char * body) {
+    return _rpn_word_set(ctxt, name, strlen(name), body, strlen(body));
+}
+
+bool rpn_word_del(rpn_context & ctxt, const char * name) {
+    unsigned int index = _rpn_word_find(ctxt, name, strlen(name));
+    if ((index == ctxt.words.size()) || ctxt.words.fixed()) return false;
+    _rpn_word_release(ctxt, ctxt.words[index]);
+    ctxt.words[index].version = 0;
+    _rpn_memory_recount(ctxt);
+    return true;
+}
+
+bool rpn_words_clear(rpn_context & ctxt) {
+    ctxt.words.clear();
+    ctxt.checkpoint.words = 0;
+    ctxt.word_code.clear();
+    ctxt.word_bindings.clear();
+    if (ctxt.operators.empty() && ctxt.variables.empty()) _rpn_symbols_clear(ctxt);
+    _rpn_memory_recount(ctxt);
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Execution
+// ----------------------------------------------------------------------------
+
+// Runs a validated program, bindings as returned by _rpn_program_bind.
+// Given where to resume from it starts there and stops after that many
+// instructions or ticks (0 for no limit), the position of the next
+// instruction and the open loops are saved and it fails with
+// RPN_ERROR_NOT_FINISHED.
+bool _rpn_run(rpn_context & ctxt, const unsigned char * data, const unsigned int * bindings, rpn_resume * resume, unsigned long instructions, unsigned long ticks) {
+
+    rpn_error = RPN_ERROR_OK;
+    _rpn_snapshot snapshot(ctxt);
+
+    bool variable_must_exist = RPN_READ_BYTE(data + 4) & RPN_PROGRAM_FLAG_MUST_EXIST;
+    unsigned int operators = _rpn_read_u16(data + 8);
+    unsigned int variables = _rpn_read_u16(data + 10);
+    unsigned long code = _rpn_read_u32(data + 12);
+    unsigned long code_size = _rpn_read_u32(data + 16);
+
+    // Words it uses must not have changed since it was compiled or loaded
+    const unsigned int * uses = bindings + operators + variables + RPN_READ_BYTE(data + 5);
+    for (unsigned int i=0; i<uses[0]; i++) {
+        unsigned int index = uses[1 + 2 * i];
+        if ((index >= ctxt.words.size()) || (ctxt.words[index].version != uses[2 + 2 * i])) {
+            rpn_error = RPN_ERROR_STALE_PROGRAM;
+            RPN_TRACE(ctxt, RPN_TRACE_ERROR);
+            return false;
+        }
+    }
+
+    const unsigned char * literals = data + RPN_PROGRAM_HEADER_SIZE;
+    const unsigned char * first = data + code;
+    const unsigned char * ip = first;
+    const unsigned char * end = ip + code_size;
+
+    rpn_resume local {};
+    rpn_resume & state = resume ? *resume : local;
+    bool budget = resume && (instructions || ticks);
+    unsigned long start = ticks ? _rpn_ticks() : 0;
+    unsigned long executed = 0;
+    ip += state.position;
+
+    while (ip < end) {
+
+        // At least one instruction per call, so it always moves forward
+        if (budget && executed) {
+            if ((instructions && (executed == instructions)) || (ticks && (_rpn_ticks() - start >= ticks))) {
+                state.position = ip - first;
+                rpn_error = RPN_ERROR_NOT_FINISHED;
+                return false;
+            }
+        }
+        executed++;
+
+        unsigned char opcode = RPN_READ_BYTE(ip);
+        unsigned int operand = _rpn_read_u16(ip + 1);
+        ip += RPN_INSTRUCTION_SIZE;
+
+        if (RPN_OPCODE_NUMBER == opcode) {
+            float value;
+            RPN_READ_BLOCK(&value, literals + operand * sizeof(float), sizeof(float));
+            if (!rpn_stack_push(ctxt, value)) break;
+            RPN_TRACE(ctxt, RPN_TRACE_NUMBER);
+            continue;
+        }
+
+        if (RPN_OPCODE_OPERATOR == opcode) {
+            unsigned int index = bindings[operand];
+            if (index >= ctxt.operators.size()) {
+                rpn_error = RPN_ERROR_INVALID_PROGRAM;
+                break;
+            }
+            if (ctxt.stack.size() < ctxt.operators[index].argc) {
+                rpn_error = RPN_ERROR_ARGUMENT_COUNT_MISMATCH;
+                break;
+            }
+            if (!_rpn_operator_call(ctxt, index)) {
+                // Same as rpn_process, operators failing
+                // without an error are reported as unknown tokens
+                if (RPN_ERROR_OK == rpn_error) rpn_error = RPN_ERROR_UNKNOWN_TOKEN;
+                break;
+            }
+            if (RPN_ERROR_OK != rpn_error) break;
+            RPN_TRACE(ctxt, index);
+            continue;
+        }
+
+        if (RPN_OPCODE_CALL == opcode) {
+            if (!_rpn_word_call(ctxt, bindings[operators + variables + operand])) break;
+            continue;
+        }
+
+        if (RPN_OPCODE_JUMP == opcode) {
+            ip = first + operand * RPN_INSTRUCTION_SIZE;
+            continue;
+        }
+
+        // Only rule sets have them, and they fail like the expression they replace
+        if (RPN_OPCODE_TEMPORARY == opcode) {
+            if (operand >= ctxt.temporaries_size) {
+                rpn_error = RPN_ERROR_INVALID_PROGRAM;
+                break;
+            }
+            const rpn_temporary & temporary = ctxt.temporaries[operand];
+            if (RPN_ERROR_OK != temporary.error) {
+                rpn_error = temporary.error;
+                break;
+            }
+            if (!rpn_stack_push(ctxt, temporary.value)) break;
+            RPN_TRACE(ctxt, RPN_TRACE_VARIABLE);
+            continue;
+        }
+
+        if ((RPN_OPCODE_BRANCH == opcode) || (RPN_OPCODE_DO == opcode)) {
+            float value;
+            if (!rpn_stack_pop(ctxt, value)) {
+                rpn_error = RPN_ERROR_ARGUMENT_COUNT_MISMATCH;
+                break;
+            }
+            if (RPN_OPCODE_BRANCH == opcode) {
+                if (0 == value) ip = first + operand * RPN_INSTRUCTION_SIZE;
+            } else if (!(value <= RPNLIB_LOOP_MAX)) {
+                rpn_error = RPN_ERROR_UNVALID_ARGUMENT;
+                break;
+            } else if (value < 1) {
+                ip = first + operand * RPN_INSTRUCTION_SIZE;
+            } else if (state.loops == RPNLIB_LOOP_DEPTH) {
+                rpn_error = RPN_ERROR_OUT_OF_MEMORY;
+                break;
+            } else {
+                state.counters[state.loops++] = value;
+            }
+            continue;
+        }
+
+        if (RPN_OPCODE_LOOP == opcode) {
+            if (0 == state.loops) {
+                rpn_error = RPN_ERROR_INVALID_PROGRAM;
+                break;
+            }
+            if (--state.counters[state.loops - 1]) {
+                ip = first + operand * RPN_INSTRUCTION_SIZE;
+            } else {
+                state.loops--;
+            }
+            continue;
+        }
+
+        // Variable
+        const char * name = (const char *) data + bindings[operators + operand];
+        #ifdef ARDUINO_ARCH_ESP8266
+            char buffer[0x100];
+            RPN_READ_BLOCK(buffer, name, RPN_READ_BYTE(name - 1) + 1);
+            name = buffer;
+        #endif
+        float value = 0;
+        bool found = rpn_variable_get(ctxt, name, value);
+        if (RPN_ERROR_OK != rpn_error) break;
+        if (!found && variable_must_exist) {
+            rpn_error = RPN_ERROR_UNKNOWN_TOKEN;
+            break;
+        }
+        if (!rpn_stack_push(ctxt, value)) break;
+        RPN_TRACE(ctxt, RPN_TRACE_VARIABLE);
+
+    }
+
+    if (RPN_ERROR_OK != rpn_error) {
+        RPN_TRACE(ctxt, RPN_TRACE_ERROR);
+    }
+    return (RPN_ERROR_OK == rpn_error);
+
+}
+
+// Same as rpn_process, the program might be run again from the start when
+// its snapshot expired, calling its operators more than once
+bool rpn_execute(rpn_context & ctxt, const rpn_program & program) {
+    const unsigned char * data = _rpn_program_data(program);
+    if (!data) {
+        rpn_error = RPN_ERROR_INVALID_PROGRAM;
+        return false;
+    }
+    bool empty = ctxt.stack.empty();
+    unsigned int retries = 0;
+    bool result;
+    do {
+        result = _rpn_run(ctxt, data, program.bindings.data());
+    } while (!result && _rpn_snapshot_retry(ctxt, empty, retries));
+    return result;
+}
+
+bool rpn_execute(rpn_context & ctxt, const rpn_program & program, rpn_histogram & histogram) {
+    unsigned long start = _rpn_ticks();
+    bool result = rpn_execute(ctxt, program);
+    _rpn_histogram_record(histogram, _rpn_ticks() - start);
+    return result;
+}
+
+// Runs at most that many instructions, or for about that many microseconds
+// (whatever comes first, 0 is no limit), then fails with RPN_ERROR_NOT_FINISHED
+// leaving the program paused. Calling it again with the same program picks
+// it up where it was. Any other program (or this one compiled or loaded
+// again) drops the paused one, along with what it left on the stack, and
+// starts over. A slow operator is not interrupted, the budget is checked
+// between instructions. Variables are read as of when each call starts.
+bool rpn_execute_budget(rpn_context & ctxt, const rpn_program & program, unsigned long instructions, unsigned long microseconds) {
+    const unsigned char * data = _rpn_program_data(program);
+    if (!data) {
+        rpn_error = RPN_ERROR_INVALID_PROGRAM;
+        return false;
+    }
+    rpn_resume & paused = ctxt.paused;
+    if (paused.program != program.id) {
+        rpn_execute_reset(ctxt);
+        paused.program = program.id;
+        paused.depth = ctxt.stack.size();
+    }
+    bool result = _rpn_run(ctxt, data, program.bindings.data(), &paused, instructions, _rpn_us_to_ticks(microseconds));
+    if (RPN_ERROR_NOT_FINISHED != rpn_error) paused = rpn_resume {};
+    return result;
+}
+
+// Drops the paused program, if any, and the values it left on the stack
+bool rpn_execute_reset(rpn_context & ctxt) {
+    if (ctxt.paused.program && (ctxt.stack.size() > ctxt.paused.depth)) {
+        ctxt.stack.resize(ctxt.paused.depth);
+    }
+    ctxt.paused = rpn_resume {};
+    return true;
+}
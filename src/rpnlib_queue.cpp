@@ -0,0 +1,299 @@
+/*
+
+RPNlib
+
+Copyright (C) 2018-2019 by Xose Pérez <xose dot perez at gmail dot com>
+
+The rpnlib library is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+The rpnlib library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with the rpnlib library.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "rpnlib.h"
+#include "rpnlib_internal.h"
+
+#ifdef RPNLIB_THREADS
+
+#include <new>
+
+#ifdef __linux__
+#include <climits>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// ----------------------------------------------------------------------------
+// Evaluation queue
+// ----------------------------------------------------------------------------
+//
+// Bounded ring of request pointers that any number of threads can submit
+// to and take from without locks (Dmitry Vyukov's MPMC queue). Every cell
+// has a sequence number telling whether it is free for the submission or
+// holds the request for the taker with that position. Submitting never
+// allocates nor waits, a full queue is reported as RPN_ERROR_OUT_OF_MEMORY.
+// Idle evaluators and rpn_request_wait sleep on an event. Sleepers count
+// themselves in and read the event count before checking whether they
+// still have to sleep, wakers publish and bump the event count before
+// checking whether anybody sleeps. Either the sleeper sees what was
+// published or the waker sees the sleeper, and a sleeper that read the
+// count before the bump does not sleep at all.
+//
+// Submissions in flight are counted too, rpn_queue_clear waits for them
+// after stopping new ones, so nothing lands in the queue once it drained.
+//
+// Evaluators are forks of the queue context, the inputs of a request are
+// overrides of the fork (so the shared variables are not written and no
+// epoch is published) and dropped with rpn_reset once it is done. They take
+// requests in batches, and requests of a batch with the same program and
+// inputs are evaluated only once.
+
+rpn_queue::~rpn_queue() {
+    rpn_queue_clear(*this);
+}
+
+bool _rpn_queue_push(rpn_queue & queue, rpn_request * request) {
+    size_t position = queue.tail.load(std::memory_order_relaxed);
+    rpn_queue::cell * cell;
+    while (true) {
+        cell = &queue.cells[position & queue.mask];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        long difference = (long) (sequence - position);
+        if (0 == difference) {
+            if (queue.tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+        } else if (difference < 0) {
+            return false;
+        } else {
+            position = queue.tail.load(std::memory_order_relaxed);
+        }
+    }
+    cell->request = request;
+    cell->sequence.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+bool _rpn_queue_pop(rpn_queue & queue, rpn_request * & request) {
+    size_t position = queue.head.load(std::memory_order_relaxed);
+    rpn_queue::cell * cell;
+    while (true) {
+        cell = &queue.cells[position & queue.mask];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        long difference = (long) (sequence - (position + 1));
+        if (0 == difference) {
+            if (queue.head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+        } else if (difference < 0) {
+            return false;
+        } else {
+            position = queue.head.load(std::memory_order_relaxed);
+        }
+    }
+    request = cell->request;
+    cell->sequence.store(position + queue.mask + 1, std::memory_order_release);
+    return true;
+}
+
+bool _rpn_queue_empty(rpn_queue & queue) {
+    size_t position = queue.head.load(std::memory_order_relaxed);
+    return queue.cells[position & queue.mask].sequence.load(std::memory_order_acquire) != position + 1;
+}
+
+// Sleeps unless the event count moved past the one read
+void _rpn_event_wait(rpn_event & event, unsigned int seen) {
+    #ifdef __linux__
+        static_assert(sizeof(std::atomic<unsigned int>) == sizeof(int), "futex needs a plain int");
+        syscall(SYS_futex, (int *) &event.count, FUTEX_WAIT_PRIVATE, (int) seen, nullptr, nullptr, 0);
+    #else
+        std::unique_lock<std::mutex> lock(event.lock);
+        while (event.count.load() == seen) event.wake.wait(lock);
+    #endif
+}
+
+void _rpn_event_wake(rpn_event & event, bool all) {
+    event.count.fetch_add(1);
+    if (0 == event.sleepers.load()) return;
+    #ifdef __linux__
+        syscall(SYS_futex, (int *) &event.count, FUTEX_WAKE_PRIVATE, all ? INT_MAX : 1, nullptr, nullptr, 0);
+    #else
+        { std::lock_guard<std::mutex> lock(event.lock); }
+        if (all) event.wake.notify_all();
+        else event.wake.notify_one();
+    #endif
+}
+
+bool _rpn_request_same(const rpn_request & one, const rpn_request & other) {
+    if ((one.program != other.program) || (one.count != other.count)) return false;
+    for (size_t i=0; i<one.count; i++) {
+        if (one.values[i] != other.values[i]) return false;
+        if ((one.names[i] != other.names[i]) && (strcmp(one.names[i], other.names[i]) != 0)) return false;
+    }
+    return true;
+}
+
+// A request with a callback is handed over to it, and not touched afterwards.
+// Neither is a waited request once done, the waiter might have dropped it.
+void _rpn_request_complete(rpn_request & request) {
+    void (*callback)(rpn_request &) = request.callback;
+    if (callback) {
+        request.done.store(true, std::memory_order_relaxed);
+        callback(request);
+        return;
+    }
+    rpn_queue & queue = *request.queue;
+    request.done.store(true, std::memory_order_release);
+    _rpn_event_wake(queue.completed, true);
+}
+
+void _rpn_queue_evaluate(rpn_context & ctxt, rpn_request * batch[], size_t count) {
+    for (size_t i=0; i<count; i++) {
+        rpn_request & request = *batch[i];
+        size_t same = 0;
+        while ((same < i) && !_rpn_request_same(*batch[same], request)) same++;
+        if (same < i) {
+            request.result = batch[same]->result;
+            request.error = batch[same]->error;
+            continue;
+        }
+        bool result = ((0 == request.count) || _rpn_variables_override(ctxt, request.names, request.values, request.count))
+            && rpn_execute(ctxt, *request.program);
+        request.result = (result && !ctxt.stack.empty()) ? ctxt.stack.back() : 0;
+        request.error = rpn_error;
+        rpn_reset(ctxt);
+    }
+    for (size_t i=0; i<count; i++) {
+        _rpn_request_complete(*batch[i]);
+    }
+}
+
+// Sleeps until a submission or rpn_queue_clear, see above
+void _rpn_queue_sleep(rpn_queue & queue) {
+    rpn_event & event = queue.submitted;
+    event.sleepers.fetch_add(1);
+    while (true) {
+        unsigned int seen = event.count.load();
+        if (!_rpn_queue_empty(queue) || queue.stopping.load()) break;
+        _rpn_event_wait(event, seen);
+    }
+    event.sleepers.fetch_sub(1);
+}
+
+// Whatever was submitted is evaluated before stopping
+void _rpn_queue_thread(rpn_queue & queue, rpn_context & ctxt) {
+    rpn_request * batch[RPN_QUEUE_BATCH];
+    while (true) {
+        // Every submission made it in once stopping, so an empty queue stays so
+        bool stopping = queue.stopping.load();
+        size_t count = 0;
+        while ((count < RPN_QUEUE_BATCH) && _rpn_queue_pop(queue, batch[count])) count++;
+        if (count) {
+            _rpn_queue_evaluate(ctxt, batch, count);
+        } else if (stopping) {
+            return;
+        } else {
+            _rpn_queue_sleep(queue);
+        }
+    }
+}
+
+// Capacity is rounded up to a power of two. As with any fork, nothing but
+// the context variables may change until the queue is cleared. Nothing
+// may be submitted while it is initialized.
+bool rpn_queue_init(rpn_queue & queue, rpn_context & ctxt, size_t capacity, size_t evaluators) {
+    rpn_queue_clear(queue);
+    size_t size = 2;
+    while (size < capacity) size *= 2;
+    queue.cells = new (std::nothrow) rpn_queue::cell[size];
+    if (!queue.cells) {
+        rpn_error = RPN_ERROR_OUT_OF_MEMORY;
+        return false;
+    }
+    for (size_t i=0; i<size; i++) {
+        queue.cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    queue.mask = size - 1;
+    queue.head.store(0, std::memory_order_relaxed);
+    queue.tail.store(0, std::memory_order_relaxed);
+    if (0 == evaluators) evaluators = 1;
+    for (size_t i=0; i<evaluators; i++) {
+        rpn_context * fork = new (std::nothrow) rpn_context();
+        if (!fork) {
+            rpn_queue_clear(queue);
+            rpn_error = RPN_ERROR_OUT_OF_MEMORY;
+            return false;
+        }
+        rpn_fork(ctxt, *fork);
+        queue.evaluators.push_back(fork);
+    }
+    for (auto fork : queue.evaluators) {
+        queue.threads.emplace_back(_rpn_queue_thread, std::ref(queue), std::ref(*fork));
+    }
+    return true;
+}
+
+// Allocation free, and lock free on Linux (see rpn_event). Fails if the
+// queue is full or not running, the request is then done with that error.
+bool rpn_queue_submit(rpn_queue & queue, rpn_request & request) {
+    request.done.store(false, std::memory_order_relaxed);
+    request.error = RPN_ERROR_OK;
+    request.queue = &queue;
+    queue.submitting.fetch_add(1);
+    bool result = !queue.closed.load() && queue.cells && _rpn_queue_push(queue, &request);
+    if (result) _rpn_event_wake(queue.submitted, false);
+    queue.submitting.fetch_sub(1);
+    if (!result) {
+        request.error = RPN_ERROR_OUT_OF_MEMORY;
+        request.done.store(true, std::memory_order_release);
+        rpn_error = RPN_ERROR_OUT_OF_MEMORY;
+    }
+    return result;
+}
+
+// Waits for a request without a callback, true if it was evaluated with
+// no error (which is left in rpn_error)
+bool rpn_request_wait(rpn_request & request) {
+    if (!request.done.load(std::memory_order_acquire)) {
+        rpn_event & event = request.queue->completed;
+        event.sleepers.fetch_add(1);
+        while (true) {
+            unsigned int seen = event.count.load();
+            if (request.done.load(std::memory_order_acquire)) break;
+            _rpn_event_wait(event, seen);
+        }
+        event.sleepers.fetch_sub(1);
+    }
+    rpn_error = request.error;
+    return (RPN_ERROR_OK == rpn_error);
+}
+
+// Evaluates whatever is still queued, then stops the evaluators
+// (submissions racing with it either fail or make it in before that)
+bool rpn_queue_clear(rpn_queue & queue) {
+    queue.closed.store(true);
+    while (queue.submitting.load()) std::this_thread::yield();
+    queue.stopping.store(true);
+    _rpn_event_wake(queue.submitted, true);
+    for (auto & thread : queue.threads) thread.join();
+    queue.threads.clear();
+    for (auto fork : queue.evaluators) {
+        rpn_clear(*fork);
+        delete fork;
+    }
+    queue.evaluators.clear();
+    delete [] queue.cells;
+    queue.cells = nullptr;
+    queue.mask = 0;
+    queue.stopping.store(false);
+    queue.closed.store(false);
+    return true;
+}
+
+#endif
@@ -0,0 +1,587 @@
+/*
+
+RPNlib
+
+Copyright (C) 2018-2019 by Xose Pérez <xose dot perez at gmail dot com>
+
+The rpnlib library is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+The rpnlib library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with the rpnlib library.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "rpnlib.h"
+#include "rpnlib_internal.h"
+
+#include <string.h>
+
+#include <string>
+#include <unordered_map>
+
+#ifndef ARDUINO
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// ----------------------------------------------------------------------------
+// Ruleset methods
+// ----------------------------------------------------------------------------
+
+// Tells rule sets apart for the temporaries kept by contexts
+std::atomic<unsigned long> _rpn_ruleset_ids {0};
+
+unsigned long _rpn_ruleset_id() {
+    return _rpn_ruleset_ids.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+// One rule per line, empty lines and lines starting with # are skipped.
+// Tokens are read in place, the text is not copied.
+bool rpn_ruleset_compile(rpn_context & ctxt, rpn_ruleset & ruleset, const char * text, size_t length, bool variable_must_exist) {
+
+    _rpn_compiler compiler;
+
+    ruleset.arena.clear();
+    ruleset.bindings.clear();
+    ruleset.rules.clear();
+    ruleset.temporaries.clear();
+    ruleset.id = _rpn_ruleset_id();
+    ruleset.error_line = 0;
+    rpn_error = RPN_ERROR_OK;
+
+    unsigned long line = 0;
+    size_t position = 0;
+    while (position < length) {
+
+        const char * start = text + position;
+        const char * eol = (const char *) memchr(start, '\n', length - position);
+        size_t line_length = eol ? (size_t) (eol - start) : length - position;
+        position += line_length + 1;
+        line++;
+
+        if ((line_length > 0) && ('\r' == start[line_length - 1])) line_length--;
+        size_t first = 0;
+        while ((first < line_length) && (' ' == start[first])) first++;
+        if ((first == line_length) || ('#' == start[first])) continue;
+
+        rpn_ruleset::rule rule = {
+            (unsigned int) ruleset.arena.size(),
+            (unsigned int) ruleset.bindings.size()
+        };
+        if (!_rpn_program_build(ctxt, compiler, start, line_length, variable_must_exist, ruleset.arena, ruleset.bindings)) {
+            ruleset.arena.resize(rule.program);
+            ruleset.error_line = line;
+            return false;
+        }
+        ruleset.rules.push_back(rule);
+
+    }
+
+    return true;
+
+}
+
+#ifndef ARDUINO
+
+// Whatever is left to read, for files that cannot be mapped (pipes, /proc)
+bool _rpn_ruleset_read(int fd, std::string & text) {
+    char buffer[512];
+    while (true) {
+        ssize_t count = read(fd, buffer, sizeof(buffer));
+        if (count < 0) {
+            if (EINTR == errno) continue;
+            return false;
+        }
+        if (0 == count) return true;
+        text.append(buffer, count);
+    }
+}
+
+// Maps the file instead of reading it and compiles it in place. The arena
+// is reserved upfront for the worst case, but pages that are never written
+// are never backed by memory. Anything but regular files (pipes, /proc,
+// whose size is unknown) is read instead. Files that cannot be opened,
+// mapped or read fail with RPN_ERROR_FILE.
+bool rpn_ruleset_load(rpn_context & ctxt, rpn_ruleset & ruleset, const char * filename, bool variable_must_exist) {
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        rpn_error = RPN_ERROR_FILE;
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        rpn_error = RPN_ERROR_FILE;
+        return false;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        std::string text;
+        bool complete = _rpn_ruleset_read(fd, text);
+        close(fd);
+        if (!complete) {
+            rpn_error = RPN_ERROR_FILE;
+            return false;
+        }
+        return rpn_ruleset_compile(ctxt, ruleset, text.data(), text.size(), variable_must_exist);
+    }
+
+    size_t length = st.st_size;
+    if (0 == length) {
+        close(fd);
+        return rpn_ruleset_compile(ctxt, ruleset, "", 0, variable_must_exist);
+    }
+
+    void * text = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == text) {
+        rpn_error = RPN_ERROR_FILE;
+        return false;
+    }
+    madvise(text, length, MADV_SEQUENTIAL);
+
+    size_t lines = 1;
+    for (const char * p = (const char *) text; (p = (const char *) memchr(p, '\n', length - (p - (const char *) text))); p++) {
+        lines++;
+    }
+    ruleset.arena.reserve(length * (sizeof(float) + RPN_INSTRUCTION_SIZE) / 2 + lines * RPN_PROGRAM_HEADER_SIZE);
+    ruleset.bindings.reserve(length / 2);
+    ruleset.rules.reserve(lines);
+
+    bool result = rpn_ruleset_compile(ctxt, ruleset, (const char *) text, length, variable_must_exist);
+    munmap(text, length);
+    return result;
+
+}
+
+#endif
+
+size_t rpn_ruleset_size(const rpn_ruleset & ruleset) {
+    return ruleset.rules.size();
+}
+
+// Rules read the shared temporaries from values
+bool _rpn_ruleset_execute(rpn_context & ctxt, const rpn_ruleset & ruleset, size_t index, const rpn_temporary * values) {
+    if (index >= ruleset.rules.size()) {
+        rpn_error = RPN_ERROR_INVALID_PROGRAM;
+        return false;
+    }
+    const rpn_ruleset::rule & rule = ruleset.rules[index];
+    const rpn_temporary * temporaries = ctxt.temporaries;
+    size_t temporaries_size = ctxt.temporaries_size;
+    ctxt.temporaries = values;
+    ctxt.temporaries_size = ruleset.temporaries.size();
+    bool empty = ctxt.stack.empty();
+    unsigned int retries = 0;
+    bool result;
+    do {
+        result = _rpn_run(ctxt, ruleset.arena.data() + rule.program, ruleset.bindings.data() + rule.bindings);
+    } while (!result && _rpn_snapshot_retry(ctxt, empty, retries));
+    ctxt.temporaries = temporaries;
+    ctxt.temporaries_size = temporaries_size;
+    return result;
+}
+
+// Temporaries are kept by the context, as of the epoch they were computed
+// at. Rules executed without a pinned snapshot read the variables as of
+// that epoch too, so they agree with the temporaries without computing
+// them again (until it expires). Under a pinned snapshot, or when they are
+// of another rule set, they are computed first.
+bool rpn_ruleset_execute(rpn_context & ctxt, const rpn_ruleset & ruleset, size_t index) {
+    if (ruleset.temporaries.empty()) {
+        return _rpn_ruleset_execute(ctxt, ruleset, index, nullptr);
+    }
+    bool empty = ctxt.stack.empty();
+    unsigned int retries = 0;
+    bool result;
+    do {
+        bool current = (ctxt.values_ruleset == ruleset.id);
+        if (current && !ctxt.pins && !retries) {
+            _rpn_snapshot_acquire(ctxt, ctxt.values_snapshot);
+        } else {
+            rpn_snapshot_acquire(ctxt);
+        }
+        result = true;
+        if (!current || (ctxt.values_snapshot != ctxt.snapshot)) {
+            // Temporaries that fail are reported by the rules reading them
+            result = _rpn_ruleset_refresh(ctxt, ruleset) || (RPN_ERROR_OUT_OF_MEMORY != rpn_error);
+        }
+        if (result) {
+            result = _rpn_ruleset_execute(ctxt, ruleset, index, ctxt.values.data());
+        }
+        rpn_snapshot_release(ctxt);
+    } while (!result && _rpn_snapshot_retry(ctxt, empty, retries));
+    return result;
+}
+
+bool rpn_ruleset_clear(rpn_ruleset & ruleset) {
+    ruleset.arena.clear();
+    ruleset.arena.shrink_to_fit();
+    ruleset.bindings.clear();
+    ruleset.bindings.shrink_to_fit();
+    ruleset.rules.clear();
+    ruleset.rules.shrink_to_fit();
+    ruleset.temporaries.clear();
+    ruleset.temporaries.shrink_to_fit();
+    ruleset.id = _rpn_ruleset_id();
+    ruleset.error_line = 0;
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Shared sub-expressions
+// ----------------------------------------------------------------------------
+//
+// Rules are read back as expression trees made of numbers, variables and
+// pure operators, and the same operator on the same operands is the same
+// node wherever it is found. Nodes found more than once are compiled into
+// programs of their own, the temporaries, and the instructions computing
+// them in the rules are replaced with one reading the value. Temporaries
+// are numbered children first, so they can read the ones before them.
+// Rules with control flow, calls to words or operators leaving a variable
+// number of values are left as they are.
+
+#define RPN_NODE_NONE               0xFFFFFFFF
+
+struct _rpn_node {
+    unsigned char opcode;
+    unsigned int operand;                   // literal bits, variable or context operator index
+    unsigned int children;                  // offset of the first one
+    unsigned char argc;
+    unsigned int size;                      // instructions computing it
+    unsigned int count;                     // times it was found
+    unsigned int temporary;
+};
+
+// Value on the stack while reading a rule, and the instruction that
+// started computing it. Values that cannot be shared have no node.
+struct _rpn_slot {
+    unsigned int node;
+    unsigned int begin;
+};
+
+// Instructions [begin, end) of a rule compute the node
+struct _rpn_occurrence {
+    unsigned int node;
+    unsigned int begin;
+    unsigned int end;
+};
+
+struct _rpn_expressions {
+    std::vector<_rpn_node> nodes;
+    std::vector<unsigned int> children;
+    std::vector<_rpn_token> names;          // variables, as first found
+    std::unordered_map<std::string, unsigned int> index;        // nodes by opcode, operand and children
+    std::unordered_map<std::string, unsigned int> variables;    // names by name
+};
+
+unsigned int _rpn_expressions_node(_rpn_expressions & expressions, unsigned char opcode, unsigned int operand, const _rpn_slot * children, unsigned char argc, unsigned int size) {
+    std::string key(1, opcode);
+    key.append((const char *) &operand, sizeof(operand));
+    for (unsigned char i=0; i<argc; i++) {
+        key.append((const char *) &children[i].node, sizeof(children[i].node));
+    }
+    auto found = expressions.index.find(key);
+    if (found != expressions.index.end()) return found->second;
+    unsigned int id = expressions.nodes.size();
+    expressions.nodes.push_back({opcode, operand, (unsigned int) expressions.children.size(), argc, size, 0, RPN_NODE_NONE});
+    for (unsigned char i=0; i<argc; i++) {
+        expressions.children.push_back(children[i].node);
+    }
+    expressions.index.emplace(std::move(key), id);
+    return id;
+}
+
+// Adds the nodes of a rule and where pure operators were found,
+// false if the rule has anything else that cannot be moved around
+bool _rpn_expressions_read(rpn_context & ctxt, _rpn_expressions & expressions, const unsigned char * data, const unsigned int * bindings, std::vector<_rpn_occurrence> & occurrences) {
+
+    unsigned int operators = _rpn_read_u16(data + 8);
+    const unsigned char * code = data + _rpn_read_u32(data + 12);
+    unsigned int instructions = _rpn_read_u32(data + 16) / RPN_INSTRUCTION_SIZE;
+
+    std::vector<_rpn_slot> stack;
+    for (unsigned int instruction = 0; instruction < instructions; instruction++) {
+
+        unsigned char opcode = RPN_READ_BYTE(code + instruction * RPN_INSTRUCTION_SIZE);
+        unsigned int operand = _rpn_read_u16(code + instruction * RPN_INSTRUCTION_SIZE + 1);
+
+        if (RPN_OPCODE_NUMBER == opcode) {
+            unsigned int bits;
+            RPN_READ_BLOCK(&bits, data + RPN_PROGRAM_HEADER_SIZE + operand * sizeof(float), sizeof(float));
+            stack.push_back({_rpn_expressions_node(expressions, opcode, bits, nullptr, 0, 1), instruction});
+            continue;
+        }
+
+        if (RPN_OPCODE_VARIABLE == opcode) {
+            const char * name = (const char *) data + bindings[operators + operand];
+            _rpn_token variable = {name, RPN_READ_BYTE(name - 1)};
+            auto found = expressions.variables.emplace(std::string(name, variable.length), expressions.names.size());
+            if (found.second) expressions.names.push_back(variable);
+            stack.push_back({_rpn_expressions_node(expressions, opcode, found.first->second, nullptr, 0, 1), instruction});
+            continue;
+        }
+
+        if (RPN_OPCODE_OPERATOR != opcode) return false;
+        unsigned int index = bindings[operand];
+        rpn_operator & f = ctxt.operators[index];
+        if ((stack.size() < f.argc) || (RPN_RESULTS_VARIABLE == f.results)) return false;
+
+        // Only when nothing but its operands was computed since the first of them
+        _rpn_slot * children = stack.data() + stack.size() - f.argc;
+        _rpn_slot slot = {RPN_NODE_NONE, f.argc ? children[0].begin : instruction};
+        unsigned int size = 1;
+        bool shared = f.pure;
+        for (unsigned char i=0; shared && (i<f.argc); i++) {
+            shared = (RPN_NODE_NONE != children[i].node);
+            if (shared) size += expressions.nodes[children[i].node].size;
+        }
+        if (shared && (instruction + 1 - slot.begin == size)) {
+            slot.node = _rpn_expressions_node(expressions, opcode, index, children, f.argc, size);
+            occurrences.push_back({slot.node, slot.begin, instruction + 1});
+        }
+        stack.resize(stack.size() - f.argc);
+        stack.insert(stack.end(), f.pure ? 1 : f.results, slot);
+
+    }
+
+    return true;
+
+}
+
+// Whatever the node is made of, and then the node itself
+bool _rpn_expressions_emit(const _rpn_expressions & expressions, _rpn_compiler & compiler, unsigned int id, bool top) {
+    const _rpn_node & node = expressions.nodes[id];
+    if (!top && (RPN_NODE_NONE != node.temporary)) {
+        return _rpn_emit(compiler, RPN_OPCODE_TEMPORARY, node.temporary);
+    }
+    for (unsigned char i=0; i<node.argc; i++) {
+        if (!_rpn_expressions_emit(expressions, compiler, expressions.children[node.children + i], false)) return false;
+    }
+    unsigned int operand;
+    if (RPN_OPCODE_NUMBER == node.opcode) {
+        float value;
+        memcpy(&value, &node.operand, sizeof(float));
+        operand = _rpn_compile_literal(compiler, value);
+    } else if (RPN_OPCODE_VARIABLE == node.opcode) {
+        operand = _rpn_compile_variable(compiler, expressions.names[node.operand]);
+    } else {
+        operand = _rpn_compile_index(compiler.operators, node.operand);
+    }
+    return _rpn_emit(compiler, node.opcode, operand);
+}
+
+// Recompiles a rule reading the temporaries instead of computing them again
+bool _rpn_expressions_rewrite(rpn_context & ctxt, _rpn_compiler & compiler, const unsigned char * data, const unsigned int * bindings, const _rpn_occurrence * shared, size_t count, std::vector<unsigned char> & arena, std::vector<unsigned int> & output) {
+
+    unsigned int operators = _rpn_read_u16(data + 8);
+    unsigned int variables = _rpn_read_u16(data + 10);
+    const unsigned char * code = data + _rpn_read_u32(data + 12);
+    unsigned int instructions = _rpn_read_u32(data + 16) / RPN_INSTRUCTION_SIZE;
+
+    _rpn_compile_reset(compiler);
+    unsigned int instruction = 0;
+    while (instruction < instructions) {
+        if (count && (instruction == shared->begin)) {
+            if (!_rpn_emit(compiler, RPN_OPCODE_TEMPORARY, shared->node)) return false;
+            instruction = shared->end;
+            shared++;
+            count--;
+            continue;
+        }
+        unsigned char opcode = RPN_READ_BYTE(code + instruction * RPN_INSTRUCTION_SIZE);
+        unsigned int operand = _rpn_read_u16(code + instruction * RPN_INSTRUCTION_SIZE + 1);
+        if (RPN_OPCODE_NUMBER == opcode) {
+            float value;
+            RPN_READ_BLOCK(&value, data + RPN_PROGRAM_HEADER_SIZE + operand * sizeof(float), sizeof(float));
+            operand = _rpn_compile_literal(compiler, value);
+        } else if (RPN_OPCODE_VARIABLE == opcode) {
+            const char * name = (const char *) data + bindings[operators + operand];
+            _rpn_token variable = {name, RPN_READ_BYTE(name - 1)};
+            operand = _rpn_compile_variable(compiler, variable);
+        } else {
+            operand = _rpn_compile_index(compiler.operators, bindings[operand]);
+        }
+        if (!_rpn_emit(compiler, opcode, operand)) return false;
+        instruction++;
+    }
+
+    // Words it was compiled with, they were all inlined
+    const unsigned int * uses = bindings + operators + variables;
+    for (unsigned int i=0; i<uses[0]; i++) {
+        compiler.uses.push_back({uses[1 + 2 * i], uses[2 + 2 * i]});
+    }
+
+    size_t start = arena.size();
+    _rpn_compile_output(ctxt, compiler, RPN_READ_BYTE(data + 4), arena);
+    return _rpn_program_link(ctxt, compiler, arena, start, output);
+
+}
+
+// Sub-expressions found more than once are evaluated once per tick by
+// rpn_ruleset_update (or by the executor, before every run), and the rules
+// read the value. Only the builtin operators are shared, custom ones might
+// do something else than computing a value. Rule sets are optimized once.
+bool rpn_ruleset_optimize(rpn_context & ctxt, rpn_ruleset & ruleset) {
+
+    rpn_error = RPN_ERROR_OK;
+    if (!ruleset.temporaries.empty()) return true;
+
+    // Every node and where it is found, rule by rule
+    _rpn_expressions expressions;
+    std::vector<_rpn_occurrence> occurrences;
+    std::vector<size_t> offsets(1, 0);
+    for (auto & rule : ruleset.rules) {
+        size_t start = occurrences.size();
+        if (!_rpn_expressions_read(ctxt, expressions, ruleset.arena.data() + rule.program, ruleset.bindings.data() + rule.bindings, occurrences)) {
+            occurrences.resize(start);
+        }
+        offsets.push_back(occurrences.size());
+    }
+    std::vector<_rpn_node> & nodes = expressions.nodes;
+    for (auto & occurrence : occurrences) {
+        nodes[occurrence.node].count++;
+    }
+
+    // Parents come after their children. Shared ones are evaluated once, so
+    // what they are made of is evaluated that many times less. Single
+    // operators on a number or a variable are not worth it.
+    std::vector<unsigned int> evaluations(nodes.size());
+    for (size_t id=0; id<nodes.size(); id++) {
+        evaluations[id] = nodes[id].count;
+    }
+    for (size_t id=nodes.size(); id--; ) {
+        _rpn_node & node = nodes[id];
+        if ((evaluations[id] > 1) && (node.size > 2)) {
+            node.temporary = 0;
+            evaluations[id] = 1;
+        }
+        for (unsigned char i=0; i<node.argc; i++) {
+            unsigned int child = expressions.children[node.children + i];
+            if (nodes[child].size > 1) evaluations[child] -= node.count - evaluations[id];
+        }
+    }
+    unsigned int temporaries = 0;
+    for (auto & node : nodes) {
+        if (RPN_NODE_NONE != node.temporary) node.temporary = temporaries++;
+    }
+    if (0 == temporaries) return true;
+
+    std::vector<unsigned char> arena;
+    std::vector<unsigned int> bindings;
+    rpn_ruleset optimized;
+    _rpn_compiler compiler;
+    unsigned char flags = RPN_READ_BYTE(ruleset.arena.data() + ruleset.rules[0].program + 4);
+
+    for (size_t id=0; id<nodes.size(); id++) {
+        if (RPN_NODE_NONE == nodes[id].temporary) continue;
+        rpn_ruleset::rule temporary = {(unsigned int) arena.size(), (unsigned int) bindings.size()};
+        _rpn_compile_reset(compiler);
+        if (!_rpn_expressions_emit(expressions, compiler, id, true)) return false;
+        _rpn_compile_output(ctxt, compiler, flags, arena);
+        if (!_rpn_program_link(ctxt, compiler, arena, temporary.program, bindings)) return false;
+        optimized.temporaries.push_back(temporary);
+    }
+
+    // Outermost occurrences only, a parent is found after its children
+    std::vector<_rpn_occurrence> shared;
+    for (size_t index=0; index<ruleset.rules.size(); index++) {
+
+        shared.clear();
+        unsigned int floor = RPN_NODE_NONE;
+        for (size_t i=offsets[index + 1]; i-- > offsets[index]; ) {
+            _rpn_occurrence occurrence = occurrences[i];
+            occurrence.node = nodes[occurrence.node].temporary;
+            if ((RPN_NODE_NONE == occurrence.node) || (occurrence.end > floor)) continue;
+            shared.insert(shared.begin(), occurrence);
+            floor = occurrence.begin;
+        }
+
+        const rpn_ruleset::rule & rule = ruleset.rules[index];
+        const unsigned char * data = ruleset.arena.data() + rule.program;
+        const unsigned int * rule_bindings = ruleset.bindings.data() + rule.bindings;
+        rpn_ruleset::rule copy = {(unsigned int) arena.size(), (unsigned int) bindings.size()};
+        if (shared.empty()) {
+            unsigned int size = _rpn_read_u32(data + 12) + _rpn_read_u32(data + 16);
+            unsigned int count = _rpn_read_u16(data + 8) + _rpn_read_u16(data + 10) + RPN_READ_BYTE(data + 5);
+            count += 1 + 2 * rule_bindings[count];
+            arena.insert(arena.end(), data, data + size);
+            bindings.insert(bindings.end(), rule_bindings, rule_bindings + count);
+        } else if (!_rpn_expressions_rewrite(ctxt, compiler, data, rule_bindings, shared.data(), shared.size(), arena, bindings)) {
+            return false;
+        }
+        optimized.rules.push_back(copy);
+
+    }
+
+    ruleset.arena.swap(arena);
+    ruleset.bindings.swap(bindings);
+    ruleset.rules.swap(optimized.rules);
+    ruleset.temporaries.swap(optimized.temporaries);
+    ruleset.id = _rpn_ruleset_id();
+    return true;
+
+}
+
+// Evaluates the temporaries into values, all of them reading the variables
+// as of the same snapshot. Fails if any of them did, with the error of the
+// first one, rules reading it fail the same way.
+bool _rpn_ruleset_update(rpn_context & ctxt, const rpn_ruleset & ruleset, rpn_temporary * values) {
+
+    _rpn_snapshot snapshot(ctxt);
+    const rpn_temporary * temporaries = ctxt.temporaries;
+    size_t temporaries_size = ctxt.temporaries_size;
+    ctxt.temporaries = values;
+    ctxt.temporaries_size = ruleset.temporaries.size();
+
+    rpn_errors error = RPN_ERROR_OK;
+    size_t depth = ctxt.stack.size();
+    for (size_t i=0; i<ruleset.temporaries.size(); i++) {
+        const rpn_ruleset::rule & temporary = ruleset.temporaries[i];
+        bool result = _rpn_run(ctxt, ruleset.arena.data() + temporary.program, ruleset.bindings.data() + temporary.bindings);
+        values[i].value = (result && (ctxt.stack.size() > depth)) ? ctxt.stack.back() : 0;
+        values[i].error = rpn_error;
+        if (!result && (RPN_ERROR_OK == error)) error = rpn_error;
+        if (ctxt.stack.size() > depth) ctxt.stack.resize(depth);
+    }
+
+    ctxt.temporaries = temporaries;
+    ctxt.temporaries_size = temporaries_size;
+    rpn_error = error;
+    return (RPN_ERROR_OK == rpn_error);
+
+}
+
+// Computes the temporaries into the context, at the pinned snapshot
+bool _rpn_ruleset_refresh(rpn_context & ctxt, const rpn_ruleset & ruleset) {
+    size_t capacity = ctxt.values.capacity();
+    if (!ctxt.values.resize(ruleset.temporaries.size())) {
+        ctxt.values_ruleset = 0;
+        rpn_error = RPN_ERROR_OUT_OF_MEMORY;
+        return false;
+    }
+    if (ctxt.values.capacity() != capacity) _rpn_memory_update(ctxt);
+    ctxt.values_ruleset = ruleset.id;
+    ctxt.values_snapshot = ctxt.snapshot;
+    return _rpn_ruleset_update(ctxt, ruleset, ctxt.values.data());
+}
+
+// Once per tick, before executing the rules. The temporaries are kept by
+// the context (for one rule set at a time), see rpn_ruleset_execute.
+bool rpn_ruleset_update(rpn_context & ctxt, const rpn_ruleset & ruleset) {
+    _rpn_snapshot snapshot(ctxt);
+    return _rpn_ruleset_refresh(ctxt, ruleset);
+}
@@ -0,0 +1,362 @@
+/*
+
+RPNlib
+
+Copyright (C) 2018-2019 by Xose Pérez <xose dot perez at gmail dot com>
+
+The rpnlib library is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+The rpnlib library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with the rpnlib library.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "rpnlib.h"
+#include "rpnlib_internal.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+// ----------------------------------------------------------------------------
+// Hash table storage
+// ----------------------------------------------------------------------------
+//
+// Tables are allocated together with their header. Old tables are chained
+// behind the current one, they are only released once nothing can be
+// reading them anymore, that is when the owner clears the table.
+
+void rpn_table::attach(std::atomic<unsigned int> * storage, size_t size) {
+    _release();
+    _fixed = {nullptr, size, storage};
+    for (size_t i=0; i<size; i++) storage[i].store(0, std::memory_order_relaxed);
+    _current.store(&_fixed, std::memory_order_release);
+}
+
+void rpn_table::set_allocator(rpn_allocator * allocator) {
+    _release();
+    _allocator = allocator;
+}
+
+std::atomic<unsigned int> * rpn_table::create(size_t size) {
+    if (fixed()) return nullptr;
+    size_t bytes = sizeof(_block) + size * sizeof(unsigned int);
+    _block * block = (_block *) (_allocator ? _allocator->allocate(bytes, alignof(_block)) : malloc(bytes));
+    if (!block) return nullptr;
+    block->retired = nullptr;
+    block->size = size;
+    block->slots = (std::atomic<unsigned int> *) (block + 1);
+    for (size_t i=0; i<size; i++) block->slots[i].store(0, std::memory_order_relaxed);
+    return block->slots;
+}
+
+void rpn_table::publish(std::atomic<unsigned int> * slots) {
+    _block * block = ((_block *) slots) - 1;
+    block->retired = _current.load(std::memory_order_relaxed);
+    _current.store(block, std::memory_order_release);
+}
+
+void rpn_table::clear() {
+    _block * current = _current.load(std::memory_order_relaxed);
+    if (!current) return;
+    while (_block * block = current->retired) {
+        current->retired = block->retired;
+        _free(block);
+    }
+    for (size_t i=0; i<current->size; i++) current->slots[i].store(0, std::memory_order_relaxed);
+}
+
+size_t rpn_table::size() const {
+    _block * block = _current.load(std::memory_order_relaxed);
+    return block ? block->size : 0;
+}
+
+size_t rpn_table::bytes() const {
+    size_t bytes = 0;
+    for (_block * block = _current.load(std::memory_order_relaxed); block; block = block->retired) {
+        bytes += block->size * sizeof(unsigned int);
+        if (block != &_fixed) bytes += sizeof(_block);
+    }
+    return bytes;
+}
+
+void rpn_table::_free(_block * block) {
+    if (block == &_fixed) return;
+    if (_allocator) {
+        _allocator->deallocate(block, sizeof(_block) + block->size * sizeof(unsigned int), alignof(_block));
+    } else {
+        free(block);
+    }
+}
+
+void rpn_table::_release() {
+    _block * block = _current.exchange(nullptr, std::memory_order_relaxed);
+    while (block) {
+        _block * retired = block->retired;
+        _free(block);
+        block = retired;
+    }
+    _fixed = {nullptr, 0, nullptr};
+}
+
+// ----------------------------------------------------------------------------
+// Symbol table
+// ----------------------------------------------------------------------------
+//
+// Operator and variable names are stored once per context, packed into
+// chunks of RPNLIB_ARENA_CHUNK_SIZE bytes, and identified by the position
+// they were interned at. Names are never released one by one, only all at
+// once, so the heap only ever sees a few chunk sized blocks.
+//
+// Lookups go through an open addressing hash table of symbol id + 1
+// (0 marks an empty slot), kept at most 3/4 full.
+//
+// Static contexts provide the first chunk and the tables themselves and
+// forbid any further chunk, interning fails once those are full.
+//
+// Forks look names up in their parent first, their own names get ids
+// from RPN_SYMBOL_DEPTH above the parent ones so ids stay unique along the
+// chain, even when the parent keeps adding names.
+//
+// Lookups can run while another thread interns a name (writers hold the
+// context writer lock). Rolling back and clearing cannot.
+
+unsigned int _rpn_symbol_hash(const char * name, unsigned int length) {
+    unsigned int hash = 2166136261U;
+    for (unsigned int i=0; i<length; i++) {
+        hash = (hash ^ (unsigned char) name[i]) * 16777619U;
+    }
+    return hash;
+}
+
+// Chunks come from the same allocator as the chunks list itself
+void _rpn_symbols_free(rpn_symbols & symbols, const rpn_symbols::chunk & chunk) {
+    rpn_allocator * allocator = symbols.chunks.get_allocator();
+    if (allocator) {
+        allocator->deallocate(chunk.data, chunk.size, 1);
+    } else {
+        free(chunk.data);
+    }
+}
+
+// Contexts going away without rpn_clear, the first chunk is not ours
+rpn_symbols::~rpn_symbols() {
+    for (auto & chunk : chunks) {
+        _rpn_symbols_free(*this, chunk);
+    }
+}
+
+char * _rpn_symbols_chunk(rpn_symbols & symbols, unsigned int size) {
+    rpn_allocator * allocator = symbols.chunks.get_allocator();
+    rpn_symbols::chunk chunk = {nullptr, size};
+    chunk.data = (char *) (allocator ? allocator->allocate(size, 1) : malloc(size));
+    if (chunk.data && !symbols.chunks.push_back(chunk)) {
+        _rpn_symbols_free(symbols, chunk);
+        chunk.data = nullptr;
+    }
+    return chunk.data;
+}
+
+char * _rpn_symbols_alloc(rpn_symbols & symbols, unsigned int size) {
+
+    if ((size > symbols.left) && symbols.chunks.fixed()) return nullptr;
+
+    // Long names get a chunk of their own, the current one is kept
+    if (size > RPNLIB_ARENA_CHUNK_SIZE) {
+        return _rpn_symbols_chunk(symbols, size);
+    }
+
+    if (size > symbols.left) {
+        char * chunk = _rpn_symbols_chunk(symbols, RPNLIB_ARENA_CHUNK_SIZE);
+        if (!chunk) return nullptr;
+        symbols.next = chunk;
+        symbols.left = RPNLIB_ARENA_CHUNK_SIZE;
+    }
+
+    char * ptr = symbols.next;
+    symbols.next += size;
+    symbols.left -= size;
+    return ptr;
+
+}
+
+// Entries are published after what they point to, so readers probing
+// at the same time either miss them or see the whole thing
+void _rpn_table_insert(std::atomic<unsigned int> * slots, unsigned int mask, unsigned int hash, unsigned int entry) {
+    unsigned int slot = hash & mask;
+    while (0 != slots[slot].load(std::memory_order_relaxed)) {
+        slot = (slot + 1) & mask;
+    }
+    slots[slot].store(entry, std::memory_order_release);
+}
+
+void _rpn_symbols_insert(rpn_symbols & symbols, std::atomic<unsigned int> * slots, unsigned int mask, unsigned int id) {
+    const char * name = symbols.names[id];
+    _rpn_table_insert(slots, mask, _rpn_symbol_hash(name, strlen(name)), id + 1);
+}
+
+// Only safe while nothing else is reading the table
+void _rpn_symbols_erase(rpn_symbols & symbols, unsigned int id) {
+    const char * name = symbols.names[id];
+    _rpn_table_erase(symbols.table, id + 1, _rpn_symbol_hash(name, strlen(name)), [&symbols](unsigned int entry) {
+        const char * other = symbols.names[entry - 1];
+        return _rpn_symbol_hash(other, strlen(other));
+    });
+}
+
+// The bigger table is filled before readers can see it
+bool _rpn_symbols_grow(rpn_symbols & symbols, unsigned int size) {
+    std::atomic<unsigned int> * slots = symbols.table.create(size);
+    if (!slots) return false;
+    for (unsigned int id=0; id<symbols.names.size(); id++) {
+        _rpn_symbols_insert(symbols, slots, size - 1, id);
+    }
+    symbols.table.publish(slots);
+    return true;
+}
+
+// Refills the current table in place, only safe while nothing else is reading it
+void _rpn_symbols_rehash(rpn_symbols & symbols) {
+    unsigned int mask = 0;
+    symbols.table.clear();
+    std::atomic<unsigned int> * slots = symbols.table.slots(mask);
+    if (!slots) return;
+    for (unsigned int id=0; id<symbols.names.size(); id++) {
+        _rpn_symbols_insert(symbols, slots, mask, id);
+    }
+}
+
+// Grows the table (once) so that many more names fit in without growing it again
+bool _rpn_symbols_reserve(rpn_context & ctxt, unsigned int extra) {
+    rpn_symbols & symbols = ctxt.symbols;
+    unsigned int names = symbols.names.size();
+    if (4 * (names + extra) <= 3 * symbols.table.size()) return true;
+    unsigned int size = symbols.table.empty() ? 16 : 2 * symbols.table.size();
+    while (4 * (names + extra) > 3 * size) size *= 2;
+    return _rpn_symbols_grow(symbols, size);
+}
+
+unsigned int _rpn_symbol_find(rpn_context & ctxt, const char * name, unsigned int length) {
+    if (ctxt.parent) {
+        unsigned int id = _rpn_symbol_find(*ctxt.parent, name, length);
+        if (RPN_SYMBOL_NONE != id) return id;
+    }
+    rpn_symbols & symbols = ctxt.symbols;
+    unsigned int mask = 0;
+    std::atomic<unsigned int> * slots = symbols.table.slots(mask);
+    if (!slots) return RPN_SYMBOL_NONE;
+    unsigned int slot = _rpn_symbol_hash(name, length) & mask;
+    while (unsigned int entry = slots[slot].load(std::memory_order_acquire)) {
+        const char * candidate = symbols.names[entry - 1];
+        if ((strncmp(candidate, name, length) == 0) && (0 == candidate[length])) {
+            return symbols.base + entry - 1;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return RPN_SYMBOL_NONE;
+}
+
+unsigned int _rpn_symbol_intern(rpn_context & ctxt, const char * name, unsigned int length) {
+
+    unsigned int id = _rpn_symbol_find(ctxt, name, length);
+    if (RPN_SYMBOL_NONE != id) return id;
+
+    // Make room first, a fixed table can still take names
+    // while it has empty slots
+    rpn_symbols & symbols = ctxt.symbols;
+    id = symbols.names.size();
+    if (id + 1 >= RPN_SYMBOL_DEPTH) return RPN_SYMBOL_NONE;
+    if (4 * (id + 1) > 3 * symbols.table.size()) {
+        unsigned int size = symbols.table.empty() ? 16 : 2 * symbols.table.size();
+        if (!_rpn_symbols_grow(symbols, size) && (id + 1 >= symbols.table.size())) {
+            return RPN_SYMBOL_NONE;
+        }
+    }
+    if (symbols.names.full()) return RPN_SYMBOL_NONE;
+
+    char * copy = _rpn_symbols_alloc(symbols, length + 1);
+    if (!copy) return RPN_SYMBOL_NONE;
+    memcpy(copy, name, length);
+    copy[length] = 0;
+
+    if (!symbols.names.push_back(copy)) return RPN_SYMBOL_NONE;
+    unsigned int mask = 0;
+    std::atomic<unsigned int> * slots = symbols.table.slots(mask);
+    _rpn_symbols_insert(symbols, slots, mask, id);
+
+    return symbols.base + id;
+
+}
+
+char * _rpn_symbol_name(rpn_context & ctxt, unsigned int id) {
+    if (id < ctxt.symbols.base) return _rpn_symbol_name(*ctxt.parent, id);
+    return ctxt.symbols.names[id - ctxt.symbols.base];
+}
+
+void _rpn_symbols_clear(rpn_context & ctxt) {
+    rpn_symbols & symbols = ctxt.symbols;
+    for (auto & chunk : symbols.chunks) {
+        _rpn_symbols_free(symbols, chunk);
+    }
+    symbols.chunks.clear();
+    symbols.next = symbols.initial;
+    symbols.left = symbols.initial_size;
+    symbols.names.clear();
+    symbols.table.clear();
+    symbols.checkpoint = {0, 0, symbols.next, symbols.left};
+    _rpn_memory_recount(ctxt);
+}
+
+void _rpn_symbols_checkpoint(rpn_context & ctxt) {
+    rpn_symbols & symbols = ctxt.symbols;
+    symbols.checkpoint = {
+        (unsigned int) symbols.names.size(), (unsigned int) symbols.chunks.size(),
+        symbols.next, symbols.left
+    };
+}
+
+// Drops the names interned since the checkpoint, unless something
+// still uses them. Capacity is kept, chunks added since are released.
+bool _rpn_symbols_rollback(rpn_context & ctxt) {
+
+    rpn_symbols & symbols = ctxt.symbols;
+    unsigned int names = symbols.checkpoint.names;
+    if (symbols.names.size() <= names) return true;
+    for (auto & f : ctxt.operators) {
+        if (f.symbol >= symbols.base + names) return false;
+    }
+    for (auto & word : ctxt.words) {
+        if (word.symbol >= symbols.base + names) return false;
+    }
+    for (size_t index = 0; index < ctxt.variables.size(); index++) {
+        if (ctxt.variables[index].symbol >= symbols.base + names) return false;
+    }
+
+    // Just a few names are taken out of the table one by one
+    if (4 * (symbols.names.size() - names) > symbols.table.size()) {
+        symbols.names.truncate(names);
+        _rpn_symbols_rehash(symbols);
+    } else {
+        for (unsigned int id = symbols.names.size(); id > names; id--) {
+            _rpn_symbols_erase(symbols, id - 1);
+        }
+        symbols.names.truncate(names);
+    }
+
+    while (symbols.chunks.size() > symbols.checkpoint.chunks) {
+        _rpn_symbols_free(symbols, symbols.chunks.back());
+        symbols.chunks.pop_back();
+    }
+    symbols.next = symbols.checkpoint.next;
+    symbols.left = symbols.checkpoint.left;
+    _rpn_memory_recount(ctxt);
+    return true;
+
+}
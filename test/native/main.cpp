@@ -0,0 +1,2379 @@
+/*
+
+RPNlib
+
+Native Unit Tests
+
+Copyright (C) 2018-2019 by Xose Pérez <xose dot perez at gmail dot com>
+
+The rpnlib library is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+The rpnlib library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with the rpnlib library.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "rpnlib.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+
+// -----------------------------------------------------------------------------
+// Minimal Unity-like assertions so tests read like the PlatformIO ones
+// -----------------------------------------------------------------------------
+
+static unsigned int _tests_run = 0;
+static unsigned int _tests_failed = 0;
+static bool _test_failed = false;
+
+#define TEST_FAIL_AT(msg) do { \
+    printf("%s:%d: %s\n", __FILE__, __LINE__, msg); \
+    _test_failed = true; \
+    return; \
+} while (0)
+
+#define TEST_ASSERT_TRUE(x) do { if (!(x)) TEST_FAIL_AT("expected true: " #x); } while (0)
+#define TEST_ASSERT_FALSE(x) do { if (x) TEST_FAIL_AT("expected false: " #x); } while (0)
+#define TEST_ASSERT_EQUAL(e, a) do { if ((e) != (a)) TEST_FAIL_AT("expected " #e " == " #a); } while (0)
+#define TEST_ASSERT_EQUAL_FLOAT(e, a) do { if (fabs((e) - (a)) > 0.0001) TEST_FAIL_AT("expected " #e " ~= " #a); } while (0)
+
+#define RUN_TEST(fn) do { \
+    _test_failed = false; \
+    fn(); \
+    _tests_run++; \
+    if (_test_failed) _tests_failed++; \
+    printf("%s:%s\n", #fn, _test_failed ? "FAIL" : "PASS"); \
+} while (0)
+
+// -----------------------------------------------------------------------------
+// Heap calls counter (glibc only, sanitizers bring their own allocator)
+// -----------------------------------------------------------------------------
+
+static unsigned long _heap_calls = 0;
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+
+#define TEST_HEAP_CALLS
+
+extern "C" {
+
+void * __libc_malloc(size_t);
+void * __libc_calloc(size_t, size_t);
+void * __libc_realloc(void *, size_t);
+void __libc_free(void *);
+
+void * malloc(size_t size) {
+    _heap_calls++;
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t count, size_t size) {
+    _heap_calls++;
+    return __libc_calloc(count, size);
+}
+
+void * realloc(void * ptr, size_t size) {
+    _heap_calls++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void * ptr) {
+    if (ptr) _heap_calls++;
+    __libc_free(ptr);
+}
+
+}
+
+#endif
+
+// -----------------------------------------------------------------------------
+// Helper methods
+// -----------------------------------------------------------------------------
+
+void run_and_compare(const char * command, unsigned char depth, float * expected) {
+
+    float value;
+    rpn_context ctxt;
+
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, command));
+    TEST_ASSERT_EQUAL(RPN_ERROR_OK, rpn_error);
+
+    TEST_ASSERT_EQUAL(depth, rpn_stack_size(ctxt));
+    for (unsigned char i=0; i<depth; i++) {
+        TEST_ASSERT_TRUE(rpn_stack_get(ctxt, i, value));
+        TEST_ASSERT_EQUAL_FLOAT(expected[i], value);
+    }
+
+    rpn_clear(ctxt);
+
+}
+
+void run_and_error(const char * command, unsigned char error_code) {
+
+    rpn_context ctxt;
+
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    TEST_ASSERT_FALSE(rpn_process(ctxt, command));
+    TEST_ASSERT_EQUAL(error_code, rpn_error);
+
+    rpn_clear(ctxt);
+
+}
+
+// -----------------------------------------------------------------------------
+// Tests
+// -----------------------------------------------------------------------------
+
+void test_math(void) {
+    float expected[] = {3};
+    run_and_compare("5 2 * 3 + 5 mod", sizeof(expected)/sizeof(float), expected);
+}
+
+void test_math_advanced(void) {
+    float expected[] = {1};
+    run_and_compare("10 2 pow sqrt log10", sizeof(expected)/sizeof(float), expected);
+}
+
+void test_trig(void) {
+    float expected[] = {1};
+    run_and_compare("pi 4 / cos 2 sqrt *", sizeof(expected)/sizeof(float), expected);
+}
+
+void test_cast(void) {
+    float expected[] = {2, 1, 3.1416, 3.14};
+    run_and_compare("pi 2 round pi 4 round 1.1 floor 1.1 ceil", sizeof(expected)/sizeof(float), expected);
+}
+
+void test_map(void) {
+    float expected[] = {25};
+    run_and_compare("256 0 1024 0 100 map", sizeof(expected)/sizeof(float), expected);
+}
+
+void test_index(void) {
+    float expected[] = {30};
+    run_and_compare("2 10 20 30 40 50 5 index", sizeof(expected)/sizeof(float), expected);
+}
+
+void test_cmp3_below(void) {
+    float expected[] = {-1};
+    run_and_compare("13 18 24 cmp3", sizeof(expected)/sizeof(float), expected);
+}
+
+void test_cmp3_between(void) {
+    float expected[] = {0};
+    run_and_compare("18 18 24 cmp3", sizeof(expected)/sizeof(float), expected);
+}
+
+void test_cmp3_above(void) {
+    float expected[] = {1};
+    run_and_compare("25 18 24 cmp3", sizeof(expected)/sizeof(float), expected);
+}
+
+void test_conditional(void) {
+    float expected[] = {2};
+    run_and_compare("1 2 3 ifn", sizeof(expected)/sizeof(float), expected);
+}
+
+void test_stack(void) {
+    float expected[] = {6};
+    run_and_compare("1 3 dup unrot swap - *", sizeof(expected)/sizeof(float), expected);
+}
+
+void test_stack_bulk(void) {
+
+    rpn_context ctxt;
+    float value;
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+
+    // Stacks are not limited to 255 values
+    std::vector<float> values(1000);
+    for (size_t i=0; i<values.size(); i++) values[i] = i;
+    TEST_ASSERT_TRUE(rpn_stack_push_many(ctxt, values.data(), values.size()));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "depth"));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(1000, value);
+    TEST_ASSERT_EQUAL(1000, rpn_stack_size(ctxt));
+    TEST_ASSERT_TRUE(rpn_stack_get(ctxt, 300, value));
+    TEST_ASSERT_EQUAL_FLOAT(699, value);
+    TEST_ASSERT_FALSE(rpn_stack_get(ctxt, 1000, value));
+
+    // The view is bottom first
+    rpn_stack_span view = rpn_stack_view(ctxt);
+    TEST_ASSERT_EQUAL(1000, view.size);
+    TEST_ASSERT_EQUAL_FLOAT(0, view[0]);
+    TEST_ASSERT_EQUAL_FLOAT(999, view[999]);
+    float sum = 0;
+    for (float v : view) sum += v;
+    TEST_ASSERT_EQUAL_FLOAT(499500, sum);
+
+    // Popping many gives back what was pushed
+    std::vector<float> popped(600);
+    TEST_ASSERT_TRUE(rpn_stack_pop_many(ctxt, popped.data(), popped.size()));
+    TEST_ASSERT_EQUAL_FLOAT(400, popped[0]);
+    TEST_ASSERT_EQUAL_FLOAT(999, popped[599]);
+    TEST_ASSERT_EQUAL(400, rpn_stack_size(ctxt));
+    TEST_ASSERT_FALSE(rpn_stack_pop_many(ctxt, popped.data(), 401));
+    TEST_ASSERT_EQUAL(400, rpn_stack_size(ctxt));
+    TEST_ASSERT_TRUE(rpn_stack_pop_many(ctxt, nullptr, 0));
+    TEST_ASSERT_EQUAL(400, rpn_stack_size(ctxt));
+
+    // And neither are the values index picks from
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+    TEST_ASSERT_TRUE(rpn_stack_push(ctxt, 250));
+    TEST_ASSERT_TRUE(rpn_stack_push_many(ctxt, values.data(), 300));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "300 index"));
+    TEST_ASSERT_EQUAL(1, rpn_stack_size(ctxt));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(250, value);
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+
+    // All or nothing on static contexts
+    rpn_static_context<8, 2, 64> fixed;
+    TEST_ASSERT_TRUE(rpn_stack_push_many(fixed, values.data(), 6));
+    TEST_ASSERT_FALSE(rpn_stack_push_many(fixed, values.data(), 3));
+    TEST_ASSERT_EQUAL(RPN_ERROR_OUT_OF_MEMORY, rpn_error);
+    TEST_ASSERT_EQUAL(6, rpn_stack_size(fixed));
+
+}
+
+void test_logic(void) {
+    float expected[] = {0, 1, 0, 1};
+    run_and_compare("1 1 eq 1 1 ne 2 1 gt 2 1 lt", sizeof(expected)/sizeof(float), expected);
+}
+
+void test_boolean(void) {
+    float expected[] = {0, 1, 1, 0};
+    run_and_compare("2 0 and 2 0 or 2 0 xor 1 not", sizeof(expected)/sizeof(float), expected);
+}
+
+void test_variable(void) {
+
+    float value;
+    rpn_context ctxt;
+
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "tmp", 25));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "$tmp 5 /"));
+    TEST_ASSERT_EQUAL(1, rpn_stack_size(ctxt));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(5, value);
+    TEST_ASSERT_EQUAL(1, rpn_variables_size(ctxt));
+    TEST_ASSERT_TRUE(rpn_variables_clear(ctxt));
+    TEST_ASSERT_EQUAL(0, rpn_variables_size(ctxt));
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+
+}
+
+void test_variable_must_exist(void) {
+
+    rpn_context ctxt;
+
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    TEST_ASSERT_FALSE(rpn_process(ctxt, "$tmp 5 /", true));
+    TEST_ASSERT_EQUAL(RPN_ERROR_UNKNOWN_TOKEN, rpn_error);
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+
+}
+
+void test_custom_operator(void) {
+
+    float value;
+    rpn_context ctxt;
+
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    TEST_ASSERT_TRUE(rpn_operator_set(ctxt, "cube", 1, [](rpn_context & ctxt) {
+        float a;
+        rpn_stack_pop(ctxt, a);
+        rpn_stack_push(ctxt, a*a*a);
+        return true;
+    }));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "3 cube"));
+    TEST_ASSERT_EQUAL(1, rpn_stack_size(ctxt));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(27, value);
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+
+}
+
+void test_error_divide_by_zero(void) {
+    run_and_error("5 0 /", RPN_ERROR_DIVIDE_BY_ZERO);
+}
+
+void test_error_argument_count_mismatch(void) {
+    run_and_error("1 +", RPN_ERROR_ARGUMENT_COUNT_MISMATCH);
+}
+
+void test_error_unknown_token(void) {
+    run_and_error("1 2 sum", RPN_ERROR_UNKNOWN_TOKEN);
+}
+
+void test_profile(void) {
+
+    const char * name;
+    unsigned long calls;
+    unsigned long long ns;
+    rpn_context ctxt;
+
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    TEST_ASSERT_TRUE(rpn_operator_set(ctxt, "cube", 1, [](rpn_context & ctxt) {
+        float a;
+        rpn_stack_pop(ctxt, a);
+        rpn_stack_push(ctxt, a*a*a);
+        return true;
+    }));
+    TEST_ASSERT_TRUE(rpn_profile(ctxt, true));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "1 2 + 3 + cube"));
+
+    size_t index = 0;
+    unsigned long sum = 0, cube = 0, total = 0;
+    while (rpn_profile_get(ctxt, index++, name, calls, ns)) {
+        if (strcmp(name, "+") == 0) sum = calls;
+        if (strcmp(name, "cube") == 0) cube = calls;
+        total += calls;
+    }
+    TEST_ASSERT_EQUAL(2, sum);
+    TEST_ASSERT_EQUAL(1, cube);
+    TEST_ASSERT_EQUAL(3, total);
+
+    TEST_ASSERT_TRUE(rpn_profile_reset(ctxt));
+    TEST_ASSERT_TRUE(rpn_profile(ctxt, false));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "1 2 +"));
+    index = 0;
+    total = 0;
+    while (rpn_profile_get(ctxt, index++, name, calls, ns)) {
+        total += calls;
+    }
+    TEST_ASSERT_EQUAL(0, total);
+
+    // Operators past the first 255 can be queried too
+    std::vector<std::string> names;
+    for (unsigned int i=0; i<300; i++) names.push_back("op" + std::to_string(i));
+    for (auto & operator_name : names) {
+        TEST_ASSERT_TRUE(rpn_operator_set(ctxt, operator_name.c_str(), 0, [](rpn_context & ctxt) {
+            return rpn_stack_push(ctxt, 1);
+        }));
+    }
+    TEST_ASSERT_TRUE(rpn_profile(ctxt, true));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "op299 op299"));
+    TEST_ASSERT_TRUE(rpn_profile_get(ctxt, ctxt.operators.size() - 1, name, calls, ns));
+    TEST_ASSERT_EQUAL(0, strcmp(name, "op299"));
+    TEST_ASSERT_EQUAL(2, calls);
+    TEST_ASSERT_FALSE(rpn_profile_get(ctxt, ctxt.operators.size(), name, calls, ns));
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+
+}
+
+void test_histogram(void) {
+
+    rpn_context ctxt;
+    rpn_histogram histogram;
+
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    TEST_ASSERT_EQUAL(0, rpn_histogram_calls(histogram));
+    TEST_ASSERT_EQUAL(0, rpn_histogram_percentile(histogram, 50));
+
+    for (unsigned int i=0; i<100; i++) {
+        TEST_ASSERT_TRUE(rpn_process(ctxt, "256 0 1024 0 100 map", histogram));
+        TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+    }
+    TEST_ASSERT_FALSE(rpn_process(ctxt, "1 +", histogram));
+
+    TEST_ASSERT_EQUAL(101, rpn_histogram_calls(histogram));
+    unsigned long long p50 = rpn_histogram_percentile(histogram, 50);
+    unsigned long long p90 = rpn_histogram_percentile(histogram, 90);
+    unsigned long long p99 = rpn_histogram_percentile(histogram, 99);
+    unsigned long long max = rpn_histogram_max(histogram);
+    TEST_ASSERT_TRUE(p50 > 0);
+    TEST_ASSERT_TRUE(p50 <= p90);
+    TEST_ASSERT_TRUE(p90 <= p99);
+    TEST_ASSERT_TRUE(p99 <= max);
+    TEST_ASSERT_EQUAL(max, rpn_histogram_percentile(histogram, 100));
+
+    TEST_ASSERT_TRUE(rpn_histogram_reset(histogram));
+    TEST_ASSERT_EQUAL(0, rpn_histogram_calls(histogram));
+    TEST_ASSERT_EQUAL(0, rpn_histogram_max(histogram));
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+
+}
+
+void test_program(void) {
+
+    const char * expressions[] = {
+        "5 2 * 3 + 5 mod",
+        "pi 2 round pi 4 round 1.1 floor 1.1 ceil",
+        "2 10 20 30 40 50 5 index",
+        "1 3 dup unrot swap - *",
+        "$tmp 5 / $tmp 2 * +",
+        "3 cube 1 1 eq",
+    };
+
+    rpn_context ctxt;
+    rpn_program program;
+    float expected, value;
+
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "tmp", 25));
+    TEST_ASSERT_TRUE(rpn_operator_set(ctxt, "cube", 1, [](rpn_context & ctxt) {
+        float a;
+        rpn_stack_pop(ctxt, a);
+        rpn_stack_push(ctxt, a*a*a);
+        return true;
+    }));
+
+    // Compiled programs give the same results as rpn_process
+    for (auto expression : expressions) {
+        TEST_ASSERT_TRUE(rpn_process(ctxt, expression));
+        size_t depth = rpn_stack_size(ctxt);
+        std::vector<float> stack;
+        while (rpn_stack_pop(ctxt, value)) stack.push_back(value);
+        TEST_ASSERT_TRUE(rpn_compile(ctxt, expression, program));
+        TEST_ASSERT_TRUE(rpn_execute(ctxt, program));
+        TEST_ASSERT_TRUE(rpn_execute(ctxt, program));
+        TEST_ASSERT_EQUAL(2 * depth, rpn_stack_size(ctxt));
+        for (size_t i=0; i<2*depth; i++) {
+            TEST_ASSERT_TRUE(rpn_stack_get(ctxt, i, value));
+            TEST_ASSERT_EQUAL_FLOAT(stack[i % depth], value);
+        }
+        TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+    }
+
+    // Errors
+    TEST_ASSERT_FALSE(rpn_compile(ctxt, "1 2 sum", program));
+    TEST_ASSERT_EQUAL(RPN_ERROR_UNKNOWN_TOKEN, rpn_error);
+    TEST_ASSERT_FALSE(rpn_execute(ctxt, program));
+    TEST_ASSERT_EQUAL(RPN_ERROR_INVALID_PROGRAM, rpn_error);
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "5 $zero /", program));
+    TEST_ASSERT_FALSE(rpn_execute(ctxt, program));
+    TEST_ASSERT_EQUAL(RPN_ERROR_DIVIDE_BY_ZERO, rpn_error);
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "5 $zero /", program, true));
+    TEST_ASSERT_FALSE(rpn_execute(ctxt, program));
+    TEST_ASSERT_EQUAL(RPN_ERROR_UNKNOWN_TOKEN, rpn_error);
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+
+    // Serialize and load into another context
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "$tmp 18 21 cmp3 1 + 1 $relay 0 3 index cube", program, true));
+    std::vector<unsigned char> bytes(rpn_program_size(program));
+    TEST_ASSERT_FALSE(rpn_program_serialize(program, bytes.data(), bytes.size() - 1));
+    TEST_ASSERT_TRUE(rpn_program_serialize(program, bytes.data(), bytes.size()));
+    TEST_ASSERT_TRUE(rpn_program_clear(program));
+
+    rpn_context other;
+    rpn_program loaded;
+    TEST_ASSERT_TRUE(rpn_init(other));
+    TEST_ASSERT_FALSE(rpn_program_load(other, loaded, bytes.data(), bytes.size()));
+    TEST_ASSERT_EQUAL(RPN_ERROR_UNKNOWN_TOKEN, rpn_error);
+    TEST_ASSERT_TRUE(rpn_operator_set(other, "cube", 1, [](rpn_context & ctxt) {
+        float a;
+        rpn_stack_pop(ctxt, a);
+        rpn_stack_push(ctxt, a*a*a);
+        return true;
+    }));
+    TEST_ASSERT_TRUE(rpn_program_load(other, loaded, bytes.data(), bytes.size()));
+    TEST_ASSERT_TRUE(rpn_variable_set(other, "tmp", 17));
+    TEST_ASSERT_TRUE(rpn_variable_set(other, "relay", 0));
+    TEST_ASSERT_TRUE(rpn_execute(other, loaded));
+    TEST_ASSERT_EQUAL(1, rpn_stack_size(other));
+    TEST_ASSERT_TRUE(rpn_stack_pop(other, value));
+    expected = 1;
+    TEST_ASSERT_EQUAL_FLOAT(expected, value);
+
+    // Corrupted or truncated programs are rejected
+    TEST_ASSERT_FALSE(rpn_program_load(other, loaded, bytes.data(), bytes.size() - 1));
+    TEST_ASSERT_EQUAL(RPN_ERROR_INVALID_PROGRAM, rpn_error);
+    unsigned int code = bytes.size() - 12 * 3;
+    for (unsigned int i=0; i<bytes.size(); i++) {
+        std::vector<unsigned char> corrupted(bytes);
+        corrupted[i] ^= 0xFF;
+        bool header = (i < 20);
+        bool opcode = (i >= code) && (0 == (i - code) % 3);
+        if (header || opcode) {
+            TEST_ASSERT_FALSE(rpn_program_load(other, loaded, corrupted.data(), corrupted.size()));
+        }
+    }
+
+    TEST_ASSERT_TRUE(rpn_clear(other));
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+
+}
+
+void test_budget(void) {
+
+    rpn_context ctxt;
+    rpn_program program, other;
+    float value;
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "1 2 + 3 * 4 5 + *", program));
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "7 dup *", other));
+
+    // Nine instructions, three at a time
+    unsigned int calls = 1;
+    while (!rpn_execute_budget(ctxt, program, 3)) {
+        TEST_ASSERT_EQUAL(RPN_ERROR_NOT_FINISHED, rpn_error);
+        calls++;
+    }
+    TEST_ASSERT_EQUAL(3, calls);
+    TEST_ASSERT_EQUAL(1, rpn_stack_size(ctxt));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(81, value);
+
+    // Another program starts over, as does a reset
+    TEST_ASSERT_FALSE(rpn_execute_budget(ctxt, program, 4));
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+    TEST_ASSERT_TRUE(rpn_execute_budget(ctxt, other, 10));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(49, value);
+    TEST_ASSERT_FALSE(rpn_execute_budget(ctxt, program, 4));
+    TEST_ASSERT_TRUE(rpn_reset(ctxt));
+    TEST_ASSERT_TRUE(rpn_execute_budget(ctxt, program, 0));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(81, value);
+
+    // So does another program compiled into the same buffer
+    TEST_ASSERT_FALSE(rpn_execute_budget(ctxt, program, 4));
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+    const unsigned char * buffer = program.storage.data();
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "7 dup *", program));
+    TEST_ASSERT_TRUE(buffer == program.storage.data());
+    TEST_ASSERT_TRUE(rpn_execute_budget(ctxt, program, 10));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(49, value);
+
+    // Even with the same size and header
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "1 2 + 10 *", program));
+    TEST_ASSERT_FALSE(rpn_execute_budget(ctxt, program, 2));
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "5 6 + 10 *", program));
+    TEST_ASSERT_TRUE(rpn_execute_budget(ctxt, program, 0));
+    TEST_ASSERT_EQUAL(1, rpn_stack_size(ctxt));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(110, value);
+
+    // What the dropped program left on the stack goes with it
+    TEST_ASSERT_TRUE(rpn_stack_push(ctxt, 42));
+    TEST_ASSERT_FALSE(rpn_execute_budget(ctxt, program, 2));
+    TEST_ASSERT_EQUAL(3, rpn_stack_size(ctxt));
+    TEST_ASSERT_TRUE(rpn_execute_budget(ctxt, other, 0));
+    TEST_ASSERT_EQUAL(2, rpn_stack_size(ctxt));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(49, value);
+    TEST_ASSERT_FALSE(rpn_execute_budget(ctxt, program, 2));
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "5 6 + 10 *", program));
+    TEST_ASSERT_EQUAL(1, rpn_stack_size(ctxt));
+    TEST_ASSERT_FALSE(rpn_execute_budget(ctxt, program, 2));
+    TEST_ASSERT_TRUE(rpn_execute_reset(ctxt));
+    TEST_ASSERT_EQUAL(1, rpn_stack_size(ctxt));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(42, value);
+
+    // Slow operators run to the end, but the next instruction waits
+    TEST_ASSERT_TRUE(rpn_operator_set(ctxt, "slow", 0, [](rpn_context & ctxt) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        return rpn_stack_push(ctxt, 1);
+    }));
+    rpn_program slow;
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "slow slow +", slow));
+    TEST_ASSERT_FALSE(rpn_execute_budget(ctxt, slow, 0, 1000));
+    TEST_ASSERT_EQUAL(1, rpn_stack_size(ctxt));
+    TEST_ASSERT_FALSE(rpn_execute_budget(ctxt, slow, 0, 1000));
+    TEST_ASSERT_TRUE(rpn_execute_budget(ctxt, slow, 0, 1000));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(2, value);
+
+    // Errors end it
+    rpn_program wrong;
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "1 0 / 2 3 +", wrong));
+    TEST_ASSERT_FALSE(rpn_execute_budget(ctxt, wrong, 2));
+    TEST_ASSERT_EQUAL(RPN_ERROR_NOT_FINISHED, rpn_error);
+    TEST_ASSERT_FALSE(rpn_execute_budget(ctxt, wrong, 2));
+    TEST_ASSERT_EQUAL(RPN_ERROR_DIVIDE_BY_ZERO, rpn_error);
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+    TEST_ASSERT_FALSE(rpn_execute_budget(ctxt, wrong, 2));
+    TEST_ASSERT_EQUAL(RPN_ERROR_NOT_FINISHED, rpn_error);
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+
+}
+
+void test_control_flow(void) {
+
+    rpn_context ctxt;
+    rpn_program program;
+    float value;
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+
+    // Same results interpreted and compiled
+    struct {
+        const char * expression;
+        float expected;
+    } cases[] = {
+        {"1 if 2 else 3 then", 2},
+        {"0 if 2 else 3 then", 3},
+        {"5 0 if 2 + then", 5},
+        {"5 1 if 2 + then", 7},
+        {"0 if 2 else 1 if 3 else 4 then then", 3},
+        {"0 4 do 2 + loop", 8},
+        {"1 0 do 2 * loop", 1},
+        {"0 3 do 3 do 1 + loop loop", 9},
+        {"0 4 do dup 3 lt if 1 + else 10 + then loop", 13},
+        {"0 if 2 do 1 if 5 drop then loop 6 else 7 then", 7},
+        {"0 do 0 if 1 else 2 then loop 3", 3},
+    };
+    for (auto & c : cases) {
+        TEST_ASSERT_TRUE(rpn_process(ctxt, c.expression));
+        TEST_ASSERT_EQUAL(1, rpn_stack_size(ctxt));
+        TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+        TEST_ASSERT_EQUAL_FLOAT(c.expected, value);
+        TEST_ASSERT_TRUE(rpn_compile(ctxt, c.expression, program));
+        TEST_ASSERT_TRUE(rpn_execute(ctxt, program));
+        TEST_ASSERT_EQUAL(1, rpn_stack_size(ctxt));
+        TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+        TEST_ASSERT_EQUAL_FLOAT(c.expected, value);
+    }
+
+    // Untaken branches are not evaluated
+    static unsigned int calls;
+    calls = 0;
+    TEST_ASSERT_TRUE(rpn_operator_set(ctxt, "count", 0, [](rpn_context & ctxt) {
+        calls++;
+        return rpn_stack_push(ctxt, 1);
+    }));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "0 if count else 2 then 1 if 3 else count then +"));
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "0 if count else 2 then 1 if 3 else count then +", program));
+    TEST_ASSERT_TRUE(rpn_execute(ctxt, program));
+    TEST_ASSERT_EQUAL(0, calls);
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "3 do count drop loop"));
+    TEST_ASSERT_EQUAL(3, calls);
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+
+    // Operators cannot take the name of a control flow word
+    size_t operators = ctxt.operators.size();
+    const char * reserved[] = {"if", "else", "then", "do", "loop", ":", ";"};
+    for (auto name : reserved) {
+        rpn_error = RPN_ERROR_OK;
+        TEST_ASSERT_FALSE(rpn_operator_set(ctxt, name, 0, [](rpn_context &) {
+            return true;
+        }));
+        TEST_ASSERT_EQUAL(RPN_ERROR_UNVALID_ARGUMENT, rpn_error);
+    }
+    TEST_ASSERT_EQUAL(operators, ctxt.operators.size());
+
+    // Blocks must be closed and arms must leave the same depth
+    const char * unbalanced[] = {"1 if 2", "1 if 2 else 3", "2 else 3 then", "then", "loop", "2 do 1",
+        "1 if 2 loop", "1 do 2 then", "1 if 2 3 else 4 then", "1 if 2 then", "1 2 if drop then"};
+    for (auto expression : unbalanced) {
+        TEST_ASSERT_FALSE(rpn_compile(ctxt, expression, program));
+        TEST_ASSERT_EQUAL(RPN_ERROR_UNBALANCED, rpn_error);
+    }
+    TEST_ASSERT_FALSE(rpn_process(ctxt, "0 if 2"));
+    TEST_ASSERT_EQUAL(RPN_ERROR_UNBALANCED, rpn_error);
+    TEST_ASSERT_FALSE(rpn_process(ctxt, "1 if 2 else 3"));
+    TEST_ASSERT_EQUAL(RPN_ERROR_UNBALANCED, rpn_error);
+    TEST_ASSERT_FALSE(rpn_process(ctxt, "then"));
+    TEST_ASSERT_EQUAL(RPN_ERROR_UNBALANCED, rpn_error);
+    TEST_ASSERT_FALSE(rpn_process(ctxt, "0 do 1"));
+    TEST_ASSERT_EQUAL(RPN_ERROR_UNBALANCED, rpn_error);
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+
+    // And closed in order, taken or not
+    const char * crossed[] = {"1 if 1 do 3 then loop", "1 do 1 if loop then", "0 if 1 do then loop then",
+        "0 do 1 if loop then loop", "1 if 2 else 3 else 4 then", "0 if 2 else 3 else 4 then"};
+    for (auto expression : crossed) {
+        TEST_ASSERT_FALSE(rpn_compile(ctxt, expression, program));
+        TEST_ASSERT_EQUAL(RPN_ERROR_UNBALANCED, rpn_error);
+        TEST_ASSERT_FALSE(rpn_process(ctxt, expression));
+        TEST_ASSERT_EQUAL(RPN_ERROR_UNBALANCED, rpn_error);
+        TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+    }
+    TEST_ASSERT_FALSE(rpn_process(ctxt, "if"));
+    TEST_ASSERT_EQUAL(RPN_ERROR_ARGUMENT_COUNT_MISMATCH, rpn_error);
+
+    // The interpreter keeps a bounded number of open blocks, taken or not
+    std::string deep;
+    for (unsigned int i=0; i<RPNLIB_BLOCK_DEPTH; i++) deep += "1 if ";
+    deep += "2";
+    for (unsigned int i=0; i<RPNLIB_BLOCK_DEPTH; i++) deep += " then";
+    TEST_ASSERT_TRUE(rpn_process(ctxt, deep.c_str()));
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+    TEST_ASSERT_FALSE(rpn_process(ctxt, ("1 if " + deep + " then").c_str()));
+    TEST_ASSERT_EQUAL(RPN_ERROR_OUT_OF_MEMORY, rpn_error);
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+    TEST_ASSERT_FALSE(rpn_process(ctxt, ("1 if 0 if " + deep + " then then").c_str()));
+    TEST_ASSERT_EQUAL(RPN_ERROR_OUT_OF_MEMORY, rpn_error);
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+
+    // Unless it depends on the values
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "1 2 3 2 index 1 if 4 then", program));
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "1 2 3 do dup loop 1 if 4 then", program));
+
+    // Or on custom operators that did not say what they leave
+    TEST_ASSERT_TRUE(rpn_operator_set(ctxt, "drop2", 2, [](rpn_context & ctxt) {
+        float values[2];
+        return rpn_stack_pop_many(ctxt, values, 2);
+    }));
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "1 if 1 2 drop2 then", program));
+    TEST_ASSERT_TRUE(rpn_operator_set(ctxt, "pop2", 2, [](rpn_context & ctxt) {
+        float values[2];
+        return rpn_stack_pop_many(ctxt, values, 2);
+    }, 0));
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "1 if 1 2 pop2 then", program));
+    TEST_ASSERT_FALSE(rpn_compile(ctxt, "1 if 1 2 3 pop2 then", program));
+    TEST_ASSERT_EQUAL(RPN_ERROR_UNBALANCED, rpn_error);
+
+    // Loops are bounded
+    TEST_ASSERT_FALSE(rpn_process(ctxt, "100000 do loop"));
+    TEST_ASSERT_EQUAL(RPN_ERROR_UNVALID_ARGUMENT, rpn_error);
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "$n do loop", program));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "n", 100000));
+    TEST_ASSERT_FALSE(rpn_execute(ctxt, program));
+    TEST_ASSERT_EQUAL(RPN_ERROR_UNVALID_ARGUMENT, rpn_error);
+    TEST_ASSERT_FALSE(rpn_compile(ctxt, "1 do 1 do 1 do 1 do 1 do loop loop loop loop loop", program));
+    TEST_ASSERT_EQUAL(RPN_ERROR_INVALID_PROGRAM, rpn_error);
+    TEST_ASSERT_FALSE(rpn_process(ctxt, "1 do 1 do 1 do 1 do 1 do loop loop loop loop loop"));
+    TEST_ASSERT_EQUAL(RPN_ERROR_OUT_OF_MEMORY, rpn_error);
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+
+    // Loops can be paused half way
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "0 10 do 10 do 1 + loop loop", program));
+    unsigned int slices = 1;
+    while (!rpn_execute_budget(ctxt, program, 7)) {
+        TEST_ASSERT_EQUAL(RPN_ERROR_NOT_FINISHED, rpn_error);
+        slices++;
+    }
+    TEST_ASSERT_TRUE(slices > 10);
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(100, value);
+
+    // Jumps are validated when loading
+    std::vector<unsigned char> bytes(rpn_program_size(program));
+    TEST_ASSERT_TRUE(rpn_program_serialize(program, bytes.data(), bytes.size()));
+    rpn_program loaded;
+    unsigned int code = bytes.size() - 9 * 3;
+    for (unsigned int i=code; i<bytes.size(); i+=3) {
+        if (bytes[i] < 0x04) continue;
+        std::vector<unsigned char> corrupted(bytes);
+        corrupted[i + 1] ^= 0x01;
+        TEST_ASSERT_FALSE(rpn_program_load(ctxt, loaded, corrupted.data(), corrupted.size()));
+        TEST_ASSERT_EQUAL(RPN_ERROR_INVALID_PROGRAM, rpn_error);
+    }
+    TEST_ASSERT_TRUE(rpn_program_load(ctxt, loaded, bytes.data(), bytes.size()));
+
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+
+}
+
+void test_words(void) {
+
+    rpn_context ctxt;
+    rpn_program program, other;
+    float value;
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+
+    // Defined from an expression, or with : name body ;
+    TEST_ASSERT_TRUE(rpn_process(ctxt, ": c2f 9 * 5 / 32 + ;"));
+    TEST_ASSERT_EQUAL(0, rpn_stack_size(ctxt));
+    TEST_ASSERT_TRUE(rpn_word_set(ctxt, "comfort", "18 21 cmp3 1 +"));
+    TEST_ASSERT_TRUE(rpn_word_set(ctxt, "positive", "dup 0 lt if drop 0 then"));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "100 c2f 20 comfort -5 positive"));
+    TEST_ASSERT_EQUAL(3, rpn_stack_size(ctxt));
+    TEST_ASSERT_TRUE(rpn_stack_get(ctxt, 2, value));
+    TEST_ASSERT_EQUAL_FLOAT(212, value);
+    TEST_ASSERT_TRUE(rpn_stack_get(ctxt, 1, value));
+    TEST_ASSERT_EQUAL_FLOAT(1, value);
+    TEST_ASSERT_TRUE(rpn_stack_get(ctxt, 0, value));
+    TEST_ASSERT_EQUAL_FLOAT(0, value);
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+
+    // Short words are inlined, the others called
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "$t c2f comfort", program));
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "$t positive", other));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "t", 25));
+    TEST_ASSERT_TRUE(rpn_execute(ctxt, program));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(2, value);
+    TEST_ASSERT_TRUE(rpn_execute(ctxt, other));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(25, value);
+
+    rpn_context remote;
+    rpn_program loaded;
+    TEST_ASSERT_TRUE(rpn_init(remote));
+    std::vector<unsigned char> bytes(rpn_program_size(program));
+    TEST_ASSERT_TRUE(rpn_program_serialize(program, bytes.data(), bytes.size()));
+    TEST_ASSERT_TRUE(rpn_program_load(remote, loaded, bytes.data(), bytes.size()));
+    bytes.resize(rpn_program_size(other));
+    TEST_ASSERT_TRUE(rpn_program_serialize(other, bytes.data(), bytes.size()));
+    TEST_ASSERT_FALSE(rpn_program_load(remote, loaded, bytes.data(), bytes.size()));
+    TEST_ASSERT_EQUAL(RPN_ERROR_UNKNOWN_TOKEN, rpn_error);
+    TEST_ASSERT_TRUE(rpn_word_set(remote, "positive", "dup 0 lt if drop 0 then"));
+    TEST_ASSERT_TRUE(rpn_program_load(remote, loaded, bytes.data(), bytes.size()));
+    TEST_ASSERT_TRUE(rpn_clear(remote));
+
+    // Redefining a word only invalidates the programs using it
+    TEST_ASSERT_TRUE(rpn_word_set(ctxt, "c2f", "1.8 * 32 +"));
+    TEST_ASSERT_FALSE(rpn_execute(ctxt, program));
+    TEST_ASSERT_EQUAL(RPN_ERROR_STALE_PROGRAM, rpn_error);
+    TEST_ASSERT_TRUE(rpn_execute(ctxt, other));
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "$t c2f comfort", program));
+    TEST_ASSERT_TRUE(rpn_execute(ctxt, program));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(2, value);
+
+    // Even when used through another word
+    TEST_ASSERT_TRUE(rpn_word_set(ctxt, "warm", "c2f 80 gt"));
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "$t warm", program));
+    TEST_ASSERT_TRUE(rpn_word_set(ctxt, "c2f", "9 * 5 / 32 +"));
+    TEST_ASSERT_FALSE(rpn_execute(ctxt, program));
+    TEST_ASSERT_EQUAL(RPN_ERROR_STALE_PROGRAM, rpn_error);
+    TEST_ASSERT_FALSE(rpn_process(ctxt, "25 warm"));
+    TEST_ASSERT_EQUAL(RPN_ERROR_STALE_PROGRAM, rpn_error);
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+
+    // Deleted words are gone
+    TEST_ASSERT_TRUE(rpn_word_del(ctxt, "positive"));
+    TEST_ASSERT_FALSE(rpn_word_del(ctxt, "positive"));
+    TEST_ASSERT_FALSE(rpn_execute(ctxt, other));
+    TEST_ASSERT_EQUAL(RPN_ERROR_STALE_PROGRAM, rpn_error);
+    TEST_ASSERT_FALSE(rpn_process(ctxt, "1 positive"));
+    TEST_ASSERT_EQUAL(RPN_ERROR_UNKNOWN_TOKEN, rpn_error);
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "25 c2f"));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(77, value);
+
+    // Words cannot use themselves, nor take names that mean something else
+    TEST_ASSERT_FALSE(rpn_word_set(ctxt, "c2f", "c2f 1 +"));
+    TEST_ASSERT_EQUAL(RPN_ERROR_UNKNOWN_TOKEN, rpn_error);
+    const char * names[] = {"", "12", "$t", "if", ";", "two words"};
+    for (auto name : names) {
+        TEST_ASSERT_FALSE(rpn_word_set(ctxt, name, "1"));
+        TEST_ASSERT_EQUAL(RPN_ERROR_UNVALID_ARGUMENT, rpn_error);
+    }
+    TEST_ASSERT_FALSE(rpn_process(ctxt, ": unfinished 1 2"));
+    TEST_ASSERT_EQUAL(RPN_ERROR_UNBALANCED, rpn_error);
+    TEST_ASSERT_FALSE(rpn_compile(ctxt, ": other 1 ;", program));
+    TEST_ASSERT_EQUAL(RPN_ERROR_UNKNOWN_TOKEN, rpn_error);
+
+    // The compiler knows how deep they leave the stack
+    TEST_ASSERT_TRUE(rpn_word_set(ctxt, "pair", "1 2"));
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "5 1 if c2f then", program));
+    TEST_ASSERT_FALSE(rpn_compile(ctxt, "1 if pair then", program));
+    TEST_ASSERT_EQUAL(RPN_ERROR_UNBALANCED, rpn_error);
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "1 if pair + drop then", program));
+
+    // Forks share them, but cannot define their own
+    rpn_context fork;
+    rpn_fork(ctxt, fork);
+    TEST_ASSERT_TRUE(rpn_process(fork, "25 c2f"));
+    TEST_ASSERT_TRUE(rpn_stack_pop(fork, value));
+    TEST_ASSERT_EQUAL_FLOAT(77, value);
+    TEST_ASSERT_FALSE(rpn_word_set(fork, "f2c", "32 - 5 * 9 /"));
+    TEST_ASSERT_EQUAL(RPN_ERROR_OUT_OF_MEMORY, rpn_error);
+    TEST_ASSERT_TRUE(rpn_clear(fork));
+
+    TEST_ASSERT_TRUE(rpn_words_clear(ctxt));
+    TEST_ASSERT_FALSE(rpn_process(ctxt, "25 c2f"));
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+
+    // Words without bindings are redefined and deleted the same way
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    TEST_ASSERT_TRUE(rpn_word_set(ctxt, "one", "1"));
+    TEST_ASSERT_TRUE(rpn_word_set(ctxt, "one", "2 1 -"));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "one"));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(1, value);
+    TEST_ASSERT_TRUE(rpn_word_del(ctxt, "one"));
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+
+}
+
+void test_ruleset(void) {
+
+    const char * text =
+        "# Heater\n"
+        "$temperature 18 21 cmp3 $relay +\n"
+        "\n"
+        "   \r\n"
+        "$temperature 0 50 0 1024 map\r\n"
+        "5 dup *";
+
+    rpn_context ctxt;
+    rpn_ruleset ruleset;
+    float value;
+
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "temperature", 25));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "relay", 0));
+    TEST_ASSERT_TRUE(rpn_ruleset_compile(ctxt, ruleset, text, strlen(text), true));
+    TEST_ASSERT_EQUAL(3, rpn_ruleset_size(ruleset));
+
+    float expected[] = {1, 512, 25};
+    for (size_t i=0; i<rpn_ruleset_size(ruleset); i++) {
+        TEST_ASSERT_TRUE(rpn_ruleset_execute(ctxt, ruleset, i));
+        TEST_ASSERT_EQUAL(1, rpn_stack_size(ctxt));
+        TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+        TEST_ASSERT_EQUAL_FLOAT(expected[i], value);
+    }
+    TEST_ASSERT_FALSE(rpn_ruleset_execute(ctxt, ruleset, 3));
+
+    // Errors report the line
+    const char * wrong = "1 2 +\n\n1 2 sum\n";
+    TEST_ASSERT_FALSE(rpn_ruleset_compile(ctxt, ruleset, wrong, strlen(wrong)));
+    TEST_ASSERT_EQUAL(RPN_ERROR_UNKNOWN_TOKEN, rpn_error);
+    TEST_ASSERT_EQUAL(3, ruleset.error_line);
+
+    // Loading from a file
+    char filename[] = "/tmp/rpnlib_rulesXXXXXX";
+    int fd = mkstemp(filename);
+    TEST_ASSERT_TRUE(fd >= 0);
+    ssize_t written = write(fd, text, strlen(text));
+    TEST_ASSERT_EQUAL((ssize_t) strlen(text), written);
+    close(fd);
+    TEST_ASSERT_TRUE(rpn_ruleset_load(ctxt, ruleset, filename, true));
+    unlink(filename);
+    TEST_ASSERT_EQUAL(3, rpn_ruleset_size(ruleset));
+    TEST_ASSERT_TRUE(rpn_ruleset_execute(ctxt, ruleset, 1));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(512, value);
+    rpn_error = RPN_ERROR_OK;
+    TEST_ASSERT_FALSE(rpn_ruleset_load(ctxt, ruleset, filename));
+    TEST_ASSERT_EQUAL(RPN_ERROR_FILE, rpn_error);
+
+    // Pipes are read instead
+    int ends[2];
+    TEST_ASSERT_EQUAL(0, pipe(ends));
+    written = write(ends[1], text, strlen(text));
+    TEST_ASSERT_EQUAL((ssize_t) strlen(text), written);
+    close(ends[1]);
+    char path[32];
+    snprintf(path, sizeof(path), "/dev/fd/%d", ends[0]);
+    TEST_ASSERT_TRUE(rpn_ruleset_load(ctxt, ruleset, path, true));
+    close(ends[0]);
+    TEST_ASSERT_EQUAL(3, rpn_ruleset_size(ruleset));
+    TEST_ASSERT_TRUE(rpn_ruleset_execute(ctxt, ruleset, 1));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(512, value);
+    TEST_ASSERT_FALSE(rpn_ruleset_load(ctxt, ruleset, "/tmp"));
+    TEST_ASSERT_EQUAL(RPN_ERROR_FILE, rpn_error);
+
+    TEST_ASSERT_TRUE(rpn_ruleset_clear(ruleset));
+    TEST_ASSERT_EQUAL(0, rpn_ruleset_size(ruleset));
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+
+}
+
+void test_ruleset_shared(void) {
+
+    const char * text =
+        "$temp 1.8 * 32 + 70 gt\n"
+        "$temp 1.8 * 32 + 60 lt\n"
+        "$a $b - abs 2 gt\n"
+        "$a $b - abs 1 +\n"
+        "$a $b -\n"
+        "$a 1 + 2 $a 1 + *\n"
+        "1 if $temp 1.8 * 32 + else 0 then\n"
+        "$a $b swap - abs\n"
+        "$a $c /\n"
+        "$a $c / 1 +\n"
+        "$temp c2f 50 gt";
+    const size_t count = 11;
+
+    rpn_context ctxt;
+    rpn_ruleset plain;
+    rpn_ruleset ruleset;
+
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    TEST_ASSERT_TRUE(rpn_word_set(ctxt, "c2f", "1.8 * 32 +"));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "temp", 25));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "a", 5));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "b", 8));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "c", 0));
+    TEST_ASSERT_TRUE(rpn_ruleset_compile(ctxt, plain, text, strlen(text), true));
+    TEST_ASSERT_TRUE(rpn_ruleset_compile(ctxt, ruleset, text, strlen(text), true));
+
+    // Fahrenheit, both differences, their absolute value, $a 1 + and the division
+    TEST_ASSERT_TRUE(rpn_ruleset_optimize(ctxt, ruleset));
+    TEST_ASSERT_EQUAL(5, ruleset.temporaries.size());
+    TEST_ASSERT_EQUAL(count, rpn_ruleset_size(ruleset));
+    TEST_ASSERT_TRUE(rpn_ruleset_optimize(ctxt, ruleset));
+    TEST_ASSERT_EQUAL(5, ruleset.temporaries.size());
+
+    // Computed by the rules themselves before the first update
+    TEST_ASSERT_TRUE(rpn_ruleset_execute(ctxt, ruleset, 0));
+    TEST_ASSERT_EQUAL_FLOAT(1, rpn_stack_view(ctxt)[0]);
+    TEST_ASSERT_TRUE(rpn_ruleset_execute(ctxt, ruleset, 6));
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+
+    // Without a pinned snapshot rules read the variables as of the update
+    TEST_ASSERT_FALSE(rpn_ruleset_update(ctxt, ruleset));
+    unsigned long updated = ctxt.values_snapshot;
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "temp", 10));
+    TEST_ASSERT_TRUE(rpn_ruleset_execute(ctxt, ruleset, 0));
+    TEST_ASSERT_EQUAL_FLOAT(1, rpn_stack_view(ctxt)[0]);
+    TEST_ASSERT_EQUAL(updated, ctxt.values_snapshot);
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+
+    // They are computed again for another snapshot
+    TEST_ASSERT_TRUE(rpn_snapshot_acquire(ctxt));
+    TEST_ASSERT_TRUE(rpn_ruleset_execute(ctxt, ruleset, 0));
+    TEST_ASSERT_EQUAL_FLOAT(0, rpn_stack_view(ctxt)[0]);
+    TEST_ASSERT_TRUE(updated != ctxt.values_snapshot);
+    updated = ctxt.values_snapshot;
+    TEST_ASSERT_TRUE(rpn_ruleset_execute(ctxt, ruleset, 1));
+    TEST_ASSERT_EQUAL(updated, ctxt.values_snapshot);
+    TEST_ASSERT_TRUE(rpn_snapshot_release(ctxt));
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+
+    // Or once the one they were computed at expired
+    for (unsigned int i=0; i<RPNLIB_VARIABLE_VERSIONS; i++) {
+        TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "temp", 25));
+    }
+    TEST_ASSERT_TRUE(rpn_ruleset_execute(ctxt, ruleset, 0));
+    TEST_ASSERT_EQUAL_FLOAT(0, rpn_stack_view(ctxt)[0]);
+    TEST_ASSERT_EQUAL(updated, ctxt.values_snapshot);
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+    TEST_ASSERT_TRUE(rpn_ruleset_execute(ctxt, ruleset, 6));
+    TEST_ASSERT_EQUAL_FLOAT(77, rpn_stack_view(ctxt)[0]);
+    TEST_ASSERT_TRUE(updated != ctxt.values_snapshot);
+    TEST_ASSERT_TRUE(rpn_ruleset_execute(ctxt, ruleset, 0));
+    TEST_ASSERT_EQUAL_FLOAT(1, rpn_stack_view(ctxt)[1]);
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+
+    // Each context keeps its own
+    rpn_context fork;
+    TEST_ASSERT_TRUE(rpn_fork(ctxt, fork));
+    TEST_ASSERT_TRUE(rpn_variable_set(fork, "temp", 10));
+    TEST_ASSERT_TRUE(rpn_ruleset_execute(fork, ruleset, 0));
+    TEST_ASSERT_EQUAL_FLOAT(0, rpn_stack_view(fork)[0]);
+    TEST_ASSERT_TRUE(rpn_ruleset_execute(ctxt, ruleset, 0));
+    TEST_ASSERT_EQUAL_FLOAT(1, rpn_stack_view(ctxt)[0]);
+    TEST_ASSERT_TRUE(rpn_clear(fork));
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+
+    // Same results and errors as the rules computing everything
+    float values[] = {25, 10};
+    for (auto value : values) {
+        TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "temp", value));
+        TEST_ASSERT_FALSE(rpn_ruleset_update(ctxt, ruleset));
+        TEST_ASSERT_EQUAL(RPN_ERROR_DIVIDE_BY_ZERO, rpn_error);
+        for (size_t i=0; i<count; i++) {
+            bool expected = rpn_ruleset_execute(ctxt, plain, i);
+            rpn_errors error = rpn_error;
+            rpn_stack_span view = rpn_stack_view(ctxt);
+            std::vector<float> stack(view.begin(), view.end());
+            TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+            TEST_ASSERT_EQUAL(expected, rpn_ruleset_execute(ctxt, ruleset, i));
+            TEST_ASSERT_EQUAL(error, rpn_error);
+            TEST_ASSERT_EQUAL(stack.size(), rpn_stack_size(ctxt));
+            for (size_t j=0; j<stack.size(); j++) {
+                TEST_ASSERT_EQUAL_FLOAT(stack[j], rpn_stack_view(ctxt)[j]);
+            }
+            TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+        }
+    }
+    TEST_ASSERT_TRUE(rpn_ruleset_execute(ctxt, ruleset, 1));
+    TEST_ASSERT_EQUAL_FLOAT(1, rpn_stack_view(ctxt)[0]);
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+
+    // Evaluated once by the executor, before the rules
+    rpn_executor executor;
+    std::vector<float> expected(count), results(count);
+    std::vector<rpn_errors> expected_errors(count), errors(count);
+    TEST_ASSERT_TRUE(rpn_executor_init(executor, ctxt, 2));
+    TEST_ASSERT_FALSE(rpn_executor_run(executor, plain, expected.data(), expected_errors.data()));
+    TEST_ASSERT_FALSE(rpn_executor_run(executor, ruleset, results.data(), errors.data()));
+    TEST_ASSERT_EQUAL(RPN_ERROR_DIVIDE_BY_ZERO, rpn_error);
+    for (size_t i=0; i<count; i++) {
+        TEST_ASSERT_EQUAL(expected_errors[i], errors[i]);
+        TEST_ASSERT_EQUAL_FLOAT(expected[i], results[i]);
+    }
+    TEST_ASSERT_TRUE(rpn_executor_clear(executor));
+
+    // Rules still depend on the words they were compiled with
+    TEST_ASSERT_TRUE(rpn_word_set(ctxt, "c2f", "1.8 * 30 +"));
+    TEST_ASSERT_FALSE(rpn_ruleset_execute(ctxt, ruleset, 10));
+    TEST_ASSERT_EQUAL(RPN_ERROR_STALE_PROGRAM, rpn_error);
+    TEST_ASSERT_TRUE(rpn_ruleset_execute(ctxt, ruleset, 0));
+
+    TEST_ASSERT_TRUE(rpn_ruleset_clear(ruleset));
+    TEST_ASSERT_EQUAL(0, ruleset.temporaries.size());
+    TEST_ASSERT_TRUE(rpn_ruleset_clear(plain));
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+
+}
+
+void test_symbols(void) {
+
+    rpn_context ctxt;
+    float value;
+    char name[16];
+
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    size_t builtins = ctxt.symbols.names.size();
+
+    // Names are interned once
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "tmp", 1));
+    char * interned = rpn_variable_name(ctxt, 0);
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "tmp", 2));
+    TEST_ASSERT_TRUE(rpn_variable_del(ctxt, "tmp"));
+    TEST_ASSERT_FALSE(rpn_variable_get(ctxt, "tmp", value));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "tmp", 3));
+    TEST_ASSERT_TRUE(interned == rpn_variable_name(ctxt, 0));
+    TEST_ASSERT_EQUAL(builtins + 1, ctxt.symbols.names.size());
+
+    // Enough names to grow the table and fill a few chunks
+    for (unsigned int i=0; i<200; i++) {
+        snprintf(name, sizeof(name), "var%u", i);
+        TEST_ASSERT_TRUE(rpn_variable_set(ctxt, name, i));
+    }
+    for (unsigned int i=0; i<200; i++) {
+        snprintf(name, sizeof(name), "var%u", i);
+        TEST_ASSERT_TRUE(rpn_variable_get(ctxt, name, value));
+        TEST_ASSERT_EQUAL_FLOAT(i, value);
+    }
+    TEST_ASSERT_FALSE(rpn_variable_get(ctxt, "var200", value));
+    TEST_ASSERT_FALSE(rpn_variable_get(ctxt, "var1 ", value));
+
+    // Names longer than a chunk
+    std::string longer(RPNLIB_ARENA_CHUNK_SIZE * 2, 'x');
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, longer.c_str(), 5));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, ("$" + longer + " $var199 +").c_str()));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(204, value);
+
+    // Operators and variables share the table, but not the namespace
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "dup", 7));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "$dup dup +"));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(14, value);
+
+    // Released in bulk, but only once nothing references them
+    TEST_ASSERT_TRUE(rpn_variables_clear(ctxt));
+    TEST_ASSERT_TRUE(ctxt.symbols.names.size() > builtins);
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "1 2 +"));
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+    TEST_ASSERT_EQUAL(0, ctxt.symbols.names.size());
+    TEST_ASSERT_EQUAL(0, ctxt.symbols.chunks.size());
+
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "2 3 *"));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(6, value);
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+
+    // Contexts going out of scope without rpn_clear release their names
+    // too, leak checkers (the sanitizer builds) would report them otherwise
+    {
+        rpn_context scoped;
+        TEST_ASSERT_TRUE(rpn_init(scoped));
+        TEST_ASSERT_TRUE(rpn_variable_set(scoped, "scoped", 1));
+        TEST_ASSERT_TRUE(scoped.symbols.chunks.size() > 0);
+    }
+
+}
+
+bool _test_static_nop(rpn_context &) {
+    return true;
+}
+
+void test_static_context(void) {
+
+    float value;
+    char name[16];
+    unsigned long heap_calls = _heap_calls;
+
+    {
+
+        rpn_static_context<8, 4, 64> ctxt;
+        TEST_ASSERT_TRUE(rpn_init(ctxt));
+        TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "temperature", 22.5));
+        TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "humidity", 70));
+        TEST_ASSERT_TRUE(rpn_process(ctxt, "$temperature 18 21 cmp3 $humidity 50 gt and"));
+        TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+        TEST_ASSERT_EQUAL_FLOAT(1, value);
+
+        TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+
+        // Stack capacity
+        TEST_ASSERT_FALSE(rpn_process(ctxt, "1 2 3 4 5 6 7 8 9"));
+        TEST_ASSERT_EQUAL(RPN_ERROR_OUT_OF_MEMORY, rpn_error);
+        TEST_ASSERT_EQUAL(8, rpn_stack_size(ctxt));
+        TEST_ASSERT_FALSE(rpn_process(ctxt, "dup"));
+        TEST_ASSERT_EQUAL(RPN_ERROR_OUT_OF_MEMORY, rpn_error);
+        TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+
+        // Variables capacity, existing ones can still be updated
+        TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "a", 1));
+        TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "b", 2));
+        TEST_ASSERT_FALSE(rpn_variable_set(ctxt, "c", 3));
+        TEST_ASSERT_EQUAL(RPN_ERROR_OUT_OF_MEMORY, rpn_error);
+        TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "a", 4));
+        TEST_ASSERT_TRUE(rpn_process(ctxt, "$a $b +"));
+        TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+        TEST_ASSERT_EQUAL_FLOAT(6, value);
+
+        // Operators capacity
+        unsigned int count = ctxt.operators.size();
+        for (unsigned int i=count; i<64; i++) {
+            snprintf(name, sizeof(name), "op%u", i);
+            TEST_ASSERT_TRUE(rpn_operator_set(ctxt, name, 0, _test_static_nop));
+        }
+        TEST_ASSERT_FALSE(rpn_operator_set(ctxt, "full", 0, _test_static_nop));
+        TEST_ASSERT_EQUAL(RPN_ERROR_OUT_OF_MEMORY, rpn_error);
+
+        // Profiling and reuse after clearing
+        TEST_ASSERT_TRUE(rpn_profile(ctxt, true));
+        TEST_ASSERT_TRUE(rpn_process(ctxt, "1 2 +"));
+        TEST_ASSERT_TRUE(rpn_clear(ctxt));
+        TEST_ASSERT_TRUE(rpn_init(ctxt));
+        TEST_ASSERT_TRUE(rpn_process(ctxt, "3 4 *"));
+        TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+        TEST_ASSERT_EQUAL_FLOAT(12, value);
+
+    }
+
+    #ifdef TEST_HEAP_CALLS
+    TEST_ASSERT_EQUAL(heap_calls, _heap_calls);
+    rpn_context ctxt;
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    TEST_ASSERT_TRUE(heap_calls < _heap_calls);
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+    #endif
+
+    // Control flow, word definitions and programs, once compiled
+    {
+
+        rpn_static_context<8, 4, 64> ctxt;
+        rpn_program program, budget;
+        TEST_ASSERT_TRUE(rpn_init(ctxt));
+        TEST_ASSERT_TRUE(rpn_compile(ctxt, "3 do 1 if 2 else 3 then loop + +", program));
+        TEST_ASSERT_TRUE(rpn_compile(ctxt, "1 2 + 10 *", budget));
+        heap_calls = _heap_calls;
+
+        TEST_ASSERT_TRUE(rpn_process(ctxt, "1 if 5 else 6 then 2 do dup loop + +"));
+        TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+        TEST_ASSERT_EQUAL_FLOAT(15, value);
+        TEST_ASSERT_TRUE(rpn_process(ctxt, "0 if 1 do 2 loop else 0 do 3 loop 7 then"));
+        TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+        TEST_ASSERT_EQUAL_FLOAT(7, value);
+        TEST_ASSERT_FALSE(rpn_process(ctxt, "1 if 2"));
+        TEST_ASSERT_EQUAL(RPN_ERROR_UNBALANCED, rpn_error);
+        TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+
+        // There is no room for words
+        TEST_ASSERT_FALSE(rpn_process(ctxt, ": sq dup * ;"));
+        TEST_ASSERT_EQUAL(RPN_ERROR_OUT_OF_MEMORY, rpn_error);
+
+        TEST_ASSERT_TRUE(rpn_execute(ctxt, program));
+        TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+        TEST_ASSERT_EQUAL_FLOAT(6, value);
+        TEST_ASSERT_FALSE(rpn_execute_budget(ctxt, budget, 2));
+        TEST_ASSERT_EQUAL(RPN_ERROR_NOT_FINISHED, rpn_error);
+        TEST_ASSERT_TRUE(rpn_execute_budget(ctxt, budget, 0));
+        TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+        TEST_ASSERT_EQUAL_FLOAT(30, value);
+
+        #ifdef TEST_HEAP_CALLS
+        TEST_ASSERT_EQUAL(heap_calls, _heap_calls);
+        #endif
+
+    }
+
+}
+
+class _test_counting_allocator : public rpn_allocator {
+    public:
+        void * allocate(size_t size, size_t) override {
+            live += size;
+            calls++;
+            return malloc(size);
+        }
+        void deallocate(void * ptr, size_t size, size_t) override {
+            live -= size;
+            free(ptr);
+        }
+        size_t live = 0;
+        unsigned long calls = 0;
+};
+
+void test_allocator(void) {
+
+    float value;
+    _test_counting_allocator counting;
+
+    {
+        rpn_context ctxt(counting);
+        TEST_ASSERT_TRUE(rpn_init(ctxt));
+        TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "temperature", 21));
+        TEST_ASSERT_TRUE(rpn_process(ctxt, "$temperature 2 *"));
+        TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+        TEST_ASSERT_EQUAL_FLOAT(42, value);
+        TEST_ASSERT_TRUE(counting.live > 0);
+        TEST_ASSERT_TRUE(rpn_clear(ctxt));
+    }
+    TEST_ASSERT_TRUE(counting.calls > 0);
+    TEST_ASSERT_EQUAL(0, counting.live);
+
+    // Everything from a single buffer
+    static unsigned char buffer[16384];
+    rpn_bump_allocator bump(buffer, sizeof(buffer));
+    unsigned long heap_calls = _heap_calls;
+    {
+        rpn_context ctxt(bump);
+        TEST_ASSERT_TRUE(rpn_init(ctxt));
+        TEST_ASSERT_TRUE(rpn_process(ctxt, "1 2 3 + *"));
+        TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+        TEST_ASSERT_EQUAL_FLOAT(5, value);
+        TEST_ASSERT_TRUE(bump.used() > 0);
+        TEST_ASSERT_TRUE(rpn_clear(ctxt));
+    }
+    TEST_ASSERT_EQUAL(heap_calls, _heap_calls);
+
+    // And failing cleanly when it runs out
+    rpn_bump_allocator small(buffer, 256);
+    {
+        rpn_context ctxt(small);
+        TEST_ASSERT_FALSE(rpn_init(ctxt));
+        TEST_ASSERT_EQUAL(RPN_ERROR_OUT_OF_MEMORY, rpn_error);
+        TEST_ASSERT_TRUE(rpn_clear(ctxt));
+    }
+
+}
+
+void test_memory(void) {
+
+    rpn_context ctxt;
+    rpn_memory memory;
+
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "temperature", 21));
+    TEST_ASSERT_TRUE(rpn_memory_get(ctxt, memory));
+    TEST_ASSERT_EQUAL(ctxt.operators.size(), memory.operators.size);
+    TEST_ASSERT_TRUE(memory.operators.capacity >= memory.operators.size);
+    TEST_ASSERT_TRUE(memory.operators.bytes >= memory.operators.capacity * sizeof(rpn_operator));
+    TEST_ASSERT_EQUAL(1, memory.variables.size);
+    TEST_ASSERT_EQUAL(ctxt.operators.size() + 1, memory.names.size);
+    TEST_ASSERT_TRUE(memory.names.bytes >= RPNLIB_ARENA_CHUNK_SIZE);
+    TEST_ASSERT_EQUAL(memory.stack.bytes + memory.variables.bytes + memory.operators.bytes + memory.names.bytes, memory.bytes);
+    TEST_ASSERT_EQUAL(memory.bytes, memory.peak);
+
+    // A script growing the stack
+    size_t before = memory.bytes;
+    for (unsigned int i=0; i<100; i++) {
+        TEST_ASSERT_TRUE(rpn_stack_push(ctxt, i));
+    }
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+    TEST_ASSERT_TRUE(rpn_memory_get(ctxt, memory));
+    TEST_ASSERT_EQUAL(0, memory.stack.size);
+    TEST_ASSERT_TRUE(memory.stack.capacity >= 100);
+    TEST_ASSERT_TRUE(memory.stack.peak >= 100 * sizeof(float));
+    TEST_ASSERT_TRUE(memory.peak > before);
+
+    // Peaks start over
+    TEST_ASSERT_TRUE(rpn_memory_reset(ctxt));
+    TEST_ASSERT_TRUE(rpn_memory_get(ctxt, memory));
+    TEST_ASSERT_EQUAL(memory.bytes, memory.peak);
+    TEST_ASSERT_EQUAL(memory.stack.bytes, memory.stack.peak);
+
+    // Names are released by rpn_clear, the peak stays
+    before = memory.names.bytes;
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+    TEST_ASSERT_TRUE(rpn_memory_get(ctxt, memory));
+    TEST_ASSERT_EQUAL(0, memory.names.size);
+    TEST_ASSERT_TRUE(memory.names.bytes < before);
+    TEST_ASSERT_EQUAL(before, memory.names.peak);
+
+    // Writers count the variables and names they add themselves, while
+    // the thread evaluating keeps track of the rest
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    TEST_ASSERT_TRUE(rpn_provider_set(ctxt, "sensor*", [](rpn_context &, const char *, float & value) {
+        value = 1;
+        return true;
+    }));
+    std::thread writer([&ctxt]() {
+        char name[16];
+        for (unsigned int i=0; i<500; i++) {
+            snprintf(name, sizeof(name), "v%u", i);
+            rpn_variable_set(ctxt, name, i);
+        }
+    });
+    unsigned int failures = 0;
+    for (unsigned int i=0; i<200; i++) {
+        if (!rpn_process(ctxt, "$sensor1 $sensor2 $sensor3 + + 100 do dup loop depth")) failures++;
+        if (!rpn_stack_clear(ctxt) || !rpn_memory_get(ctxt, memory)) failures++;
+    }
+    writer.join();
+    TEST_ASSERT_EQUAL(0, failures);
+    TEST_ASSERT_TRUE(rpn_memory_get(ctxt, memory));
+    TEST_ASSERT_EQUAL(500, memory.variables.size);
+    TEST_ASSERT_TRUE(memory.variables.bytes >= 500 * sizeof(rpn_variable));
+    TEST_ASSERT_EQUAL(ctxt.operators.size() + 500, memory.names.size);
+    TEST_ASSERT_TRUE(rpn_variables_clear(ctxt));
+    TEST_ASSERT_TRUE(rpn_memory_get(ctxt, memory));
+    TEST_ASSERT_TRUE(memory.variables.peak >= 500 * sizeof(rpn_variable));
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+
+    // Static contexts report their fixed capacities
+    rpn_static_context<8, 4, 64> fixed;
+    TEST_ASSERT_TRUE(rpn_memory_get(fixed, memory));
+    TEST_ASSERT_EQUAL(8, memory.stack.capacity);
+    TEST_ASSERT_EQUAL(4, memory.variables.capacity);
+    TEST_ASSERT_EQUAL(64, memory.operators.capacity);
+    TEST_ASSERT_TRUE(memory.variables.bytes >= 4 * sizeof(rpn_variable));
+    TEST_ASSERT_TRUE(memory.names.bytes >= 12 * (4 + 64));
+
+}
+
+bool _test_double(rpn_context & ctxt) {
+    float a;
+    rpn_stack_pop(ctxt, a);
+    return rpn_stack_push(ctxt, 2 * a);
+}
+
+void test_reset(void) {
+
+    rpn_context ctxt;
+    float value;
+
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    TEST_ASSERT_TRUE(rpn_operator_set(ctxt, "double", 1, _test_double));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "offset", 1));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "scale", 2));
+    TEST_ASSERT_TRUE(rpn_checkpoint(ctxt));
+    size_t names = ctxt.symbols.names.size();
+
+    for (unsigned int request=0; request<3; request++) {
+        char name[16];
+        snprintf(name, sizeof(name), "input%u", request);
+        TEST_ASSERT_TRUE(rpn_variable_set(ctxt, name, 10));
+        TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "offset", request));
+        std::string expression = "$" + std::string(name) + " $scale * $offset + double";
+        TEST_ASSERT_TRUE(rpn_process(ctxt, expression.c_str()));
+        TEST_ASSERT_TRUE(rpn_stack_get(ctxt, 0, value));
+        TEST_ASSERT_EQUAL_FLOAT(2 * (20 + request), value);
+        TEST_ASSERT_TRUE(rpn_reset(ctxt));
+        TEST_ASSERT_EQUAL(0, rpn_stack_size(ctxt));
+        TEST_ASSERT_EQUAL(2, rpn_variables_size(ctxt));
+        TEST_ASSERT_FALSE(rpn_variable_get(ctxt, name, value));
+        TEST_ASSERT_EQUAL(names, ctxt.symbols.names.size());
+    }
+
+    // Lots of names coming and going, the ones before the checkpoint
+    // must still be found
+    for (unsigned int request=0; request<60; request+=3) {
+        for (unsigned int i=0; i<request; i++) {
+            char name[16];
+            snprintf(name, sizeof(name), "r%uv%u", request, i);
+            TEST_ASSERT_TRUE(rpn_variable_set(ctxt, name, i));
+        }
+        TEST_ASSERT_TRUE(rpn_reset(ctxt));
+        TEST_ASSERT_EQUAL(names, ctxt.symbols.names.size());
+    }
+    rpn_program program;
+    for (auto & f : ctxt.operators) {
+        TEST_ASSERT_TRUE(rpn_compile(ctxt, f.name, program));
+    }
+    TEST_ASSERT_TRUE(rpn_program_clear(program));
+    TEST_ASSERT_TRUE(rpn_variable_get(ctxt, "scale", value));
+
+    // Values set since are kept, deleted variables are not brought back
+    TEST_ASSERT_TRUE(rpn_variable_get(ctxt, "offset", value));
+    TEST_ASSERT_EQUAL_FLOAT(2, value);
+    TEST_ASSERT_TRUE(rpn_variable_del(ctxt, "offset"));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "temporary", 3));
+    TEST_ASSERT_TRUE(rpn_reset(ctxt));
+    TEST_ASSERT_EQUAL(1, rpn_variables_size(ctxt));
+    TEST_ASSERT_TRUE(rpn_variable_get(ctxt, "scale", value));
+
+    // Operators, words and providers added since are dropped too,
+    // the ones before the checkpoint stay
+    TEST_ASSERT_TRUE(rpn_word_set(ctxt, "quad", "double double"));
+    TEST_ASSERT_TRUE(rpn_checkpoint(ctxt));
+    size_t operators = ctxt.operators.size();
+    names = ctxt.symbols.names.size();
+    TEST_ASSERT_TRUE(rpn_operator_set(ctxt, "twice", 1, _test_double));
+    TEST_ASSERT_TRUE(rpn_word_set(ctxt, "octo", "quad twice"));
+    TEST_ASSERT_TRUE(rpn_provider_set(ctxt, "sensor*", [](rpn_context &, const char *, float & value) {
+        value = 5;
+        return true;
+    }));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "$sensor1 octo"));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(40, value);
+    TEST_ASSERT_TRUE(rpn_reset(ctxt));
+    TEST_ASSERT_EQUAL(operators, ctxt.operators.size());
+    TEST_ASSERT_EQUAL(1, ctxt.words.size());
+    TEST_ASSERT_EQUAL(0, ctxt.providers.size());
+    TEST_ASSERT_EQUAL(names, ctxt.symbols.names.size());
+    TEST_ASSERT_FALSE(rpn_process(ctxt, "2 twice"));
+    TEST_ASSERT_FALSE(rpn_process(ctxt, "2 octo"));
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+    TEST_ASSERT_FALSE(rpn_process(ctxt, "$sensor1", true));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "2 quad"));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(8, value);
+
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+
+}
+
+bool _test_pool_setup(rpn_context & ctxt) {
+    return rpn_operator_set(ctxt, "double", 1, _test_double)
+        && rpn_variable_set(ctxt, "scale", 2);
+}
+
+void test_pool(void) {
+
+    rpn_pool pool;
+    float value;
+
+    TEST_ASSERT_TRUE(rpn_pool_init(pool, 2, _test_pool_setup));
+    TEST_ASSERT_EQUAL(2, rpn_pool_available(pool));
+
+    rpn_context * a = rpn_pool_acquire(pool);
+    rpn_context * b = rpn_pool_acquire(pool);
+    rpn_context * c = rpn_pool_acquire(pool);
+    TEST_ASSERT_TRUE(a && b && c);
+    TEST_ASSERT_TRUE((a != b) && (b != c) && (a != c));
+    TEST_ASSERT_EQUAL(0, rpn_pool_available(pool));
+
+    TEST_ASSERT_TRUE(rpn_variable_set(*c, "input", 5));
+    TEST_ASSERT_TRUE(rpn_process(*c, "$input $scale * double"));
+    TEST_ASSERT_TRUE(rpn_stack_pop(*c, value));
+    TEST_ASSERT_EQUAL_FLOAT(20, value);
+    TEST_ASSERT_TRUE(rpn_process(*c, "1"));
+
+    TEST_ASSERT_TRUE(rpn_pool_release(pool, a));
+    TEST_ASSERT_TRUE(rpn_pool_release(pool, b));
+    TEST_ASSERT_TRUE(rpn_pool_release(pool, c));
+    TEST_ASSERT_EQUAL(3, rpn_pool_available(pool));
+
+    // Handed out clean
+    rpn_context * d = rpn_pool_acquire(pool);
+    TEST_ASSERT_TRUE(d == c);
+    TEST_ASSERT_EQUAL(0, rpn_stack_size(*d));
+    TEST_ASSERT_FALSE(rpn_variable_get(*d, "input", value));
+    TEST_ASSERT_TRUE(rpn_pool_release(pool, d));
+
+    // Shared between threads
+    std::vector<std::thread> threads;
+    std::atomic<unsigned long> failures {0};
+    for (unsigned int t=0; t<4; t++) {
+        threads.emplace_back([&pool, &failures, t]() {
+            for (unsigned int i=0; i<1000; i++) {
+                rpn_context * ctxt = rpn_pool_acquire(pool);
+                float result = 0;
+                bool ok = ctxt && rpn_variable_set(*ctxt, "input", t)
+                    && rpn_process(*ctxt, "$input $scale * double")
+                    && rpn_stack_pop(*ctxt, result)
+                    && (4 * t == result);
+                if (!ok) failures++;
+                rpn_pool_release(pool, ctxt);
+            }
+        });
+    }
+    for (auto & thread : threads) thread.join();
+    TEST_ASSERT_EQUAL(0, failures.load());
+    TEST_ASSERT_TRUE(rpn_pool_available(pool) <= 7);
+
+    TEST_ASSERT_TRUE(rpn_pool_clear(pool));
+    TEST_ASSERT_EQUAL(0, rpn_pool_available(pool));
+
+    // Contexts still held are cleared with the pool
+    {
+        rpn_pool scoped;
+        TEST_ASSERT_TRUE(rpn_pool_init(scoped, 1, _test_pool_setup));
+        rpn_context * held = rpn_pool_acquire(scoped);
+        TEST_ASSERT_TRUE(held && rpn_variable_set(*held, "input", 1));
+    }
+
+}
+
+void test_fork(void) {
+
+    rpn_context parent;
+    float value;
+
+    TEST_ASSERT_TRUE(rpn_init(parent));
+    TEST_ASSERT_TRUE(rpn_operator_set(parent, "double", 1, _test_double));
+    TEST_ASSERT_TRUE(rpn_variable_set(parent, "temperature", 20));
+    TEST_ASSERT_TRUE(rpn_variable_set(parent, "humidity", 50));
+    size_t names = parent.symbols.names.size();
+
+    rpn_program program;
+    TEST_ASSERT_TRUE(rpn_compile(parent, "$temperature $humidity + double", program));
+
+    // Overrides stay in the fork
+    rpn_context fork;
+    TEST_ASSERT_TRUE(rpn_fork(parent, fork));
+    TEST_ASSERT_TRUE(rpn_variable_set(fork, "temperature", 25));
+    TEST_ASSERT_TRUE(rpn_variable_set(fork, "wind", 3));
+    TEST_ASSERT_TRUE(rpn_process(fork, "$temperature $humidity + $wind + double"));
+    TEST_ASSERT_TRUE(rpn_stack_pop(fork, value));
+    TEST_ASSERT_EQUAL_FLOAT(156, value);
+    TEST_ASSERT_TRUE(rpn_execute(fork, program));
+    TEST_ASSERT_TRUE(rpn_stack_pop(fork, value));
+    TEST_ASSERT_EQUAL_FLOAT(150, value);
+    TEST_ASSERT_EQUAL(2, rpn_variables_size(fork));
+
+    TEST_ASSERT_TRUE(rpn_variable_get(parent, "temperature", value));
+    TEST_ASSERT_EQUAL_FLOAT(20, value);
+    TEST_ASSERT_FALSE(rpn_variable_get(parent, "wind", value));
+    TEST_ASSERT_EQUAL(names, parent.symbols.names.size());
+    TEST_ASSERT_EQUAL(2, rpn_variables_size(parent));
+
+    // Deleting the override shows the parent value again
+    TEST_ASSERT_TRUE(rpn_variable_del(fork, "temperature"));
+    TEST_ASSERT_TRUE(rpn_variable_get(fork, "temperature", value));
+    TEST_ASSERT_EQUAL_FLOAT(20, value);
+    TEST_ASSERT_FALSE(rpn_variable_del(fork, "humidity"));
+
+    // Operators are shared and read only
+    TEST_ASSERT_FALSE(rpn_operator_set(fork, "triple", 1, _test_double));
+    TEST_ASSERT_EQUAL(RPN_ERROR_OUT_OF_MEMORY, rpn_error);
+
+    // Forks of forks
+    rpn_context grandchild;
+    TEST_ASSERT_TRUE(rpn_fork(fork, grandchild));
+    TEST_ASSERT_TRUE(rpn_variable_set(grandchild, "humidity", 60));
+    TEST_ASSERT_TRUE(rpn_process(grandchild, "$temperature $humidity + $wind + double"));
+    TEST_ASSERT_TRUE(rpn_stack_pop(grandchild, value));
+    TEST_ASSERT_EQUAL_FLOAT(166, value);
+    TEST_ASSERT_TRUE(rpn_clear(grandchild));
+    TEST_ASSERT_TRUE(rpn_clear(fork));
+
+    // What if, from many threads
+    const unsigned int scenarios = 121;
+    std::vector<float> results(scenarios, 0);
+    std::vector<std::thread> threads;
+    for (unsigned int t=0; t<4; t++) {
+        threads.emplace_back([&parent, &program, &results, t]() {
+            for (unsigned int i=t; i<scenarios; i+=4) {
+                rpn_context scenario;
+                rpn_fork(parent, scenario);
+                rpn_variable_set(scenario, "temperature", 18 + 0.1 * i);
+                if (rpn_execute(scenario, program)) rpn_stack_pop(scenario, results[i]);
+                rpn_clear(scenario);
+            }
+        });
+    }
+    for (auto & thread : threads) thread.join();
+    for (unsigned int i=0; i<scenarios; i++) {
+        TEST_ASSERT_EQUAL_FLOAT(2 * (18 + 0.1 * i + 50), results[i]);
+    }
+
+    // A cleared fork is a regular context again
+    TEST_ASSERT_TRUE(rpn_init(fork));
+    TEST_ASSERT_TRUE(rpn_process(fork, "2 3 +"));
+    TEST_ASSERT_TRUE(rpn_clear(fork));
+
+    TEST_ASSERT_TRUE(rpn_program_clear(program));
+    TEST_ASSERT_TRUE(rpn_clear(parent));
+
+}
+
+void test_many_variables(void) {
+
+    rpn_context ctxt;
+    char name[16];
+    float value;
+
+    // Well past what an unsigned char could count
+    const size_t count = 20000;
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    for (size_t i=0; i<count; i++) {
+        snprintf(name, sizeof(name), "v%zu", i);
+        TEST_ASSERT_TRUE(rpn_variable_set(ctxt, name, i));
+    }
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "v0", -1));
+    TEST_ASSERT_EQUAL(count, rpn_variables_size(ctxt));
+    TEST_ASSERT_TRUE(rpn_variable_get(ctxt, "v19999", value));
+    TEST_ASSERT_EQUAL_FLOAT(19999, value);
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "$v0 $v12345 +", true));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(12344, value);
+
+    // Enumeration keeps the order variables were first set in
+    TEST_ASSERT_TRUE(rpn_variable_del(ctxt, "v300"));
+    TEST_ASSERT_FALSE(rpn_variable_get(ctxt, "v300", value));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "v300", 300));
+    TEST_ASSERT_EQUAL(0, strcmp("v299", rpn_variable_name(ctxt, 299)));
+    TEST_ASSERT_EQUAL(0, strcmp("v301", rpn_variable_name(ctxt, 300)));
+    TEST_ASSERT_EQUAL(0, strcmp("v300", rpn_variable_name(ctxt, count - 1)));
+    TEST_ASSERT_TRUE(NULL == rpn_variable_name(ctxt, count));
+    TEST_ASSERT_TRUE(rpn_variable_get(ctxt, "v19999", value));
+    TEST_ASSERT_EQUAL_FLOAT(19999, value);
+
+    // Dropping a few or most of them on reset
+    TEST_ASSERT_TRUE(rpn_variables_clear(ctxt));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "kept", 1));
+    TEST_ASSERT_TRUE(rpn_checkpoint(ctxt));
+    for (size_t round : {(size_t) 3, count}) {
+        for (size_t i=0; i<round; i++) {
+            snprintf(name, sizeof(name), "r%zu", i);
+            TEST_ASSERT_TRUE(rpn_variable_set(ctxt, name, i));
+        }
+        TEST_ASSERT_TRUE(rpn_reset(ctxt));
+        TEST_ASSERT_EQUAL(1, rpn_variables_size(ctxt));
+        TEST_ASSERT_FALSE(rpn_variable_get(ctxt, "r0", value));
+        TEST_ASSERT_TRUE(rpn_variable_get(ctxt, "kept", value));
+    }
+
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+
+}
+
+void test_bulk_update(void) {
+
+    rpn_context ctxt;
+    float value;
+
+    // New and existing variables, published as one update
+    const char * names[] = {"temperature", "humidity", "pressure"};
+    const float values[] = {21, 55, 1013};
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "humidity", 50));
+    TEST_ASSERT_TRUE(rpn_snapshot_acquire(ctxt));
+    TEST_ASSERT_TRUE(rpn_variables_set_many(ctxt, names, values, 3));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "$humidity"));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(50, value);
+    TEST_ASSERT_FALSE(rpn_variable_get(ctxt, "temperature", value));
+    TEST_ASSERT_TRUE(rpn_snapshot_release(ctxt));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "$temperature $humidity $pressure + +"));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(1089, value);
+    TEST_ASSERT_EQUAL(3, rpn_variables_size(ctxt));
+
+    // Handles skip the lookup and notice when they go stale
+    rpn_variable_handle handles[3];
+    for (unsigned int i=0; i<3; i++) {
+        TEST_ASSERT_TRUE(rpn_variable_resolve(ctxt, names[i], handles[i]));
+    }
+    TEST_ASSERT_FALSE(rpn_variable_resolve(ctxt, "wind", handles[0]));
+    const float update[] = {22, 60, 1000};
+    TEST_ASSERT_TRUE(rpn_variables_set_many(ctxt, handles, update, 3));
+    TEST_ASSERT_TRUE(rpn_variable_get(ctxt, "pressure", value));
+    TEST_ASSERT_EQUAL_FLOAT(1000, value);
+    TEST_ASSERT_TRUE(rpn_variable_del(ctxt, "humidity"));
+    TEST_ASSERT_FALSE(rpn_variables_set_many(ctxt, handles, values, 3));
+    TEST_ASSERT_EQUAL(RPN_ERROR_UNVALID_ARGUMENT, rpn_error);
+    TEST_ASSERT_TRUE(rpn_variable_get(ctxt, "temperature", value));
+    TEST_ASSERT_EQUAL_FLOAT(22, value);
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+
+    // A frame of new readings grows storage once, not once per reading
+    const size_t count = 500;
+    std::vector<std::string> storage;
+    std::vector<const char *> frame;
+    std::vector<float> readings(count, 1);
+    for (size_t i=0; i<count; i++) storage.push_back("sensor" + std::to_string(i));
+    for (auto & name : storage) frame.push_back(name.c_str());
+
+    _test_counting_allocator single, many;
+    {
+        rpn_context one(single);
+        for (size_t i=0; i<count; i++) {
+            TEST_ASSERT_TRUE(rpn_variable_set(one, frame[i], readings[i]));
+        }
+        rpn_context all(many);
+        TEST_ASSERT_TRUE(rpn_variables_set_many(all, frame.data(), readings.data(), count));
+        TEST_ASSERT_EQUAL(count, rpn_variables_size(all));
+        TEST_ASSERT_TRUE(rpn_variable_get(all, "sensor499", value));
+        TEST_ASSERT_EQUAL_FLOAT(1, value);
+        TEST_ASSERT_TRUE(many.calls < single.calls);
+        TEST_ASSERT_TRUE(rpn_clear(one));
+        TEST_ASSERT_TRUE(rpn_clear(all));
+    }
+
+    // Static contexts take what fits
+    rpn_static_context<4, 2, 64> fixed;
+    TEST_ASSERT_FALSE(rpn_variables_set_many(fixed, names, values, 3));
+    TEST_ASSERT_EQUAL(RPN_ERROR_OUT_OF_MEMORY, rpn_error);
+    TEST_ASSERT_EQUAL(2, rpn_variables_size(fixed));
+
+}
+
+void test_executor(void) {
+
+    rpn_context ctxt;
+    rpn_ruleset ruleset;
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+
+    // Enough rules for every worker to get some and steal some more
+    const size_t count = 1000;
+    std::string text;
+    for (size_t i=0; i<count; i++) {
+        TEST_ASSERT_TRUE(rpn_variable_set(ctxt, ("s" + std::to_string(i % 10)).c_str(), i % 10));
+        text += "$s" + std::to_string(i % 10) + " " + std::to_string(i) + " +";
+        text += (i % 100 == 99) ? " 0 /\n" : "\n";
+    }
+    TEST_ASSERT_TRUE(rpn_ruleset_compile(ctxt, ruleset, text.c_str(), text.size(), true));
+
+    rpn_executor executor;
+    TEST_ASSERT_TRUE(rpn_executor_init(executor, ctxt, 4));
+    TEST_ASSERT_EQUAL(4, rpn_executor_workers(executor));
+
+    std::vector<float> results(count, -1);
+    std::vector<rpn_errors> errors(count);
+    for (unsigned int run=0; run<3; run++) {
+        TEST_ASSERT_FALSE(rpn_executor_run(executor, ruleset, results.data(), errors.data()));
+        TEST_ASSERT_EQUAL(RPN_ERROR_DIVIDE_BY_ZERO, rpn_error);
+        for (size_t i=0; i<count; i++) {
+            if (i % 100 == 99) {
+                TEST_ASSERT_EQUAL(RPN_ERROR_DIVIDE_BY_ZERO, errors[i]);
+                TEST_ASSERT_EQUAL_FLOAT(0, results[i]);
+            } else {
+                TEST_ASSERT_EQUAL(RPN_ERROR_OK, errors[i]);
+                TEST_ASSERT_EQUAL_FLOAT(i + i % 10, results[i]);
+            }
+        }
+    }
+
+    // Every rule sees the same snapshot while variables keep changing
+    std::string same;
+    for (size_t i=0; i<count; i++) same += "$s0 $s1 -\n";
+    TEST_ASSERT_TRUE(rpn_ruleset_compile(ctxt, ruleset, same.c_str(), same.size(), true));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "s1", 0));
+    // (one update per run at most, fewer than the versions kept, so none expires)
+    std::atomic<bool> stop {false};
+    std::atomic<unsigned int> runs {0};
+    std::thread writer([&ctxt, &stop, &runs]() {
+        unsigned int seen = 0;
+        for (float value = 1; !stop.load(); ) {
+            if (runs.load() == seen) {
+                std::this_thread::yield();
+                continue;
+            }
+            seen = runs.load();
+            const char * names[] = {"s0", "s1"};
+            const float values[] = {value, value};
+            rpn_variables_set_many(ctxt, names, values, 2);
+            value++;
+        }
+    });
+    unsigned int failures = 0;
+    for (unsigned int run=0; run<20; run++) {
+        runs++;
+        if (!rpn_executor_run(executor, ruleset, results.data())) {
+            failures++;
+            continue;
+        }
+        for (auto result : results) {
+            if (0 != result) failures++;
+        }
+    }
+    stop.store(true);
+    writer.join();
+    TEST_ASSERT_EQUAL(0, failures);
+
+    TEST_ASSERT_TRUE(rpn_executor_clear(executor));
+    TEST_ASSERT_EQUAL(0, rpn_executor_workers(executor));
+    TEST_ASSERT_FALSE(rpn_executor_run(executor, ruleset, results.data()));
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+
+}
+
+std::atomic<unsigned int> _test_queue_callbacks {0};
+
+void _test_queue_callback(rpn_request & request) {
+    if ((RPN_ERROR_OK == request.error) && (request.result == *(float *) request.data)) {
+        _test_queue_callbacks++;
+    }
+}
+
+void test_queue(void) {
+
+    rpn_context ctxt;
+    rpn_program program;
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "offset", 100));
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "$input $offset +", program));
+
+    rpn_queue queue;
+    TEST_ASSERT_TRUE(rpn_queue_init(queue, ctxt, 64, 2));
+
+    // Waiting on the request
+    const char * names[] = {"input"};
+    float input = 5;
+    rpn_request request;
+    request.program = &program;
+    request.names = names;
+    request.values = &input;
+    request.count = 1;
+    TEST_ASSERT_TRUE(rpn_queue_submit(queue, request));
+    TEST_ASSERT_TRUE(rpn_request_wait(request));
+    TEST_ASSERT_EQUAL_FLOAT(105, request.result);
+
+    // Inputs are seen by that evaluation only, they neither write
+    // the variables of the context nor publish an epoch
+    unsigned long epoch = ctxt.epoch.load();
+    const char * overriding[] = {"input", "offset"};
+    float inputs_and_offset[] = {1, 2};
+    rpn_request shadowing;
+    shadowing.program = &program;
+    shadowing.names = overriding;
+    shadowing.values = inputs_and_offset;
+    shadowing.count = 2;
+    TEST_ASSERT_TRUE(rpn_queue_submit(queue, shadowing));
+    TEST_ASSERT_TRUE(rpn_request_wait(shadowing));
+    TEST_ASSERT_EQUAL_FLOAT(3, shadowing.result);
+    TEST_ASSERT_TRUE(epoch == ctxt.epoch.load());
+    float offset = 0;
+    TEST_ASSERT_TRUE(rpn_variable_get(ctxt, "offset", offset));
+    TEST_ASSERT_EQUAL_FLOAT(100, offset);
+    TEST_ASSERT_FALSE(rpn_variable_get(ctxt, "input", offset));
+
+    // Inputs do not outlive the request
+    rpn_request bare;
+    bare.program = &program;
+    TEST_ASSERT_TRUE(rpn_queue_submit(queue, bare));
+    TEST_ASSERT_TRUE(rpn_request_wait(bare));
+    TEST_ASSERT_EQUAL_FLOAT(100, bare.result);
+
+    // Idle evaluators are woken up, and any number of threads can wait
+    for (unsigned int round=0; round<20; round++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        const unsigned int waiters = 4;
+        float waited[waiters];
+        rpn_request pending[waiters];
+        std::vector<std::thread> waiting;
+        for (unsigned int w=0; w<waiters; w++) {
+            waited[w] = w;
+            pending[w].program = &program;
+            pending[w].names = names;
+            pending[w].values = &waited[w];
+            pending[w].count = 1;
+            TEST_ASSERT_TRUE(rpn_queue_submit(queue, pending[w]));
+            waiting.emplace_back([&pending, w]() {
+                rpn_request_wait(pending[w]);
+            });
+        }
+        for (auto & thread : waiting) thread.join();
+        for (unsigned int w=0; w<waiters; w++) {
+            TEST_ASSERT_TRUE(pending[w].done.load());
+            TEST_ASSERT_EQUAL_FLOAT(100 + w, pending[w].result);
+        }
+    }
+
+    // Many producers with callbacks, some of them with the same inputs
+    const unsigned int producers = 4;
+    const unsigned int count = 500;
+    std::vector<float> inputs(producers * count);
+    std::vector<float> expected(producers * count);
+    std::vector<rpn_request> requests(producers * count);
+    for (size_t i=0; i<requests.size(); i++) {
+        inputs[i] = i % 7;
+        expected[i] = 100 + inputs[i];
+        requests[i].program = &program;
+        requests[i].names = names;
+        requests[i].values = &inputs[i];
+        requests[i].count = 1;
+        requests[i].callback = _test_queue_callback;
+        requests[i].data = &expected[i];
+    }
+    std::vector<std::thread> threads;
+    for (unsigned int p=0; p<producers; p++) {
+        threads.emplace_back([&queue, &requests, p, count]() {
+            for (unsigned int i=0; i<count; i++) {
+                while (!rpn_queue_submit(queue, requests[p * count + i])) std::this_thread::yield();
+            }
+        });
+    }
+    for (auto & thread : threads) thread.join();
+    for (auto & request : requests) {
+        while (!request.done.load()) std::this_thread::yield();
+    }
+    TEST_ASSERT_EQUAL(producers * count, _test_queue_callbacks.load());
+
+    // Errors come back with the request
+    rpn_program wrong;
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "1 0 /", wrong));
+    rpn_request failing;
+    failing.program = &wrong;
+    TEST_ASSERT_TRUE(rpn_queue_submit(queue, failing));
+    TEST_ASSERT_FALSE(rpn_request_wait(failing));
+    TEST_ASSERT_EQUAL(RPN_ERROR_DIVIDE_BY_ZERO, rpn_error);
+
+    // Submissions racing with clearing are either evaluated or rejected
+    std::vector<rpn_request> racing(producers * 100);
+    std::vector<char> accepted(racing.size(), 0);
+    for (auto & request : racing) request.program = &program;
+    threads.clear();
+    for (unsigned int p=0; p<producers; p++) {
+        threads.emplace_back([&queue, &racing, &accepted, p]() {
+            for (unsigned int i=0; i<100; i++) {
+                accepted[p * 100 + i] = rpn_queue_submit(queue, racing[p * 100 + i]);
+            }
+        });
+    }
+    TEST_ASSERT_TRUE(rpn_queue_clear(queue));
+    for (auto & thread : threads) thread.join();
+    for (size_t i=0; i<racing.size(); i++) {
+        TEST_ASSERT_TRUE(racing[i].done.load());
+        TEST_ASSERT_EQUAL(accepted[i] ? RPN_ERROR_OK : RPN_ERROR_OUT_OF_MEMORY, racing[i].error);
+        TEST_ASSERT_EQUAL(accepted[i] != 0, rpn_request_wait(racing[i]));
+        if (accepted[i]) TEST_ASSERT_EQUAL_FLOAT(100, racing[i].result);
+    }
+
+    // Nothing is taken once cleared
+    TEST_ASSERT_TRUE(rpn_queue_clear(queue));
+    TEST_ASSERT_FALSE(rpn_queue_submit(queue, request));
+    TEST_ASSERT_EQUAL(RPN_ERROR_OUT_OF_MEMORY, rpn_error);
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+
+}
+
+unsigned int _test_provider_calls = 0;
+
+bool _test_provider_sensor(rpn_context &, const char * name, float & value) {
+    _test_provider_calls++;
+    if (strcmp(name, "sensor.missing") == 0) return false;
+    value = strlen(name);
+    return true;
+}
+
+bool _test_provider_pressure(rpn_context &, const char *, float & value) {
+    _test_provider_calls++;
+    value = 1013;
+    return true;
+}
+
+void test_providers(void) {
+
+    rpn_context ctxt;
+    float value;
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    TEST_ASSERT_TRUE(rpn_provider_set(ctxt, "sensor.*", _test_provider_sensor));
+    TEST_ASSERT_TRUE(rpn_provider_set(ctxt, "sensor.pressure", _test_provider_pressure));
+
+    // Fetched once per evaluation, exact names first
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "$sensor.abc $sensor.abc + $sensor.pressure +"));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(1033, value);
+    TEST_ASSERT_EQUAL(2, _test_provider_calls);
+
+    // Stored values win, misses are cached as well
+    _test_provider_calls = 0;
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "sensor.abc", 1));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "$sensor.abc $sensor.missing $sensor.missing + +"));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(1, value);
+    TEST_ASSERT_EQUAL(1, _test_provider_calls);
+    TEST_ASSERT_FALSE(rpn_process(ctxt, "$sensor.missing", true));
+    TEST_ASSERT_EQUAL(RPN_ERROR_UNKNOWN_TOKEN, rpn_error);
+    TEST_ASSERT_FALSE(rpn_process(ctxt, "$other", true));
+
+    // Compiled programs and forks ask them too
+    rpn_program program;
+    _test_provider_calls = 0;
+    TEST_ASSERT_TRUE(rpn_compile(ctxt, "$sensor.xy $sensor.xy *", program, true));
+    rpn_context fork;
+    TEST_ASSERT_TRUE(rpn_fork(ctxt, fork));
+    TEST_ASSERT_TRUE(rpn_execute(fork, program));
+    TEST_ASSERT_TRUE(rpn_stack_pop(fork, value));
+    TEST_ASSERT_EQUAL_FLOAT(81, value);
+    TEST_ASSERT_EQUAL(1, _test_provider_calls);
+    TEST_ASSERT_TRUE(rpn_clear(fork));
+
+    // Outside of an evaluation they are asked every time
+    _test_provider_calls = 0;
+    TEST_ASSERT_TRUE(rpn_variable_get(ctxt, "sensor.pressure", value));
+    TEST_ASSERT_TRUE(rpn_variable_get(ctxt, "sensor.pressure", value));
+    TEST_ASSERT_EQUAL(2, _test_provider_calls);
+
+    TEST_ASSERT_TRUE(rpn_provider_del(ctxt, "sensor.pressure"));
+    TEST_ASSERT_FALSE(rpn_provider_del(ctxt, "sensor.pressure"));
+    TEST_ASSERT_TRUE(rpn_variable_get(ctxt, "sensor.pressure", value));
+    TEST_ASSERT_EQUAL_FLOAT(15, value);
+    TEST_ASSERT_TRUE(rpn_providers_clear(ctxt));
+    TEST_ASSERT_FALSE(rpn_variable_get(ctxt, "sensor.pressure", value));
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+
+}
+
+void test_concurrent_variables(void) {
+
+    rpn_context parent;
+    TEST_ASSERT_TRUE(rpn_init(parent));
+    TEST_ASSERT_TRUE(rpn_variable_set(parent, "temperature", 1));
+
+    // Sensors flip a value and keep adding variables (growing every table)
+    // while evaluators read them through their forks
+    const float values[2] = {1, -2.5e10};
+    const unsigned int sensors = 2, added = 2000;
+    std::atomic<bool> done {false};
+    std::atomic<unsigned int> failures {0}, evaluations {0}, expired {0};
+    std::vector<std::thread> threads;
+
+    for (unsigned int t=0; t<sensors; t++) {
+        threads.emplace_back([&parent, &values, t]() {
+            char name[16];
+            for (unsigned int i=0; i<added; i++) {
+                rpn_variable_set(parent, "temperature", values[i & 1]);
+                snprintf(name, sizeof(name), "sensor%u", (i + t * added / 2) % added);
+                rpn_variable_set(parent, name, i);
+            }
+        });
+    }
+    for (unsigned int t=0; t<4; t++) {
+        threads.emplace_back([&parent, &values, &done, &failures, &evaluations, &expired]() {
+            rpn_context fork;
+            float value;
+            rpn_fork(parent, fork);
+            while (!done.load()) {
+                evaluations += 2;
+                bool valid = rpn_process(fork, "$temperature") && rpn_stack_pop(fork, value);
+                if (!valid && (RPN_ERROR_SNAPSHOT_EXPIRED == rpn_error)) {
+                    expired++;
+                } else if (!valid || ((value != values[0]) && (value != values[1]))) {
+                    failures++;
+                }
+                if (rpn_variable_get(fork, "sensor100", value) && (value >= added)) failures++;
+                if (!rpn_process(fork, "$sensor1999 0 +")) {
+                    if (RPN_ERROR_SNAPSHOT_EXPIRED == rpn_error) expired++;
+                    else failures++;
+                }
+                rpn_stack_clear(fork);
+            }
+            rpn_clear(fork);
+        });
+    }
+    for (unsigned int t=0; t<sensors; t++) threads[t].join();
+    done = true;
+    for (auto & thread : threads) {
+        if (thread.joinable()) thread.join();
+    }
+
+    // Expired snapshots are retried, so hardly any evaluation fails
+    TEST_ASSERT_EQUAL(0, failures.load());
+    TEST_ASSERT_TRUE(expired.load() * 100 <= evaluations.load());
+
+    // Each name was added just once
+    TEST_ASSERT_EQUAL(added + 1, parent.variables.size());
+    float value;
+    TEST_ASSERT_TRUE(rpn_variable_get(parent, "sensor1999", value));
+    TEST_ASSERT_TRUE(rpn_clear(parent));
+
+}
+
+void test_snapshot(void) {
+
+    rpn_context ctxt;
+    float value;
+
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "a", 1));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "b", 1));
+
+    // Updates after the snapshot are not seen until it is released
+    TEST_ASSERT_TRUE(rpn_snapshot_acquire(ctxt));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "a", 2));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "c", 3));
+    TEST_ASSERT_TRUE(rpn_variable_get(ctxt, "a", value));
+    TEST_ASSERT_EQUAL_FLOAT(1, value);
+    TEST_ASSERT_FALSE(rpn_variable_get(ctxt, "c", value));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "$a $b +"));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(2, value);
+
+    // Until the version it needs is rewritten
+    for (unsigned int i=0; i<RPNLIB_VARIABLE_VERSIONS; i++) {
+        TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "b", 10 + i));
+    }
+    TEST_ASSERT_FALSE(rpn_process(ctxt, "$a $b +"));
+    TEST_ASSERT_EQUAL(RPN_ERROR_SNAPSHOT_EXPIRED, rpn_error);
+    TEST_ASSERT_TRUE(rpn_snapshot_release(ctxt));
+    TEST_ASSERT_FALSE(rpn_snapshot_release(ctxt));
+
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "$a $c +"));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(5, value);
+
+    // Evaluations pinning their own snapshot on an empty stack run again
+    static unsigned int bumps, calls;
+    bumps = 1;
+    calls = 0;
+    TEST_ASSERT_TRUE(rpn_operator_set(ctxt, "bump", 0, [](rpn_context & ctxt) {
+        calls++;
+        if (bumps) {
+            bumps--;
+            for (unsigned int i=0; i<RPNLIB_VARIABLE_VERSIONS; i++) {
+                rpn_variable_set(ctxt, "c", 20 + i);
+            }
+        }
+        return true;
+    }, 0));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "$c bump $c +"));
+    TEST_ASSERT_EQUAL(2, calls);
+    TEST_ASSERT_EQUAL(1, rpn_stack_size(ctxt));
+    TEST_ASSERT_TRUE(rpn_stack_pop(ctxt, value));
+    TEST_ASSERT_EQUAL_FLOAT(2 * (20 + RPNLIB_VARIABLE_VERSIONS - 1), value);
+
+    // A bounded number of times
+    bumps = RPNLIB_SNAPSHOT_RETRIES + 1;
+    calls = 0;
+    TEST_ASSERT_FALSE(rpn_process(ctxt, "$c bump $c +"));
+    TEST_ASSERT_EQUAL(RPN_ERROR_SNAPSHOT_EXPIRED, rpn_error);
+    TEST_ASSERT_EQUAL(RPNLIB_SNAPSHOT_RETRIES + 1, calls);
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+
+    // But not on values that were already there
+    bumps = 1;
+    calls = 0;
+    TEST_ASSERT_TRUE(rpn_stack_push(ctxt, 1));
+    TEST_ASSERT_FALSE(rpn_process(ctxt, "$c bump $c +"));
+    TEST_ASSERT_EQUAL(RPN_ERROR_SNAPSHOT_EXPIRED, rpn_error);
+    TEST_ASSERT_EQUAL(1, calls);
+    TEST_ASSERT_TRUE(rpn_stack_clear(ctxt));
+
+    // a is always updated before b, evaluations never see b ahead of a
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "b", 2));
+    rpn_context fork;
+    rpn_program program;
+    TEST_ASSERT_TRUE(rpn_fork(ctxt, fork));
+    TEST_ASSERT_TRUE(rpn_compile(fork, "$a $b ge", program));
+    std::atomic<bool> done {false};
+    std::atomic<unsigned int> failures {0};
+    std::thread reader([&fork, &program, &done, &failures]() {
+        float result;
+        while (!done.load()) {
+            if (rpn_execute(fork, program) && rpn_stack_pop(fork, result) && (result != 1)) failures++;
+            if (rpn_process(fork, "$a $b ge") && rpn_stack_pop(fork, result) && (result != 1)) failures++;
+            rpn_stack_clear(fork);
+        }
+    });
+    for (unsigned int i=20; i<20000; i++) {
+        rpn_variable_set(ctxt, "a", i);
+        rpn_variable_set(ctxt, "b", i);
+    }
+    done = true;
+    reader.join();
+    TEST_ASSERT_EQUAL(0, failures.load());
+
+    TEST_ASSERT_TRUE(rpn_program_clear(program));
+    TEST_ASSERT_TRUE(rpn_clear(fork));
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+
+}
+
+#ifdef RPNLIB_TRACE
+
+void test_trace(void) {
+
+    rpn_context ctxt;
+    rpn_trace_buffer buffer;
+    rpn_trace_event event;
+    char line[64];
+
+    TEST_ASSERT_TRUE(rpn_init(ctxt));
+    TEST_ASSERT_TRUE(rpn_variable_set(ctxt, "tmp", 25));
+    TEST_ASSERT_TRUE(rpn_trace(ctxt, &buffer));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "$tmp 5 /"));
+    TEST_ASSERT_FALSE(rpn_process(ctxt, "0 /"));
+
+    TEST_ASSERT_EQUAL(5, rpn_trace_size(buffer));
+    TEST_ASSERT_TRUE(rpn_trace_get(buffer, 0, event));
+    TEST_ASSERT_EQUAL(RPN_TRACE_VARIABLE, event.opcode);
+    TEST_ASSERT_EQUAL(1, event.depth);
+    TEST_ASSERT_EQUAL_FLOAT(25, event.top);
+    TEST_ASSERT_TRUE(rpn_trace_get(buffer, 2, event));
+    TEST_ASSERT_EQUAL(1, event.depth);
+    TEST_ASSERT_EQUAL_FLOAT(5, event.top);
+    TEST_ASSERT_TRUE(rpn_trace_format(ctxt, event, event.timestamp, line, sizeof(line)) > 0);
+    TEST_ASSERT_TRUE(strstr(line, "/") != NULL);
+    TEST_ASSERT_TRUE(rpn_trace_get(buffer, 4, event));
+    TEST_ASSERT_EQUAL(RPN_TRACE_ERROR, event.opcode);
+    TEST_ASSERT_EQUAL_FLOAT(RPN_ERROR_DIVIDE_BY_ZERO, event.top);
+    TEST_ASSERT_FALSE(rpn_trace_get(buffer, 5, event));
+
+    // Ring buffer keeps the newest events
+    for (unsigned int i=0; i<RPNLIB_TRACE_SIZE; i++) {
+        TEST_ASSERT_TRUE(rpn_process(ctxt, "1"));
+    }
+    TEST_ASSERT_EQUAL(RPNLIB_TRACE_SIZE, rpn_trace_size(buffer));
+    TEST_ASSERT_TRUE(rpn_trace_get(buffer, RPNLIB_TRACE_SIZE - 1, event));
+    TEST_ASSERT_EQUAL(RPN_TRACE_NUMBER, event.opcode);
+
+    TEST_ASSERT_TRUE(rpn_trace_clear(buffer));
+    TEST_ASSERT_EQUAL(0, rpn_trace_size(buffer));
+    TEST_ASSERT_TRUE(rpn_trace(ctxt, NULL));
+    TEST_ASSERT_TRUE(rpn_process(ctxt, "1"));
+    TEST_ASSERT_EQUAL(0, rpn_trace_size(buffer));
+    TEST_ASSERT_TRUE(rpn_clear(ctxt));
+
+}
+
+#endif
+
+// -----------------------------------------------------------------------------
+// Main
+// -----------------------------------------------------------------------------
+
+int main(void) {
+    RUN_TEST(test_math);
+    RUN_TEST(test_math_advanced);
+    RUN_TEST(test_trig);
+    RUN_TEST(test_cast);
+    RUN_TEST(test_map);
+    RUN_TEST(test_index);
+    RUN_TEST(test_cmp3_below);
+    RUN_TEST(test_cmp3_between);
+    RUN_TEST(test_cmp3_above);
+    RUN_TEST(test_conditional);
+    RUN_TEST(test_stack);
+    RUN_TEST(test_stack_bulk);
+    RUN_TEST(test_logic);
+    RUN_TEST(test_boolean);
+    RUN_TEST(test_variable);
+    RUN_TEST(test_variable_must_exist);
+    RUN_TEST(test_custom_operator);
+    RUN_TEST(test_error_divide_by_zero);
+    RUN_TEST(test_error_argument_count_mismatch);
+    RUN_TEST(test_error_unknown_token);
+    RUN_TEST(test_profile);
+    RUN_TEST(test_histogram);
+    RUN_TEST(test_program);
+    RUN_TEST(test_budget);
+    RUN_TEST(test_control_flow);
+    RUN_TEST(test_words);
+    RUN_TEST(test_ruleset);
+    RUN_TEST(test_ruleset_shared);
+    RUN_TEST(test_symbols);
+    RUN_TEST(test_static_context);
+    RUN_TEST(test_allocator);
+    RUN_TEST(test_memory);
+    RUN_TEST(test_reset);
+    RUN_TEST(test_pool);
+    RUN_TEST(test_fork);
+    RUN_TEST(test_many_variables);
+    RUN_TEST(test_bulk_update);
+    RUN_TEST(test_executor);
+    RUN_TEST(test_queue);
+    RUN_TEST(test_providers);
+    RUN_TEST(test_concurrent_variables);
+    RUN_TEST(test_snapshot);
+    #ifdef RPNLIB_TRACE
+    RUN_TEST(test_trace);
+    #endif
+    printf("\n%u Tests %u Failures\n", _tests_run, _tests_failed);
+    return (0 == _tests_failed) ? 0 : 1;
+}